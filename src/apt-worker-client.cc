@@ -45,6 +45,15 @@
 
 #define APT_WORKER_CMD_DEFAULT "/usr/libexec/apt-worker"
 
+/* The shared memory file for the response ring.  When it can't be
+   created, all responses go through the fifo.
+*/
+#define APT_WORKER_RING "/dev/shm/apt-worker.ring"
+
+/* Streamed package lists arrive in pieces of roughly this size.
+ */
+#define PACKAGE_LIST_CHUNK_SIZE (32*1024)
+
 int apt_worker_out_fd = -1;
 int apt_worker_in_fd = -1;
 int apt_worker_cancel_fd = -1;
@@ -189,6 +198,8 @@ add_apt_worker_handler ()
   g_io_channel_unref (channel);
 }
 
+static void reset_response_reader ();
+
 static void
 notice_apt_worker_failure ()
 {
@@ -202,11 +213,41 @@ notice_apt_worker_failure ()
   apt_worker_out_fd = -1;
   apt_worker_cancel_fd = -1;
 
+  reset_response_reader ();
   cancel_all_pending_worker_calls ();
 
   what_the_fock_p ();
 }
 
+static apt_proto_ring response_ring;
+
+static bool
+create_response_ring ()
+{
+  int fd;
+
+  if (unlink (APT_WORKER_RING) < 0 && errno != ENOENT)
+    log_perror (APT_WORKER_RING);
+
+  fd = open (APT_WORKER_RING, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0)
+    {
+      log_perror (APT_WORKER_RING);
+      return false;
+    }
+
+  if (!response_ring.create (fd))
+    {
+      add_log ("can't set up response ring, using fifo only.\n");
+      unlink (APT_WORKER_RING);
+      close (fd);
+      return false;
+    }
+
+  close (fd);
+  return true;
+}
+
 static void
 apt_worker_watch (GPid pid, int status, gpointer data)
 {
@@ -258,11 +299,14 @@ start_apt_worker (void)
 
   const char *options = backend_options ();
 
+  const char *ring = create_response_ring () ? APT_WORKER_RING : NULL;
+
   const char *args[] = {
     sudo, prog, "backend",
     "/tmp/apt-worker.to", "/tmp/apt-worker.from",
     "/tmp/apt-worker.status", "/tmp/apt-worker.cancel",
     options,
+    ring,
     NULL
   };
 
@@ -285,8 +329,11 @@ start_apt_worker (void)
 
   g_child_watch_add (apt_worker_pid, apt_worker_watch, NULL);
 
-  apt_worker_in_fd = must_open_nonblock ("/tmp/apt-worker.from",
-					 O_RDONLY);
+  /* Responses are read incrementally from the main loop, see
+     handle_one_apt_worker_response, so the input stays non-blocking.
+  */
+  apt_worker_in_fd = must_open ("/tmp/apt-worker.from",
+				O_RDONLY | O_NONBLOCK);
   apt_worker_status_fd = must_open_nonblock ("/tmp/apt-worker.status", 
 					     O_RDONLY);
   if (apt_worker_in_fd < 0 || apt_worker_status_fd < 0)
@@ -314,6 +361,8 @@ finish_apt_worker_startup ()
   must_unlink ("/tmp/apt-worker.from");
   must_unlink ("/tmp/apt-worker.status");
   must_unlink ("/tmp/apt-worker.cancel");
+  if (response_ring.is_attached ())
+    must_unlink (APT_WORKER_RING);
 
   apt_worker_ready = TRUE;
 
@@ -350,6 +399,34 @@ apt_status_callback (int cmd, apt_proto_decoder *dec, void *unused)
     }
 }
 
+/* The encoding of the responses, as agreed upon with SET_ENCODING.
+ */
+static int response_encoding = encoding_classic;
+
+static void
+set_encoding_reply (int cmd, apt_proto_decoder *dec, void *unused)
+{
+  if (dec == NULL)
+    return;
+
+  /* This takes effect with the next response.
+   */
+  int encoding = dec->decode_int ();
+  if (!dec->corrupted ())
+    response_encoding = encoding;
+}
+
+static void
+apt_worker_set_encoding (int encoding)
+{
+  apt_proto_encoder request;
+
+  request.encode_int (encoding);
+  call_apt_worker (APTCMD_SET_ENCODING,
+		   request.get_buf (), request.get_len (),
+		   set_encoding_reply, NULL);
+}
+
 void
 maybe_start_apt_worker (void)
 {
@@ -364,6 +441,11 @@ maybe_start_apt_worker (void)
 
   /* Everything went fine if reached */
   apt_worker_set_status_callback (apt_status_callback, NULL);
+
+  /* This is the first request for the new apt-worker.
+   */
+  response_encoding = encoding_classic;
+  apt_worker_set_encoding (encoding_compact);
 }
 
 void
@@ -377,28 +459,32 @@ cancel_apt_worker ()
     }
 }
 
-static bool
-must_read (void *buf, size_t n)
+/* Read up to N bytes from APT_WORKER_IN_FD, which is in non-blocking
+   mode.  Returns the number of bytes read, which is zero when nothing
+   is available right now, or -1 when apt-worker has gone away.
+*/
+static int
+read_some (void *buf, size_t n)
 {
   int r;
 
-  while (n > 0)
+  do
+    r = read (apt_worker_in_fd, buf, n);
+  while (r < 0 && errno == EINTR);
+
+  if (r < 0)
     {
-      r = read (apt_worker_in_fd, buf, n);
-      if (r < 0)
-	{
-	  log_perror ("read");
-	  return false;
-	}
-      else if (r == 0)
-	{
-	  add_log ("apt-worker closed connection.\n");
-	  return false;
-	}
-      n -= r;
-      buf = ((char *)buf) + r;
+      if (errno == EAGAIN)
+	return 0;
+      log_perror ("read");
+      return -1;
     }
-  return true;
+  else if (r == 0)
+    {
+      add_log ("apt-worker closed connection.\n");
+      return -1;
+    }
+  return r;
 }
 
 static bool
@@ -460,21 +546,44 @@ struct worker_call {
   void *done_data;
 };
 
-static worker_call *pending_calls, **pending_tail = &pending_calls;
+/* One queue of pending calls for each priority.
+ */
+static worker_call *pending_calls[apt_worker_n_priorities];
+static worker_call **pending_tails[apt_worker_n_priorities] = {
+  &pending_calls[0], &pending_calls[1], &pending_calls[2]
+};
 static worker_call *active_call;
 
+/* The query that is outstanding while ACTIVE_CALL is a long
+   operation, if any.  See <apt-worker-proto.h>.
+*/
+static worker_call *query_call;
+
+static worker_call *
+peek_next_pending_worker_call ()
+{
+  for (int prio = 0; prio < apt_worker_n_priorities; prio++)
+    if (pending_calls[prio])
+      return pending_calls[prio];
+  return NULL;
+}
+
 static worker_call *
 get_next_pending_worker_call ()
 {
-  worker_call *c = pending_calls;
-  if (c)
+  for (int prio = 0; prio < apt_worker_n_priorities; prio++)
     {
-      pending_calls = c->next;
-      c->next = NULL;
-      if (pending_tail == &(c->next))
-	pending_tail = &pending_calls;
+      worker_call *c = pending_calls[prio];
+      if (c)
+	{
+	  pending_calls[prio] = c->next;
+	  c->next = NULL;
+	  if (pending_tails[prio] == &(c->next))
+	    pending_tails[prio] = &pending_calls[prio];
+	  return c;
+	}
     }
-  return c;
+  return NULL;
 }
 
 static void
@@ -487,14 +596,34 @@ cancel_worker_call (worker_call *c)
   delete c;
 }
 
+/* Send the next pending call if there is room for it.  While a long
+   operation is active, the next call is sent as the query call when
+   it is a query.  Calls are always sent in order, so a query never
+   overtakes a call that has been made before it.
+*/
 static void
 maybe_send_one_worker_call ()
 {
   if (!apt_worker_ready)
     return;
 
-  while (active_call == NULL)
+  while (true)
     {
+      worker_call **slot;
+
+      if (active_call == NULL)
+	slot = &active_call;
+      else if (query_call == NULL
+	       && apt_proto_is_long_operation (active_call->cmd))
+	{
+	  worker_call *next = peek_next_pending_worker_call ();
+	  if (next == NULL || !apt_proto_is_query (next->cmd))
+	    return;
+	  slot = &query_call;
+	}
+      else
+	return;
+
       worker_call *c = get_next_pending_worker_call ();
       if (c == NULL)
         return;
@@ -508,7 +637,7 @@ maybe_send_one_worker_call ()
         {
           g_free (c->data);
           c->data = NULL;
-          active_call = c;
+          *slot = c;
         }
     }
 }
@@ -519,8 +648,20 @@ void
 call_apt_worker (int cmd, char *data, int len,
                  apt_worker_callback *done_callback,
                  void *done_data)
+{
+  call_apt_worker_with_priority (apt_worker_priority_normal,
+				 cmd, data, len,
+				 done_callback, done_data);
+}
+
+void
+call_apt_worker_with_priority (int priority,
+			       int cmd, char *data, int len,
+			       apt_worker_callback *done_callback,
+			       void *done_data)
 {
   assert (cmd >= 0 && cmd < APTCMD_MAX);
+  assert (priority >= 0 && priority < apt_worker_n_priorities);
 
   /* Ensure apt-worker was started */
   maybe_start_apt_worker ();
@@ -553,8 +694,8 @@ call_apt_worker (int cmd, char *data, int len,
     c->data = NULL;
 
   c->next = NULL;
-  *pending_tail = c;
-  pending_tail = &(c->next);
+  *pending_tails[priority] = c;
+  pending_tails[priority] = &(c->next);
 
   maybe_send_one_worker_call ();
 }
@@ -569,73 +710,181 @@ cancel_all_pending_worker_calls ()
       active_call = NULL;
     }
 
+  if (query_call)
+    {
+      cancel_worker_call (query_call);
+      query_call = NULL;
+    }
+
   worker_call *c;
   while ((c = get_next_pending_worker_call ()))
     cancel_worker_call (c);
 }
 
-void
-handle_one_apt_worker_response ()
+static void
+dispatch_one_apt_worker_response (apt_response_header *res,
+				  apt_proto_decoder *dec)
 {
   static bool running = false;
 
-  static apt_response_header res;
-  static char *response_data = NULL;
-  static int response_len = 0;
-  static apt_proto_decoder dec;
-
   assert (!running);
-    
-  if (!must_read (&res, sizeof (res)))
+
+  if (res->cmd == APTCMD_STATUS)
     {
-      notice_apt_worker_failure ();
+      running = true;
+      if (status_callback)
+	status_callback (res->cmd, dec, status_callback_data);
+      running = false;
       return;
     }
-      
-  //printf ("got response %d/%d/%d\n", res.cmd, res.seq, res.len);
 
-  if (response_len < res.len)
+  worker_call **slot;
+  if (active_call && active_call->seq == res->seq)
+    slot = &active_call;
+  else if (query_call && query_call->seq == res->seq)
+    slot = &query_call;
+  else
     {
-      if (response_data)
-	delete[] response_data;
-      response_data = new char[res.len];
-      response_len = res.len;
+      fprintf (stderr, "ignoring out of sequence reply.\n");
+      return;
     }
 
-  if (!must_read (response_data, res.len))
+  if (res->cmd == APTCMD_PARTIAL)
     {
-      notice_apt_worker_failure ();
+      /* More is coming, keep the call active.
+       */
+      running = true;
+      (*slot)->done_callback (res->cmd, dec, (*slot)->done_data);
+      running = false;
       return;
     }
+  
+  running = true;
+  worker_call *c = *slot;
+  *slot = NULL;
+  c->done_callback (res->cmd, dec, c->done_data);
+  delete c;
+  running = false;
 
-  if (!apt_worker_ready)
-    finish_apt_worker_startup ();
+  maybe_send_one_worker_call ();
+}
 
-  dec.reset (response_data, res.len);
+/* The response that is currently being read.  A response can arrive
+   in many pieces, and we only read what is available each time the
+   main loop tells us that the input fifo is readable.  That way, the
+   UI stays responsive while a big response is being transferred.
+*/
+
+static apt_response_header res;
+static int res_have;            // bytes of RES read so far
+static char *response_data;
+static int response_len;        // allocated size of RESPONSE_DATA
+static int response_have;       // bytes of data read so far
+
+/* How much to read at most before returning to the main loop.
+ */
+#define RESPONSE_READ_BUDGET (256*1024)
 
-  if (res.cmd == APTCMD_STATUS)
+static void
+reset_response_reader ()
+{
+  res_have = 0;
+  response_have = 0;
+}
+
+void
+handle_one_apt_worker_response ()
+{
+  static apt_proto_decoder dec;
+
+  const char *data;
+  int budget = RESPONSE_READ_BUDGET;
+  int r;
+
+  while (res_have < (int) sizeof (res))
     {
-      running = true;
-      if (status_callback)
-	status_callback (res.cmd, &dec, status_callback_data);
-      running = false;
-      return;
+      r = read_some (((char *)&res) + res_have, sizeof (res) - res_have);
+      if (r < 0)
+	{
+	  notice_apt_worker_failure ();
+	  return;
+	}
+      else if (r == 0)
+	return;
+      res_have += r;
     }
 
-  if (active_call == NULL || active_call->seq != res.seq)
+  //printf ("got response %d/%d/%d/%d\n", res.cmd, res.seq, res.len, res.offset);
+
+  if (res.len < 0)
     {
-      fprintf (stderr, "ignoring out of sequence reply.\n");
+      add_log ("bogus response length.\n");
+      notice_apt_worker_failure ();
       return;
     }
-  
-  running = true;
-  worker_call *c = active_call;
-  active_call = NULL;
-  c->done_callback (res.cmd, &dec, c->done_data);
-  delete c;
-  running = false;
 
-  maybe_send_one_worker_call ();
+  if (res.offset >= 0)
+    {
+      /* The data is in the response ring, we decode it right there.
+       */
+      data = response_ring.get (res.offset, res.len);
+      if (data == NULL)
+	{
+	  add_log ("bogus response ring offset.\n");
+	  notice_apt_worker_failure ();
+	  return;
+	}
+    }
+  else
+    {
+      if (response_len < res.len)
+	{
+	  char *new_data = new char[res.len];
+	  if (response_data)
+	    {
+	      memcpy (new_data, response_data, response_have);
+	      delete[] response_data;
+	    }
+	  response_data = new_data;
+	  response_len = res.len;
+	}
+
+      while (response_have < res.len)
+	{
+	  if (budget <= 0)
+	    return;
+
+	  r = read_some (response_data + response_have,
+			 res.len - response_have);
+	  if (r < 0)
+	    {
+	      notice_apt_worker_failure ();
+	      return;
+	    }
+	  else if (r == 0)
+	    return;
+	  response_have += r;
+	  budget -= r;
+	}
+
+      data = response_data;
+    }
+
+  /* We have the complete response.  Get ready for the next one
+     before dispatching this one.
+  */
+  apt_response_header complete_res = res;
+  reset_response_reader ();
+
+  if (!apt_worker_ready)
+    finish_apt_worker_startup ();
+
+  dec.set_encoding (response_encoding);
+  dec.reset (data, complete_res.len);
+  dispatch_one_apt_worker_response (&complete_res, &dec);
+
+  if (complete_res.offset >= 0)
+    response_ring.release (complete_res.offset, complete_res.len);
 }
 
 static apt_proto_encoder request;
@@ -645,6 +894,7 @@ typedef struct {
   void *data;
   char *package;
   char *alt_download_root;
+  char *prefetch;
 } cmd_clos;
 
 void
@@ -666,6 +916,7 @@ apt_worker_get_package_list (bool only_user,
 			     bool only_available,
 			     const char *pattern,
 			     bool show_magic_sys,
+			     bool stream,
 			     apt_worker_callback *callback, void *data)
 {
   request.reset ();
@@ -674,11 +925,31 @@ apt_worker_get_package_list (bool only_user,
   request.encode_int (only_available);
   request.encode_string (pattern);
   request.encode_int (show_magic_sys);
+  request.encode_int (stream? PACKAGE_LIST_CHUNK_SIZE : 0);
   call_apt_worker (APTCMD_GET_PACKAGE_LIST, 
                    request.get_buf (), request.get_len (),
                    callback, data);
 }
 
+void
+apt_worker_get_package_list_delta (int generation,
+				   bool only_user,
+				   bool only_installed,
+				   bool only_available,
+				   bool show_magic_sys,
+				   apt_worker_callback *callback, void *data)
+{
+  request.reset ();
+  request.encode_int (generation);
+  request.encode_int (only_user);
+  request.encode_int (only_installed);
+  request.encode_int (only_available);
+  request.encode_int (show_magic_sys);
+  call_apt_worker (APTCMD_GET_PACKAGE_LIST_DELTA,
+                   request.get_buf (), request.get_len (),
+                   callback, data);
+}
+
 static void
 apt_worker_update_cache_cont (int cmd, apt_proto_decoder *dec, void *data)
 {
@@ -749,9 +1020,26 @@ apt_worker_get_package_info (const char *package,
   request.reset ();
   request.encode_string (package);
   request.encode_int (only_installable_info);
-  call_apt_worker (APTCMD_GET_PACKAGE_INFO, 
-                   request.get_buf (), request.get_len (),
-                   callback, data);
+  call_apt_worker_with_priority (apt_worker_priority_interactive,
+				 APTCMD_GET_PACKAGE_INFO, 
+				 request.get_buf (), request.get_len (),
+				 callback, data);
+}
+
+void
+apt_worker_get_package_infos (const char **packages,
+			      bool only_installable_info,
+			      int priority,
+			      apt_worker_callback *callback, void *data)
+{
+  request.reset ();
+  request.encode_int (only_installable_info);
+  for (int i = 0; packages[i]; i++)
+    request.encode_string (packages[i]);
+  request.encode_string (NULL);
+  call_apt_worker_with_priority (priority, APTCMD_GET_PACKAGE_INFOS,
+				 request.get_buf (), request.get_len (),
+				 callback, data);
 }
 
 void
@@ -765,9 +1053,10 @@ apt_worker_get_package_details (const char *package,
   request.encode_string (package);
   request.encode_string (version);
   request.encode_int (summary_kind);
-  call_apt_worker (APTCMD_GET_PACKAGE_DETAILS, 
-                   request.get_buf (), request.get_len (),
-                   callback, data);
+  call_apt_worker_with_priority (apt_worker_priority_interactive,
+				 APTCMD_GET_PACKAGE_DETAILS, 
+				 request.get_buf (), request.get_len (),
+				 callback, data);
 }
 
 void
@@ -828,6 +1117,8 @@ apt_worker_install_package_cont (int cmd, apt_proto_decoder *dec, void *data)
   request.reset ();
   request.encode_string (clos->package);
   request.encode_string (clos->alt_download_root);
+  if (clos->prefetch)
+    request.encode_string (clos->prefetch);
 
   /* Install the package */
   call_apt_worker (APTCMD_INSTALL_PACKAGE,
@@ -840,12 +1131,14 @@ apt_worker_install_package_cont (int cmd, apt_proto_decoder *dec, void *data)
 void
 apt_worker_install_package (const char *package,
 			    const char *alt_download_root,
+			    const char *prefetch,
 			    apt_worker_callback *callback, void *data)
 {
   cmd_clos *clos = new cmd_clos;
   clos->callback = callback;
   clos->package = (char *) package;
   clos->alt_download_root = (char *) alt_download_root;
+  clos->prefetch = (char *) prefetch;
   clos->data = data;
 
   apt_worker_set_env (apt_worker_install_package_cont, clos);
@@ -980,9 +1273,10 @@ apt_worker_third_party_policy_check (const char *package,
   request.reset ();
   request.encode_string (package);
   request.encode_string (version);
-  call_apt_worker (APTCMD_THIRD_PARTY_POLICY_CHECK,
-                   request.get_buf (), request.get_len (),
-                   callback, data);
+  call_apt_worker_with_priority (apt_worker_priority_interactive,
+				 APTCMD_THIRD_PARTY_POLICY_CHECK,
+				 request.get_buf (), request.get_len (),
+				 callback, data);
 }
 
 void
@@ -996,6 +1290,31 @@ apt_worker_autoremove (apt_worker_callback *callback,
                    callback, data);
 }
 
+void
+apt_worker_get_stats (apt_worker_callback *callback,
+		      void *data)
+{
+  request.reset ();
+
+  call_apt_worker (APTCMD_GET_STATS,
+		   request.get_buf (), request.get_len (),
+		   callback, data);
+}
+
+void
+apt_worker_get_icons (const char **hashes,
+		      apt_worker_callback *callback, void *data)
+{
+  request.reset ();
+  for (int i = 0; hashes[i]; i++)
+    request.encode_string (hashes[i]);
+  request.encode_string (NULL);
+  call_apt_worker_with_priority (apt_worker_priority_background,
+				 APTCMD_GET_ICONS,
+				 request.get_buf (), request.get_len (),
+				 callback, data);
+}
+
 static void exit_apt_worker_callback(int cmd, apt_proto_decoder *dec, void *data)
 {
 }
@@ -41,15 +41,43 @@ typedef void apt_worker_callback (int cmd,
 				  apt_proto_decoder *dec,
 				  void *callback_data);
 
-/* There can be only one non-completed request per command.  If you
-   try tp queue another request before the pending one has completed,
-   you get an error and the DONE callback will be called with a NULL
-   response data.
+/* Requests are sent one at a time.  When apt-worker is not running,
+   the DONE callback will be called with a NULL response data.
+
+   Commands that stream their response call DONE once for every
+   APTCMD_PARTIAL piece, with CMD set to APTCMD_PARTIAL, and then once
+   more for the final piece.  When the request is cancelled, DONE is
+   called with a NULL response data as usual, possibly after some
+   pieces have already been delivered.
 */
 void call_apt_worker (int cmd, char *data, int len,
 		      apt_worker_callback *done,
 		      void *done_data);
 
+/* Requests are queued by priority.  A pending request is only sent
+   when no request of a higher priority is pending, and requests of
+   the same priority are sent in order.  A request that has been sent
+   runs to completion; lower priority requests that are still pending
+   simply wait, they are not cancelled.
+
+   Use apt_worker_priority_interactive for requests that the user is
+   waiting for, such as the details of a package, and
+   apt_worker_priority_background for requests that only fill in
+   information that might be shown later.  CALL_APT_WORKER uses
+   apt_worker_priority_normal.
+*/
+enum apt_worker_priority {
+  apt_worker_priority_interactive,
+  apt_worker_priority_normal,
+  apt_worker_priority_background,
+  apt_worker_n_priorities
+};
+
+void call_apt_worker_with_priority (int priority,
+				    int cmd, char *data, int len,
+				    apt_worker_callback *done,
+				    void *done_data);
+
 bool apt_worker_is_running ();
 void send_apt_request (int cmd, int seq, char *data, int len);
 void handle_one_apt_worker_response ();
@@ -68,9 +96,18 @@ void apt_worker_get_package_list (bool only_user,
 				  bool only_available,
 				  const char *pattern,
 				  bool show_magic_sys,
+				  bool stream,
 				  apt_worker_callback *callback,
 				  void *data);
 
+void apt_worker_get_package_list_delta (int generation,
+					bool only_user,
+					bool only_installed,
+					bool only_available,
+					bool show_magic_sys,
+					apt_worker_callback *callback,
+					void *data);
+
 void apt_worker_update_cache (apt_worker_callback *callback,
 			      void *data);
 
@@ -93,6 +130,12 @@ void apt_worker_get_package_info (const char *package,
 				  apt_worker_callback *callback,
 				  void *data);
 
+void apt_worker_get_package_infos (const char **packages,
+				   bool only_installable_info,
+				   int priority,
+				   apt_worker_callback *callback,
+				   void *data);
+
 void apt_worker_get_package_details (const char *package,
 				     const char *version,
 				     int summary_kind,
@@ -112,6 +155,7 @@ void apt_worker_download_package (const char *package,
 
 void apt_worker_install_package (const char *package,
 				 const char *alt_download_root,
+				 const char *prefetch,
 				 apt_worker_callback *callback,
 				 void *data);
 
@@ -158,6 +202,13 @@ void apt_worker_third_party_policy_check (const char *package,
 void apt_worker_autoremove (apt_worker_callback *callback,
                             void *data);
 
+void apt_worker_get_stats (apt_worker_callback *callback,
+			   void *data);
+
+void apt_worker_get_icons (const char **hashes,
+			   apt_worker_callback *callback,
+			   void *data);
+
 void exit_apt_worker ();
 
 #endif /* !APT_WORKER_CLIENT_H */
@@ -24,6 +24,12 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #include <glib.h>
 
@@ -33,18 +39,36 @@ apt_proto_encoder::apt_proto_encoder ()
 {
   buf = NULL;
   buf_len = len = 0;
+  encoding = encoding_classic;
+  strtab = NULL;
+  strtab_size = strtab_count = 0;
 }
 
 apt_proto_encoder::~apt_proto_encoder ()
 {
   if (buf)
     free (buf);
+  if (strtab)
+    free (strtab);
 }
 
 void
 apt_proto_encoder::reset ()
 {
   len = 0;
+  if (strtab_count > 0)
+    {
+      for (int i = 0; i < strtab_size; i++)
+	strtab[i].offset = -1;
+      strtab_count = 0;
+    }
+}
+
+void
+apt_proto_encoder::set_encoding (int enc)
+{
+  encoding = enc;
+  reset ();
 }
 
 char *
@@ -88,7 +112,7 @@ apt_proto_encoder::grow (int delta)
 void
 apt_proto_encoder::encode_mem_plus_zeros (const void *val, int n, int z)
 {
-  int r = roundup (n+z, sizeof (int));
+  int r = (encoding == encoding_compact)? n+z : roundup (n+z, sizeof (int));
   grow (r);
   memcpy (buf+len, (char *)val, n);
   memset (buf+len+n, 0, (r - n));
@@ -101,16 +125,34 @@ apt_proto_encoder::encode_mem (const void *val, int n)
   encode_mem_plus_zeros (val, n, 0);
 }
 
+void
+apt_proto_encoder::encode_varint (uint64_t val)
+{
+  grow (10);
+  while (val >= 0x80)
+    {
+      buf[len++] = (val & 0x7F) | 0x80;
+      val >>= 7;
+    }
+  buf[len++] = val;
+}
+
 void
 apt_proto_encoder::encode_int (int val)
 {
-  encode_mem (&val, sizeof (int));
+  if (encoding == encoding_compact)
+    encode_varint (((uint32_t)val << 1) ^ (uint32_t)(val >> 31));
+  else
+    encode_mem (&val, sizeof (int));
 }
 
 void
 apt_proto_encoder::encode_int64 (int64_t val)
 {
-  encode_mem (&val, sizeof (int64_t));
+  if (encoding == encoding_compact)
+    encode_varint (((uint64_t)val << 1) ^ (uint64_t)(val >> 63));
+  else
+    encode_mem (&val, sizeof (int64_t));
 }
 
 void
@@ -119,10 +161,106 @@ apt_proto_encoder::encode_string (const char *val)
   encode_stringn (val, -1);
 }
 
+static unsigned int
+hash_mem (const char *mem, int n)
+{
+  /* FNV-1a
+   */
+  unsigned int h = 2166136261U;
+  while (n-- > 0)
+    h = (h ^ (unsigned char)*mem++) * 16777619U;
+  return h;
+}
+
+/* The string table of the compact encoding is a open addressed hash
+   table that refers to the first occurrence of each string in BUF.
+   It is only ever grown, so that RESET is cheap.
+*/
+
+int
+apt_proto_encoder::strtab_lookup (unsigned int hash, const char *val, int n)
+{
+  if (strtab_count == 0)
+    return -1;
+
+  for (int i = hash & (strtab_size - 1);
+       strtab[i].offset >= 0;
+       i = (i + 1) & (strtab_size - 1))
+    {
+      if (strtab[i].hash == hash
+	  && strtab[i].len == n
+	  && memcmp (buf + strtab[i].offset, val, n) == 0)
+	return strtab[i].index;
+    }
+
+  return -1;
+}
+
+void
+apt_proto_encoder::strtab_add (unsigned int hash, int offset, int n)
+{
+  if (2 * (strtab_count + 1) > strtab_size)
+    {
+      strtab_entry *old = strtab;
+      int old_size = strtab_size;
+
+      strtab_size = (old_size == 0)? 256 : 2 * old_size;
+      strtab = (strtab_entry *)malloc (strtab_size * sizeof (strtab_entry));
+      if (strtab == NULL)
+	{
+	  perror ("malloc");
+	  exit (1);
+	}
+      for (int i = 0; i < strtab_size; i++)
+	strtab[i].offset = -1;
+
+      for (int i = 0; i < old_size; i++)
+	if (old[i].offset >= 0)
+	  {
+	    int j = old[i].hash & (strtab_size - 1);
+	    while (strtab[j].offset >= 0)
+	      j = (j + 1) & (strtab_size - 1);
+	    strtab[j] = old[i];
+	  }
+      free (old);
+    }
+
+  int i = hash & (strtab_size - 1);
+  while (strtab[i].offset >= 0)
+    i = (i + 1) & (strtab_size - 1);
+
+  strtab[i].hash = hash;
+  strtab[i].offset = offset;
+  strtab[i].len = n;
+  strtab[i].index = strtab_count++;
+}
+
 void
 apt_proto_encoder::encode_stringn (const char *val, int len)
 {
-  if (val == NULL)
+  if (encoding == encoding_compact)
+    {
+      if (val == NULL)
+	encode_varint (0);
+      else
+	{
+	  if (len == -1)
+	    len = strlen (val);
+
+	  unsigned int hash = hash_mem (val, len);
+	  int index = strtab_lookup (hash, val, len);
+	  if (index >= 0)
+	    encode_varint (index + 2);
+	  else
+	    {
+	      encode_varint (1);
+	      encode_varint (len);
+	      strtab_add (hash, this->len, len);
+	      encode_mem_plus_zeros (val, len, 1);
+	    }
+	}
+    }
+  else if (val == NULL)
     encode_int (-1);
   else
     {
@@ -162,16 +300,24 @@ apt_proto_encoder::encode_xexp (xexp *x)
 
 apt_proto_decoder::apt_proto_decoder ()
 {
+  encoding = encoding_classic;
+  strings = NULL;
+  strings_size = 0;
   reset (NULL, 0);
 }
 
 apt_proto_decoder::apt_proto_decoder (const char *buf, int len)
 {
+  encoding = encoding_classic;
+  strings = NULL;
+  strings_size = 0;
   reset (buf, len);
 }
 
 apt_proto_decoder::~apt_proto_decoder ()
 {
+  if (strings)
+    free (strings);
 }
 
 void
@@ -181,8 +327,15 @@ apt_proto_decoder::reset (const char *buf, int len)
   this->len = len;
   corrupted_flag = false;
   at_end_flag = (len == 0);
+  strings_count = 0;
 }  
 
+void
+apt_proto_decoder::set_encoding (int enc)
+{
+  encoding = enc;
+}
+
 bool
 apt_proto_decoder::at_end ()
 {
@@ -201,8 +354,8 @@ apt_proto_decoder::decode_mem (void *mem, int n)
   if (corrupted ())
     return;
 
-  int r = roundup (n, sizeof (int));
-  if (ptr + r > buf + len)
+  int r = (encoding == encoding_compact)? n : roundup (n, sizeof (int));
+  if (n < 0 || ptr + r > buf + len)
     {
       corrupted_flag = true;
       at_end_flag = true;
@@ -217,11 +370,57 @@ apt_proto_decoder::decode_mem (void *mem, int n)
     }
 }
 
+uint64_t
+apt_proto_decoder::decode_varint ()
+{
+  uint64_t val = 0;
+  int shift = 0;
+
+  /* Most values fit into a single byte.
+   */
+  if (!corrupted_flag && ptr < buf + len && (*ptr & 0x80) == 0)
+    {
+      val = (unsigned char)*ptr++;
+      if (ptr == buf + len)
+	at_end_flag = true;
+      return val;
+    }
+
+  while (!corrupted ())
+    {
+      if (ptr >= buf + len || shift > 63)
+	{
+	  corrupted_flag = true;
+	  at_end_flag = true;
+	  break;
+	}
+
+      unsigned char b = *ptr++;
+      val |= (uint64_t)(b & 0x7F) << shift;
+      shift += 7;
+
+      if ((b & 0x80) == 0)
+	{
+	  if (ptr == buf + len)
+	    at_end_flag = true;
+	  return val;
+	}
+    }
+
+  return 0;
+}
+
 int
 apt_proto_decoder::decode_int ()
 {
   int val = 0;
-  decode_mem (&val, sizeof (int));
+  if (encoding == encoding_compact)
+    {
+      uint32_t v = decode_varint ();
+      val = (int)(v >> 1) ^ -(int)(v & 1);
+    }
+  else
+    decode_mem (&val, sizeof (int));
   return val;
 }
 
@@ -229,22 +428,62 @@ int64_t
 apt_proto_decoder::decode_int64 ()
 {
   int64_t val = 0;
-  decode_mem (&val, sizeof (int64_t));
+  if (encoding == encoding_compact)
+    {
+      uint64_t v = decode_varint ();
+      val = (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+    }
+  else
+    decode_mem (&val, sizeof (int64_t));
   return val;
 }
 
 const char *
 apt_proto_decoder::decode_string_in_place ()
 {
-  int len = decode_int ();
+  int len;
   const char *str;
 
-  if (len == -1 || corrupted ())
+  if (encoding == encoding_compact)
+    {
+      uint64_t tag = decode_varint ();
+
+      if (tag == 0 || corrupted ())
+	return NULL;
+
+      if (tag >= 2)
+	{
+	  if (tag - 2 >= (uint64_t)strings_count)
+	    {
+	      corrupted_flag = true;
+	      at_end_flag = true;
+	      return NULL;
+	    }
+	  return strings[tag - 2];
+	}
+
+      len = decode_varint ();
+    }
+  else
+    {
+      len = decode_int ();
+      if (len == -1)
+	return NULL;
+    }
+
+  if (corrupted ())
     return NULL;
 
   str = ptr;
   decode_mem (NULL, len+1);
 
+  if (corrupted () || str[len] != '\0')
+    {
+      corrupted_flag = true;
+      at_end_flag = true;
+      return NULL;
+    }
+
   if (!g_utf8_validate (str, -1, NULL))
     {
       for (unsigned char *p = (unsigned char *)str; *p; p++)
@@ -252,6 +491,22 @@ apt_proto_decoder::decode_string_in_place ()
 	  *p = '?';
     }
 
+  if (encoding == encoding_compact)
+    {
+      if (strings_count == strings_size)
+	{
+	  strings_size = (strings_size == 0)? 256 : 2 * strings_size;
+	  strings = (const char **)realloc (strings,
+					    strings_size * sizeof (char *));
+	  if (strings == NULL)
+	    {
+	      perror ("realloc");
+	      exit (1);
+	    }
+	}
+      strings[strings_count++] = str;
+    }
+
   return str;
 }
 
@@ -294,3 +549,306 @@ apt_proto_decoder::decode_xexp ()
   else
     return xexp_text_new (tag, decode_string_in_place ());
 }
+
+apt_proto_ring::apt_proto_ring ()
+{
+  hdr = NULL;
+  data = NULL;
+  size = head = 0;
+}
+
+apt_proto_ring::~apt_proto_ring ()
+{
+  detach ();
+}
+
+bool
+apt_proto_ring::map (int fd)
+{
+  void *mem = mmap (NULL, sizeof (apt_proto_ring_header) + APT_PROTO_RING_SIZE,
+		    PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (mem == MAP_FAILED)
+    {
+      perror ("mmap");
+      return false;
+    }
+
+  hdr = (apt_proto_ring_header *)mem;
+  data = (char *)mem + sizeof (apt_proto_ring_header);
+  size = APT_PROTO_RING_SIZE;
+  return true;
+}
+
+/* CREATE is used by the frontend on a freshly created file.
+ */
+bool
+apt_proto_ring::create (int fd)
+{
+  detach ();
+
+  if (ftruncate (fd, sizeof (apt_proto_ring_header) + APT_PROTO_RING_SIZE) < 0)
+    {
+      perror ("ftruncate");
+      return false;
+    }
+
+  if (!map (fd))
+    return false;
+
+  hdr->magic = APT_PROTO_RING_MAGIC;
+  hdr->size = APT_PROTO_RING_SIZE;
+  hdr->head = hdr->tail = 0;
+  head = 0;
+  return true;
+}
+
+/* ATTACH is used by apt-worker.  Since apt-worker runs as root, we
+   are careful to only ever write into a file that has been set up by
+   CREATE.
+*/
+bool
+apt_proto_ring::attach (int fd)
+{
+  struct stat buf;
+
+  detach ();
+
+  if (fstat (fd, &buf) < 0)
+    {
+      perror ("fstat");
+      return false;
+    }
+
+  if (!S_ISREG (buf.st_mode)
+      || buf.st_nlink != 1
+      || buf.st_size != (off_t)(sizeof (apt_proto_ring_header)
+				+ APT_PROTO_RING_SIZE))
+    return false;
+
+  if (!map (fd))
+    return false;
+
+  if (hdr->magic != APT_PROTO_RING_MAGIC
+      || hdr->size != APT_PROTO_RING_SIZE
+      || hdr->head != hdr->tail)
+    {
+      detach ();
+      return false;
+    }
+
+  head = hdr->head;
+  return true;
+}
+
+void
+apt_proto_ring::detach ()
+{
+  if (hdr)
+    munmap (hdr, sizeof (apt_proto_ring_header) + APT_PROTO_RING_SIZE);
+  hdr = NULL;
+  data = NULL;
+  size = head = 0;
+}
+
+bool
+apt_proto_ring::is_attached ()
+{
+  return hdr != NULL;
+}
+
+/* HEAD and TAIL count bytes and are allowed to wrap around.  Since
+   SIZE is a power of two, the position in the ring is still simply
+   the count modulo SIZE.
+
+   We keep our own copy of HEAD and never trust the one in the shared
+   header.
+*/
+int
+apt_proto_ring::put (const void *mem, int n)
+{
+  if (hdr == NULL || n < 0)
+    return -1;
+
+  unsigned int r = roundup (n, sizeof (int));
+  if (r > size)
+    return -1;
+
+  __sync_synchronize ();
+  unsigned int used = head - hdr->tail;
+  if (used > size)
+    {
+      fprintf (stderr, "response ring corrupted, not using it anymore.\n");
+      detach ();
+      return -1;
+    }
+
+  unsigned int pos = head % size;
+  unsigned int skip = (pos + r > size)? size - pos : 0;
+  if (used + skip + r > size)
+    return -1;
+
+  pos = (head + skip) % size;
+  memcpy (data + pos, mem, n);
+  if (r > (unsigned int)n)
+    memset (data + pos + n, 0, r - n);
+
+  /* The data must be in place before the frontend can see the new
+     HEAD.
+  */
+  __sync_synchronize ();
+  head += skip + r;
+  hdr->head = head;
+
+  return pos;
+}
+
+const char *
+apt_proto_ring::get (int offset, int n)
+{
+  if (hdr == NULL || offset < 0 || n < 0
+      || (unsigned int)offset + (unsigned int)n > size)
+    return NULL;
+
+  __sync_synchronize ();
+  return data + offset;
+}
+
+void
+apt_proto_ring::release (int offset, int n)
+{
+  if (hdr == NULL)
+    return;
+
+  unsigned int tail = hdr->tail;
+  unsigned int skip = (offset - tail % size + size) % size;
+
+  /* We must be done with the data before apt-worker can see the new
+     TAIL.
+  */
+  __sync_synchronize ();
+  hdr->tail = tail + skip + roundup (n, sizeof (int));
+}
+
+/* The cancel watch.
+ */
+
+static volatile sig_atomic_t cancel_signalled = 0;
+
+static void
+cancel_sigio_handler (int sig)
+{
+  cancel_signalled = 1;
+}
+
+apt_proto_cancel_watch::apt_proto_cancel_watch ()
+{
+  fd = -1;
+  async = false;
+}
+
+bool
+apt_proto_cancel_watch::watch (int watch_fd)
+{
+  struct sigaction sa;
+  int flags;
+
+  fd = watch_fd;
+  async = false;
+
+  memset (&sa, 0, sizeof (sa));
+  sa.sa_handler = cancel_sigio_handler;
+  sigemptyset (&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+
+  if (sigaction (SIGIO, &sa, NULL) < 0
+      || (flags = fcntl (fd, F_GETFL)) < 0
+      || fcntl (fd, F_SETOWN, getpid ()) < 0
+      || fcntl (fd, F_SETFL, flags | O_ASYNC) < 0)
+    return false;
+
+  /* A byte might have arrived before we asked for SIGIO.
+   */
+  async = true;
+  cancel_signalled = 1;
+  return true;
+}
+
+bool
+apt_proto_cancel_watch::cancelled ()
+{
+  unsigned char byte;
+
+  if (fd < 0)
+    return false;
+
+  if (async)
+    {
+      if (!cancel_signalled)
+	return false;
+
+      /* Clear the flag before reading so that a byte arriving
+	 during the read is noticed next time.
+      */
+      cancel_signalled = 0;
+    }
+
+  if (read (fd, &byte, 1) != 1)
+    return false;
+
+  /* There might be more bytes.
+   */
+  if (async)
+    cancel_signalled = 1;
+  return true;
+}
+
+void
+apt_proto_cancel_watch::drain ()
+{
+  unsigned char byte;
+
+  if (fd < 0)
+    return;
+
+  cancel_signalled = 0;
+  while (read (fd, &byte, 1) == 1)
+    ;
+}
+
+bool
+apt_proto_is_long_operation (int cmd)
+{
+  switch (cmd)
+    {
+    case APTCMD_CHECK_UPDATES:
+    case APTCMD_DOWNLOAD_PACKAGE:
+    case APTCMD_INSTALL_PACKAGE:
+    case APTCMD_REMOVE_PACKAGE:
+    case APTCMD_INSTALL_FILE:
+    case APTCMD_AUTOREMOVE:
+      return true;
+    default:
+      return false;
+    }
+}
+
+bool
+apt_proto_is_query (int cmd)
+{
+  switch (cmd)
+    {
+    case APTCMD_GET_PACKAGE_LIST:
+    case APTCMD_GET_PACKAGE_LIST_DELTA:
+    case APTCMD_GET_PACKAGE_INFO:
+    case APTCMD_GET_PACKAGE_INFOS:
+    case APTCMD_GET_PACKAGE_DETAILS:
+    case APTCMD_GET_CATALOGUES:
+    case APTCMD_GET_FREE_SPACE:
+    case APTCMD_GET_SYSTEM_UPDATE_PACKAGES:
+    case APTCMD_GET_STATS:
+    case APTCMD_GET_ICONS:
+      return true;
+    default:
+      return false;
+    }
+}
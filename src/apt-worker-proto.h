@@ -38,7 +38,9 @@ enum apt_command {
   APTCMD_STATUS,
 
   APTCMD_GET_PACKAGE_LIST,
+  APTCMD_GET_PACKAGE_LIST_DELTA,
   APTCMD_GET_PACKAGE_INFO,
+  APTCMD_GET_PACKAGE_INFOS,
   APTCMD_GET_PACKAGE_DETAILS,
 
   APTCMD_CHECK_UPDATES,        // needs network
@@ -70,6 +72,12 @@ enum apt_command {
 
   APTCMD_AUTOREMOVE,
 
+  APTCMD_SET_ENCODING,
+  APTCMD_GET_STATS,
+  APTCMD_GET_ICONS,
+
+  APTCMD_PARTIAL,
+
   APTCMD_EXIT,
 
   APTCMD_MAX
@@ -85,8 +93,122 @@ struct apt_response_header {
   int cmd;
   int seq;
   int len;
+  int offset;   // where the data is in the response ring, or -1
+};
+
+// The response ring
+//
+// The frontend can give apt-worker a shared memory file to put
+// response data into.  When it does, a response is sent by copying
+// its data into the ring and then writing only the
+// apt_response_header to the response fifo, with OFFSET set to where
+// the data starts in the ring.  The fifo is thus only used to wake up
+// the frontend, which decodes the data directly from the shared
+// memory.  When the frontend has dealt with the response, it
+// releases the data so that apt-worker can reuse the space.
+//
+// Responses are released in the order they are received.  A response
+// always occupies a contiguous piece of the ring; when it doesn't fit
+// before the end, the rest of the ring is skipped.
+//
+// When a response does not fit into the ring, or when there is no
+// ring, OFFSET is -1 and the LEN bytes of data follow the header in
+// the fifo, as usual.
+
+#define APT_PROTO_RING_MAGIC 0x41575231
+#define APT_PROTO_RING_SIZE  (512*1024)   // must be a power of two
+
+struct apt_proto_ring_header {
+  int magic;
+  int size;
+  volatile unsigned int head;   // only written by apt-worker
+  volatile unsigned int tail;   // only written by the frontend
+};
+
+struct apt_proto_ring {
+
+  apt_proto_ring ();
+  ~apt_proto_ring ();
+
+  bool create (int fd);
+  bool attach (int fd);
+  void detach ();
+  bool is_attached ();
+
+  // Used by apt-worker.  Returns the offset, or -1 when there is no
+  // room.
+  int put (const void *data, int len);
+
+  // Used by the frontend.  GET returns NULL when OFFSET and LEN do
+  // not describe a piece of the ring.
+  const char *get (int offset, int len);
+  void release (int offset, int len);
+
+private:
+  apt_proto_ring_header *hdr;
+  char *data;
+  unsigned int size;
+  unsigned int head;
+
+  bool map (int fd);
+};
+
+// Cancellation
+//
+// The frontend cancels the current operation of apt-worker by
+// writing a byte to the cancel fifo.  apt-worker checks for this
+// very often, once per package in some loops, and reading the fifo
+// every time would cost a system call per check.
+//
+// An apt_proto_cancel_watch sets the fifo up so that the kernel
+// sends SIGIO when a byte arrives, and only reads from the fifo when
+// that has happened.  Other than that, CANCELLED behaves as if it
+// tried to read one byte from the fifo: every byte written by the
+// frontend cancels one operation.  When the fifo can not be set up
+// for SIGIO, CANCELLED does read it every time.
+//
+// There can only be one watch in a process.
+
+struct apt_proto_cancel_watch {
+
+  apt_proto_cancel_watch ();
+
+  bool watch (int fd);
+  bool cancelled ();
+  void drain ();
+
+private:
+  int fd;
+  bool async;
 };
 
+// Queries during long operations
+//
+// Normally, the frontend sends the next request only after it has
+// received the response to the previous one.  While apt-worker
+// works on a long operation, one for which APT_PROTO_IS_LONG_OPERATION
+// is true, the frontend may additionally have one query outstanding,
+// a request for which APT_PROTO_IS_QUERY is true.
+//
+// Such a query is answered by a child process that apt-worker forks
+// when it starts the operation.  The child has a copy of the cache,
+// and its own handles on the package index files, as they were at
+// that moment, and all queries see exactly that state:
+// packages that are being installed or removed by the operation
+// still show their old versions, and catalogues that are being
+// refreshed still have their old contents.  The changes of the
+// operation become visible with the first request that is sent after
+// the response to the operation has been received.  The child
+// exits before apt-worker sends that response.
+//
+// Responses to queries never use the response ring, and they can
+// arrive before or after STATUS and PARTIAL responses of the
+// operation.  The child answers any other request with an empty
+// response, which the frontend can't decode.
+
+bool apt_proto_is_long_operation (int cmd);
+bool apt_proto_is_query (int cmd);
+
 enum apt_proto_result_code {
   rescode_success,              // (success)
   rescode_partial_success,
@@ -102,6 +224,28 @@ enum apt_proto_result_code {
 // Encoding and decoding of data types
 //
 // All strings are in UTF-8.
+//
+// There are two encodings.  In the classic one, ints are sent in
+// host byte order, and strings are sent as their length followed by
+// their bytes and a terminating zero.  A NULL string is sent as a
+// length of -1.  Everything is padded to a multiple of four bytes.
+//
+// In the compact encoding, ints are sent as zig-zag varints: seven
+// bits per byte, least significant group first, with the high bit
+// set on all but the last byte.  Nothing is padded.  Strings are
+// sent as a varint tag: 0 for NULL, 1 for a string that has not
+// appeared yet in this response, which is followed by its length as
+// a varint and its bytes and a terminating zero, and N+2 for the
+// Nth new string of this response.  Repeated strings like section
+// names and version numbers are thus only sent once per response.
+//
+// Requests always use the classic encoding.  Responses use the
+// encoding that has been agreed upon with SET_ENCODING.
+
+enum apt_proto_encoding {
+  encoding_classic,
+  encoding_compact
+};
 
 struct apt_proto_encoder {
 
@@ -109,6 +253,7 @@ struct apt_proto_encoder {
   ~apt_proto_encoder ();
   
   void reset ();
+  void set_encoding (int);
 
   void encode_mem (const void *, int);
   void encode_int (int);
@@ -124,9 +269,24 @@ private:
   char *buf;
   int buf_len;
   int len;
+  int encoding;
+
+  struct strtab_entry {
+    unsigned int hash;
+    int offset;
+    int len;
+    int index;
+  };
+
+  strtab_entry *strtab;
+  int strtab_size;
+  int strtab_count;
 
   void grow (int delta);
   void encode_mem_plus_zeros (const void *, int, int);
+  void encode_varint (uint64_t);
+  int strtab_lookup (unsigned int hash, const char *, int len);
+  void strtab_add (unsigned int hash, int offset, int len);
 };
 
 struct apt_proto_decoder {
@@ -136,6 +296,7 @@ struct apt_proto_decoder {
   ~apt_proto_decoder ();
   
   void reset (const char *data, int len);
+  void set_encoding (int);
 
   void decode_mem (void *, int);
   int decode_int ();
@@ -151,6 +312,13 @@ private:
   const char *buf, *ptr;
   int len;
   bool corrupted_flag, at_end_flag;
+  int encoding;
+
+  const char **strings;
+  int strings_size;
+  int strings_count;
+
+  uint64_t decode_varint ();
 };
 
 // NOOP - do nothing, no parameters, no results
@@ -172,6 +340,18 @@ enum apt_proto_operation {
   op_general
 };
 
+// PARTIAL - a piece of a streamed response
+//
+// Like STATUS, this command is special: you never send a request for
+// it.  Commands that stream their results send zero or more PARTIAL
+// responses before their final response.  The PARTIAL responses have
+// the seq of the request that they belong to and the final response
+// has the real cmd, as usual.
+//
+// The content of the pieces is specified by the streaming command.
+// A piece is never split in the middle of a logical entry, so each
+// piece can be decoded on its own.
+
 // GET_PACKAGE_LIST - get a list of packages with their names,
 //                    versions, and assorted information
 //
@@ -183,6 +363,8 @@ enum apt_proto_operation {
 // - only_available (int). Include only packages that are available.
 // - pattern (string).     Include only packages that match pattern.
 // - show_magic_sys (int). Include the artificial "magic:sys" package.
+// - chunk_size (int).     When positive, stream the response in
+//                         PARTIAL pieces of roughly this many bytes.
 //
 // The response starts with an int that tells whether the request
 // succeeded.  When that int is 0, no data follows.  When it is 1 then
@@ -195,17 +377,63 @@ enum apt_proto_operation {
 // - installed_section or null (string)
 // - installed_pretty_name or null (string)
 // - installed_short_description or null (string)
-// - installed_icon or null (string).
+// - installed_icon_hash or null (string).  See GET_ICONS.
 // - available_version or null (string) 
 // - available_section (string)
 // - available_pretty_name or null (string)
 // - available_short_description or null (string)
-// - available_icon or null (string)
+// - available_icon_hash or null (string)
 // - flags (int)
 //
 // When the available_short_description would be identical to the
-// installed_short_description, it is set to null.  Likewise for the
-// icon.
+// installed_short_description, it is set to null.  An icon hash is
+// null when that version has no icon; the client should then show
+// its default icon, not the icon of the other version.
+//
+// When streaming, every PARTIAL piece and the final response start
+// with the success int and contain only complete package entries.
+// The "magic:sys" package is always in the final response.
+
+// GET_PACKAGE_LIST_DELTA - get the changes to a package list
+//
+// apt-worker remembers the last package list that it has sent
+// completely in response to a GET_PACKAGE_LIST without a pattern, or
+// a GET_PACKAGE_LIST_DELTA.  Each such list is tagged with a
+// generation number, which changes whenever the cache is rebuilt.
+// This command returns what has changed in that list since then.
+//
+// Parameters:
+//
+// - generation (int).     The generation of the list that the client
+//                         has, as returned by a previous
+//                         GET_PACKAGE_LIST_DELTA, or -1.
+// - only_user (int).      As for GET_PACKAGE_LIST.
+// - only_installed (int). 
+// - only_available (int). 
+// - show_magic_sys (int). 
+//
+// Response:
+//
+// - generation (int).     The current generation, or -1 when the
+//                         cache could not be built.
+// - delta (int).          When 0, apt-worker doesn't have the list
+//                         that the client has, and the client needs
+//                         to use GET_PACKAGE_LIST to get the full
+//                         list.  This list will then have the
+//                         returned generation, or a later one.
+//                         Nothing else follows.
+//
+// When delta is 1, the response continues with:
+//
+// - The package entries that are new or have changed, each preceded
+//   by a 1 (int), and followed by a 0 (int).  The entries are as for
+//   GET_PACKAGE_LIST.  "magic:sys" is never included.
+// - removed (string)*,(null).  The names of the packages that are no
+//   longer in the list.
+// - affected (string)*,(null).  The names of packages whose entries
+//   haven't changed, but whose GET_PACKAGE_INFO and
+//   GET_PACKAGE_DETAILS might have, because a package that they
+//   depend on, or that depends on them, has changed.
 
 // UPDATE_PACKAGE_CACHE - recreate package cache
 //
@@ -312,6 +540,19 @@ struct apt_proto_package_info {
   int64_t remove_user_size_delta;
 };
 
+// GET_PACKAGE_INFOS - the same as GET_PACKAGE_INFO for a number of
+//                     packages at once.
+//
+// Parameters:
+//
+// - only_installable_info (int).
+// - names (string)*,(null).       Names of the packages.
+//
+// Response:
+//
+// - infos (apt_proto_package_info)*.  One for each name, in the same
+//                                     order as the names.
+
 // GET_PACKAGE_DETAILS - get a lot of details about a specific
 //                       package.  This is intended for the "Details"
 //                       dialog, of course.
@@ -391,6 +632,14 @@ enum apt_proto_pkgtrust {
 // - https_proxy (string).       The value of the https_proxy envvar to use.
 // - check_free_space (int).     Whether or not to check the
 //                               "Required-Free-Space" field of the packages
+// - prefetch (string).          Optional.  The package that will be
+//                               installed next.  Its archives are
+//                               downloaded while this package is being
+//                               installed.  The next DOWNLOAD_PACKAGE
+//                               for it stops that download and resumes
+//                               it, and a CLEAN before it keeps them.
+//                               Other requests, except queries and
+//                               checks, stop it and drop them.
 // Response:
 //
 // - result_code (int).
@@ -513,4 +762,77 @@ enum third_party_policy_status {
   third_party_incompatible
 };
 
+// SET_ENCODING - choose the encoding of the responses
+//
+// Parameters:
+//
+// - encoding (int).  One of apt_proto_encoding, see above.
+//
+// Response:
+//
+// - encoding (int).  The encoding that apt-worker will use from the
+//                    next response on.  This might be
+//                    encoding_classic if apt-worker doesn't know the
+//                    requested one.  The response itself is always
+//                    in the encoding that was in effect before.
+
+// GET_STATS - get statistics about the work done by apt-worker
+//
+// Parameters: none.
+//
+// Response:
+//
+// - stats (xexp).  A list like this:
+//
+//   <stats>
+//    <command>
+//     <name>GET_PACKAGE_LIST</name>
+//     <count>12</count>
+//     <p50-usecs>262144</p50-usecs>
+//     <p99-usecs>1048576</p99-usecs>
+//     <max-usecs>901772</max-usecs>
+//     <total-usecs>3612931</total-usecs>
+//     <request-bytes>288</request-bytes>
+//     <response-bytes>10381220</response-bytes>
+//    </command>
+//    ...
+//    <cache-init>
+//     <count>3</count>
+//     ...
+//    </cache-init>
+//    <cache-refresh>
+//     ...
+//    </cache-refresh>
+//   </stats>
+//
+//   There is one COMMAND element for each command that has been
+//   handled at least once since apt-worker started.  Times are in
+//   microseconds and the percentiles are only accurate to a factor
+//   of two.  Response bytes include PARTIAL responses but not
+//   STATUS responses.  CACHE-REFRESH counts the times that the cache
+//   was only reset after a modifying command because none of its
+//   input files had changed; the other times are in CACHE-INIT.
+//   Queries that were answered during a long operation are not
+//   counted.
+
+// GET_ICONS - get the icons of packages
+//
+// Package lists only contain the hashes of the package icons, so
+// that icons that are shared by many packages, or that the client
+// has seen before, are not sent over and over again.  A hash is the
+// hex SHA1 checksum of the icon.  The client uses this command to
+// get the icons that it doesn't have yet.
+//
+// Parameters:
+//
+// - hash (string)*,(null).  The hashes of the wanted icons, as they
+//                           appeared in a package list.
+//
+// Response:
+//
+// - icon (string)*.  For each requested hash, the icon as a base64
+//                    encoded image, as in the Maemo-Icon-26 field of
+//                    a package, or null when apt-worker doesn't know
+//                    the hash.
+
 #endif /* !APT_WORKER_PROTO_H */
@@ -58,10 +58,14 @@
 #include <sys/statvfs.h>
 #include <sys/types.h>
 #include <sys/fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 #include <errno.h>
 #include <dirent.h>
 #include <signal.h>
 #include <ftw.h>
+#include <time.h>
+#include <limits.h>
 
 #include <fstream>
 
@@ -217,6 +221,33 @@ log_stderr (const char *fmt, ...)
   fprintf (stderr, "\n");
 }
 
+/* HASH_MEM and HASH_STR compute FNV-1a hashes.  Start with
+   FNV_OFFSET_BASIS.
+*/
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+
+static uint64_t
+hash_mem (uint64_t h, const void *mem, size_t n)
+{
+  const unsigned char *p = (const unsigned char *)mem;
+
+  while (n-- > 0)
+    {
+      h ^= *p++;
+      h *= 1099511628211ULL;
+    }
+  return h;
+}
+
+static uint64_t
+hash_str (uint64_t h, const char *str)
+{
+  if (str == NULL)
+    return hash_mem (h, "\377", 1);
+  return hash_mem (h, str, strlen (str) + 1);
+}
+
 /** APT WORKER MULTI STATE MANAGEMENT
  */
 
@@ -353,6 +384,9 @@ public:
   
   bool init_cache_after_request;  
   myCacheFile *cache;
+  pkgRecords *records;   // see package_record
+  char *cache_status;    // see describe_cache_status
+  char *cache_sources;   // see describe_cache_sources
   pkgDepCache::ActionGroup *action_group;
   static AptWorkerCache *current;
   static bool global_initialized;
@@ -363,7 +397,8 @@ AptWorkerCache *AptWorkerCache::current = 0;
 bool AptWorkerCache::global_initialized = false;
 
 AptWorkerCache::AptWorkerCache ()
-  : init_cache_after_request (false), cache (0)
+  : init_cache_after_request (false), cache (0), records (0),
+    cache_status (0), cache_sources (0)
 {
 }
 
@@ -591,85 +626,556 @@ myCacheFile::Open (OpProgress &Progress, bool WithLock)
   return true;
 }
 
-/* Save the 'extra_info' of the cache.  We first make a copy of the
-   Auto flags in our own extra_info storage so that CACHE_RESET
-   will reset the Auto flags to the state last saved with this
-   function.
+/* The extra_info store
+
+   EXTRA_INFO_STORE holds the 'autoinst' flag and the current domain
+   of every package for which they are not the default.  It is a hash
+   table with fixed size records, keyed by a hash of the package
+   name, that is mmapped when the cache is opened.  Thus, loading
+   only needs to hash the package names.
+
+   Saving does not sync the store itself.  The records that have
+   changed are appended to EXTRA_INFO_JOURNAL as one batch, followed
+   by a commit entry with a checksum, and the journal is synced once.
+   Only then are the records changed in the mapping.  Journal entries
+   hold the new values of records, not differences, so replaying them
+   any number of times over a store that has some or none of them
+   gives the same result.  When the store is opened, all complete
+   batches in the journal are replayed and a torn batch at its end is
+   cut off.  When the journal gets too long, the store is synced and
+   the journal is emptied.
+
+   Domains are recorded by name in the header, so that the records
+   stay valid when the domain configuration changes.  Packages in
+   domains that are no longer configured are in the default domain,
+   as before.
+
+   The store replaces the old 'autoinst' and 'domain.<name>' text
+   files.  When there is no store yet, those files are read and the
+   store is created from them.
 */
 
-void
-myCacheFile::save_extra_info ()
+#define EXTRA_INFO_DIR   "/var/lib/hildon-application-manager"
+#define EXTRA_INFO_STORE EXTRA_INFO_DIR "/extra-info"
+#define EXTRA_INFO_JOURNAL EXTRA_INFO_DIR "/extra-info.journal"
+
+#define EXTRA_INFO_MAGIC            0x45584931
+#define EXTRA_INFO_VERSION          1
+#define EXTRA_INFO_MAX_DOMAINS      64
+#define EXTRA_INFO_DOMAIN_NAME_LEN  64
+#define EXTRA_INFO_MIN_SLOTS        1024
+#define EXTRA_INFO_JOURNAL_MAX      (64*1024)
+
+struct extra_info_store_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t n_slots;      // a power of two
+  uint32_t n_used;
+  uint32_t n_domains;
+  uint32_t reserved;
+  char domain_names[EXTRA_INFO_MAX_DOMAINS][EXTRA_INFO_DOMAIN_NAME_LEN];
+};
+
+struct extra_info_record {
+  uint64_t hash;         // 0 for an unused slot
+  uint8_t autoinst;
+  uint8_t domain;        // index into domain_names
+  uint8_t reserved[6];
+};
+
+enum {
+  extra_info_journal_record = 1,
+  extra_info_journal_domain,
+  extra_info_journal_commit
+};
+
+struct extra_info_journal_entry {
+  uint32_t type;
+  uint32_t count;        // commit: number of entries in the batch
+  uint64_t hash;         // record: as in extra_info_record
+                         // commit: hash_mem of the batch
+  uint8_t autoinst;      // record
+  uint8_t domain;        // record and domain
+  uint8_t reserved[6];
+  char name[EXTRA_INFO_DOMAIN_NAME_LEN];  // domain
+};
+
+static struct {
+  char *data;
+  size_t size;
+  extra_info_store_header *header;
+  extra_info_record *records;
+  off_t journal_size;
+} extra_info_store;
+
+static void extra_info_journal_replay ();
+
+static uint64_t
+package_name_hash (const char *name)
 {
-  if (mkdir ("/var/lib/hildon-application-manager", 0777) < 0
-      && errno != EEXIST)
+  uint64_t h = hash_str (FNV_OFFSET_BASIS, name);
+  return h? h : 1;
+}
+
+static size_t
+extra_info_store_size (uint32_t n_slots)
+{
+  return (sizeof (extra_info_store_header)
+	  + n_slots * sizeof (extra_info_record));
+}
+
+static void
+extra_info_store_close ()
+{
+  if (extra_info_store.data)
+    munmap (extra_info_store.data, extra_info_store.size);
+  extra_info_store.data = NULL;
+  extra_info_store.header = NULL;
+  extra_info_store.records = NULL;
+}
+
+static bool
+extra_info_store_open ()
+{
+  struct stat st;
+
+  extra_info_store_close ();
+
+  int fd = open (EXTRA_INFO_STORE, O_RDWR);
+  if (fd < 0)
+    return false;
+
+  void *data = MAP_FAILED;
+  if (fstat (fd, &st) == 0
+      && st.st_size >= (off_t) sizeof (extra_info_store_header))
+    data = mmap (NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		 fd, 0);
+  close (fd);
+
+  if (data == MAP_FAILED)
+    return false;
+
+  extra_info_store_header *h = (extra_info_store_header *)data;
+  if (h->magic != EXTRA_INFO_MAGIC
+      || h->version != EXTRA_INFO_VERSION
+      || h->n_slots < EXTRA_INFO_MIN_SLOTS
+      || (h->n_slots & (h->n_slots - 1)) != 0
+      || h->n_domains > EXTRA_INFO_MAX_DOMAINS
+      || (size_t) st.st_size != extra_info_store_size (h->n_slots))
     {
-      log_stderr ("/var/lib/hildon-application-manager: %m");
-      return;
+      log_stderr ("ignoring corrupted %s", EXTRA_INFO_STORE);
+      munmap (data, st.st_size);
+      return false;
     }
 
-  FILE *f = fopen ("/var/lib/hildon-application-manager/autoinst", "w");
-  if (f)
+  extra_info_store.data = (char *)data;
+  extra_info_store.size = st.st_size;
+  extra_info_store.header = h;
+  extra_info_store.records =
+    (extra_info_record *)(extra_info_store.data + sizeof (*h));
+
+  /* N_USED might be stale when only some of the pages of the mapping
+     have been written back.
+  */
+  h->n_used = 0;
+  for (uint32_t i = 0; i < h->n_slots; i++)
+    if (extra_info_store.records[i].hash != 0)
+      h->n_used++;
+
+  extra_info_journal_replay ();
+  return true;
+}
+
+/* Find the record for HASH, or the empty slot where it should go.
+ */
+static extra_info_record *
+extra_info_store_find (extra_info_record *records, uint32_t n_slots,
+		       uint64_t hash)
+{
+  uint32_t mask = n_slots - 1;
+  uint32_t i = hash & mask;
+
+  while (records[i].hash != 0 && records[i].hash != hash)
+    i = (i + 1) & mask;
+  return &records[i];
+}
+
+/* Write a new, empty store with N_SLOTS slots that has the domain
+   names and records of the current one, and open it.
+*/
+static bool
+extra_info_store_create (uint32_t n_slots)
+{
+  const char *tmp = EXTRA_INFO_STORE ".new";
+  size_t size = extra_info_store_size (n_slots);
+  char *data = (char *)g_malloc0 (size);
+  extra_info_store_header *h = (extra_info_store_header *)data;
+  extra_info_record *records = (extra_info_record *)(data + sizeof (*h));
+  bool success = false;
+
+  h->magic = EXTRA_INFO_MAGIC;
+  h->version = EXTRA_INFO_VERSION;
+  h->n_slots = n_slots;
+
+  if (extra_info_store.header)
     {
-      pkgDepCache &cache = *DCache;
+      extra_info_store_header *old = extra_info_store.header;
 
-      for (pkgCache::PkgIterator pkg = cache.PkgBegin(); !pkg.end (); pkg++)
+      h->n_domains = old->n_domains;
+      memcpy (h->domain_names, old->domain_names, sizeof (h->domain_names));
+
+      for (uint32_t i = 0; i < old->n_slots; i++)
+	{
+	  extra_info_record *r = &extra_info_store.records[i];
+	  if (r->hash == 0)
+	    continue;
+	  *extra_info_store_find (records, n_slots, r->hash) = *r;
+	  h->n_used++;
+	}
+    }
+
+  if (mkdir (EXTRA_INFO_DIR, 0777) < 0 && errno != EEXIST)
+    log_stderr ("%s: %m", EXTRA_INFO_DIR);
+  else
+    {
+      FILE *f = fopen (tmp, "w");
+      if (f == NULL)
+	log_stderr ("%s: %m", tmp);
+      else
 	{
-	  if (cache[pkg].Flags & pkgCache::Flag::Auto)
+	  if (fwrite (data, size, 1, f) != 1
+	      || fflush (f) || fsync (fileno (f)))
 	    {
-	      extra_info[pkg->ID].autoinst = true;
-	      fprintf (f, "%s\n", pkg.Name ());
+	      log_stderr ("%s: %m", tmp);
+	      fclose (f);
 	    }
+	  else if (fclose (f) || rename (tmp, EXTRA_INFO_STORE) < 0)
+	    log_stderr ("%s: %m", EXTRA_INFO_STORE);
 	  else
-	    extra_info[pkg->ID].autoinst = false;
+	    success = true;
+
+	  if (!success)
+	    unlink (tmp);
 	}
-      fflush (f);
-      fsync (fileno (f));
-      fclose (f);
     }
 
-  for (domain_t i = 0; i < domains_number; i++)
+  g_free (data);
+
+  return success && extra_info_store_open ();
+}
+
+/* Return the index of the domain D in the header of the store,
+   adding it when necessary.  Returns -1 when the domain can not be
+   recorded.
+*/
+static int
+extra_info_store_domain (domain_t d)
+{
+  extra_info_store_header *h = extra_info_store.header;
+  const char *name = domains[d].name;
+
+  for (uint32_t i = 0; i < h->n_domains; i++)
+    if (!strncmp (h->domain_names[i], name, EXTRA_INFO_DOMAIN_NAME_LEN))
+      return i;
+
+  if (h->n_domains == EXTRA_INFO_MAX_DOMAINS
+      || strlen (name) >= EXTRA_INFO_DOMAIN_NAME_LEN)
     {
-      char *name =
-	g_strdup_printf ("/var/lib/hildon-application-manager/domain.%s",
-			 domains[i].name);
-      
-      FILE *f = fopen (name, "w");
-      if (f)
+      log_stderr ("can't record domain %s", name);
+      return -1;
+    }
+
+  strcpy (h->domain_names[h->n_domains], name);
+  return h->n_domains++;
+}
+
+/* Apply the journal entry E to the store.  Returns false when it
+   can not be applied.
+*/
+static bool
+extra_info_store_apply (const extra_info_journal_entry *e)
+{
+  extra_info_store_header *h = extra_info_store.header;
+
+  if (e->type == extra_info_journal_domain)
+    {
+      if (e->domain >= EXTRA_INFO_MAX_DOMAINS
+	  || memchr (e->name, 0, sizeof (e->name)) == NULL)
+	return false;
+      strcpy (h->domain_names[e->domain], e->name);
+      if (h->n_domains <= e->domain)
+	h->n_domains = e->domain + 1;
+      return true;
+    }
+  else if (e->type == extra_info_journal_record && e->hash != 0)
+    {
+      extra_info_record *r =
+	extra_info_store_find (extra_info_store.records, h->n_slots, e->hash);
+      if (r->hash == 0)
 	{
-	  pkgDepCache &cache = *DCache;
+	  /* Always leave an empty slot so that
+	     extra_info_store_find terminates.
+	  */
+	  if (h->n_used + 1 >= h->n_slots)
+	    return false;
+	  r->hash = e->hash;
+	  h->n_used++;
+	}
+      r->autoinst = e->autoinst;
+      r->domain = e->domain;
+      return true;
+    }
+  else
+    return false;
+}
 
-	  for (pkgCache::PkgIterator pkg = cache.PkgBegin();
-	       !pkg.end (); pkg++)
-	    {
-	      if (extra_info[pkg->ID].cur_domain == i)
-		fprintf (f, "%s\n", pkg.Name ());
-	    }
-	  fflush (f);
-	  fsync (fileno (f));
-	  fclose (f);
+static void
+extra_info_journal_truncate (off_t size)
+{
+  if (truncate (EXTRA_INFO_JOURNAL, size) < 0 && errno != ENOENT)
+    log_stderr ("%s: %m", EXTRA_INFO_JOURNAL);
+  extra_info_store.journal_size = size;
+}
+
+/* Replay all complete batches in the journal and cut off anything
+   after the last one.
+*/
+static void
+extra_info_journal_replay ()
+{
+  gchar *contents;
+  gsize length;
+
+  extra_info_store.journal_size = 0;
+  if (!g_file_get_contents (EXTRA_INFO_JOURNAL, &contents, &length, NULL))
+    return;
+
+  const extra_info_journal_entry *entries =
+    (const extra_info_journal_entry *)contents;
+  size_t n_entries = length / sizeof (extra_info_journal_entry);
+  size_t start = 0, good = 0;
+
+  for (size_t i = 0; i < n_entries; i++)
+    {
+      const extra_info_journal_entry *c = &entries[i];
+
+      if (c->type != extra_info_journal_commit)
+	continue;
+
+      if (c->count != i - start
+	  || c->hash != hash_mem (FNV_OFFSET_BASIS, &entries[start],
+				  c->count * sizeof (*c)))
+	break;
+
+      bool applied = true;
+      for (size_t j = start; j < i && applied; j++)
+	applied = extra_info_store_apply (&entries[j]);
+      if (!applied)
+	break;
+
+      start = good = i + 1;
+    }
+
+  g_free (contents);
+
+  off_t good_size = good * sizeof (extra_info_journal_entry);
+  if ((size_t) good_size != length)
+    {
+      log_stderr ("discarding incomplete end of %s", EXTRA_INFO_JOURNAL);
+      extra_info_journal_truncate (good_size);
+    }
+  else
+    extra_info_store.journal_size = good_size;
+}
+
+/* Append BATCH and a commit entry for it to the journal, and sync
+   it.  Returns false when the batch has not been committed.
+*/
+static bool
+extra_info_journal_commit (GArray *batch)
+{
+  extra_info_journal_entry c;
+
+  memset (&c, 0, sizeof (c));
+  c.type = extra_info_journal_commit;
+  c.count = batch->len;
+  c.hash = hash_mem (FNV_OFFSET_BASIS, batch->data,
+		     batch->len * sizeof (extra_info_journal_entry));
+  g_array_append_val (batch, c);
+
+  const char *data = batch->data;
+  size_t len = batch->len * sizeof (extra_info_journal_entry);
+  bool success = false;
+
+  int fd = open (EXTRA_INFO_JOURNAL, O_WRONLY | O_APPEND | O_CREAT, 0644);
+  if (fd >= 0)
+    {
+      while (len > 0)
+	{
+	  ssize_t n = write (fd, data, len);
+	  if (n < 0 && errno == EINTR)
+	    continue;
+	  if (n <= 0)
+	    break;
+	  data += n;
+	  len -= n;
 	}
+      success = (len == 0 && fdatasync (fd) == 0);
+      if (!success)
+	log_stderr ("%s: %m", EXTRA_INFO_JOURNAL);
+      close (fd);
     }
+  else
+    log_stderr ("%s: %m", EXTRA_INFO_JOURNAL);
+
+  if (success)
+    extra_info_store.journal_size += batch->len * sizeof (c);
+  else
+    extra_info_journal_truncate (extra_info_store.journal_size);
+
+  return success;
 }
 
-/* Load the 'extra_info'.  You need to call CACHE_RESET to
-   transfer the auto flag into the actual cache.  */
+/* Write everything in the journal into the store and empty the
+   journal.
+*/
+static void
+extra_info_journal_compact ()
+{
+  if (msync (extra_info_store.data, extra_info_store.size, MS_SYNC) < 0)
+    log_stderr ("%s: %m", EXTRA_INFO_STORE);
+  else
+    extra_info_journal_truncate (0);
+}
 
-void
-myCacheFile::load_extra_info ()
+/* Bring the store up to date with EXTRA_INFO.  Returns false when
+   the changes could not be committed.
+*/
+static bool
+store_extra_info (pkgCache &cache, extra_info_struct *extra_info)
 {
-  pkgCache &cache = *Cache;
+  if (extra_info_store.data == NULL
+      && !extra_info_store_open ()
+      && !extra_info_store_create (EXTRA_INFO_MIN_SLOTS))
+    return false;
 
-  int package_count = cache.Head().PackageCount;
+  GArray *batch = g_array_new (FALSE, TRUE,
+			       sizeof (extra_info_journal_entry));
+  extra_info_journal_entry e;
+  extra_info_store_header *h = extra_info_store.header;
 
-  extra_info = new extra_info_struct[package_count];
+  /* Map our domains to the ones in the store, journaling the ones
+     that are new.
+  */
+  int *store_domain = new int[domains_number];
+  for (domain_t i = 0; i < domains_number; i++)
+    {
+      uint32_t n_domains = h->n_domains;
+      store_domain[i] = extra_info_store_domain (i);
+      if (h->n_domains != n_domains)
+	{
+	  memset (&e, 0, sizeof (e));
+	  e.type = extra_info_journal_domain;
+	  e.domain = store_domain[i];
+	  strcpy (e.name, h->domain_names[store_domain[i]]);
+	  g_array_append_val (batch, e);
+	}
+    }
+  int default_domain = store_domain[DOMAIN_DEFAULT];
 
-  for (int i = 0; i < package_count; i++)
+  uint32_t n_new = 0;
+  for (pkgCache::PkgIterator pkg = cache.PkgBegin(); !pkg.end (); pkg++)
     {
-      extra_info[i].autoinst = false;
-      extra_info[i].cur_domain = DOMAIN_DEFAULT;
+      extra_info_struct &info = extra_info[pkg->ID];
+      int domain = store_domain[info.cur_domain];
+      if (domain < 0)
+	domain = default_domain;
+
+      uint64_t hash = package_name_hash (pkg.Name ());
+      extra_info_record *r =
+	extra_info_store_find (extra_info_store.records, h->n_slots, hash);
+
+      /* Records of packages that are back to the defaults are kept,
+	 they are likely to be needed again.
+      */
+      if (r->hash == 0)
+	{
+	  if (!info.autoinst && domain == default_domain)
+	    continue;
+	  n_new++;
+	}
+      else if (r->autoinst == info.autoinst && r->domain == (uint8_t) domain)
+	continue;
+
+      memset (&e, 0, sizeof (e));
+      e.type = extra_info_journal_record;
+      e.hash = hash;
+      e.autoinst = info.autoinst;
+      e.domain = domain;
+      g_array_append_val (batch, e);
+    }
+
+  delete[] store_domain;
+
+  bool success = true;
+
+  if (batch->len > 0)
+    {
+      /* Keep the table at most half full.  The bigger store has only
+	 the committed records, the batch goes into the journal as
+	 usual.
+      */
+      uint32_t n_slots = h->n_slots;
+      while (2 * (h->n_used + n_new) > n_slots)
+	n_slots *= 2;
+
+      if (n_slots != h->n_slots && !extra_info_store_create (n_slots))
+	success = false;
+      else if (!extra_info_journal_commit (batch))
+	success = false;
+      else
+	{
+	  for (guint i = 0; i < batch->len - 1; i++)
+	    extra_info_store_apply (&g_array_index (batch,
+						    extra_info_journal_entry,
+						    i));
+	  if (extra_info_store.journal_size > EXTRA_INFO_JOURNAL_MAX)
+	    extra_info_journal_compact ();
+	}
     }
 
-  FILE *f = fopen ("/var/lib/hildon-application-manager/autoinst", "r");
+  g_array_free (batch, TRUE);
+
+  return success;
+}
+
+/* Save the 'extra_info' of the cache.  We first make a copy of the
+   Auto flags in our own extra_info storage so that CACHE_RESET
+   will reset the Auto flags to the state last saved with this
+   function.
+*/
+
+void
+myCacheFile::save_extra_info ()
+{
+  pkgDepCache &cache = *DCache;
+
+  for (pkgCache::PkgIterator pkg = cache.PkgBegin(); !pkg.end (); pkg++)
+    extra_info[pkg->ID].autoinst =
+      (cache[pkg].Flags & pkgCache::Flag::Auto) != 0;
+
+  store_extra_info (*Cache, extra_info);
+}
+
+/* Read the old text files with the 'extra_info', and remove them
+   once their content is in the store.
+*/
+static void
+load_legacy_extra_info (pkgCache &cache, extra_info_struct *extra_info)
+{
+  GSList *files = NULL;
+
+  FILE *f = fopen (EXTRA_INFO_DIR "/autoinst", "r");
   if (f)
     {
       char *line = NULL;
@@ -691,13 +1197,13 @@ myCacheFile::load_extra_info ()
 
       free (line);
       fclose (f);
+      files = g_slist_prepend (files, g_strdup (EXTRA_INFO_DIR "/autoinst"));
     }
 
   for (domain_t i = 0; i < domains_number; i++)
     {
       char *name =
-	g_strdup_printf ("/var/lib/hildon-application-manager/domain.%s",
-			 domains[i].name);
+	g_strdup_printf (EXTRA_INFO_DIR "/domain.%s", domains[i].name);
 
       FILE *f = fopen (name, "r");
       if (f)
@@ -721,34 +1227,98 @@ myCacheFile::load_extra_info ()
 
 	  free (line);
 	  fclose (f);
+	  files = g_slist_prepend (files, name);
 	}
+      else
+	g_free (name);
+    }
 
-      g_free (name);
+  if (files && store_extra_info (cache, extra_info))
+    {
+      for (GSList *l = files; l; l = l->next)
+	unlink ((char *)l->data);
     }
+
+  g_slist_foreach (files, (GFunc) g_free, NULL);
+  g_slist_free (files);
 }
 
-/* ALLOC_BUF and FREE_BUF can be used to manage a temporary buffer of
-   arbitrary size without having to allocate memory from the heap when
-   the buffer is small.
-   
-   The way to use them is to allocate a buffer of 'normal' but fixed
-   size statically or on the stack and the use ALLOC_BUF when the
-   actual size of the needed buffer is known.  If the actual size is
-   small enough, ALLOC_BUF will use the fixed size buffer, otherwise
-   it will allocate a new one.  FREE_BUF will free that buffer.
-*/
+/* Load the 'extra_info'.  You need to call CACHE_RESET to
+   transfer the auto flag into the actual cache.  */
 
-/* Return a pointer to LEN bytes of free storage.  When LEN is less
-   than or equal to FIXED_BUF_LEN return FIXED_BUF, otherwise a newly
-   allocated block of memory is returned.  ALLOC_BUF never return
-   NULL.
-*/
-char *
-alloc_buf (int len, char *fixed_buf, int fixed_buf_len)
+void
+myCacheFile::load_extra_info ()
 {
-  if (len <= fixed_buf_len)
-    return fixed_buf;
-  else
+  pkgCache &cache = *Cache;
+
+  int package_count = cache.Head().PackageCount;
+
+  extra_info = new extra_info_struct[package_count];
+
+  for (int i = 0; i < package_count; i++)
+    {
+      extra_info[i].autoinst = false;
+      extra_info[i].cur_domain = DOMAIN_DEFAULT;
+    }
+
+  if (!extra_info_store_open ())
+    {
+      load_legacy_extra_info (cache, extra_info);
+      return;
+    }
+
+  /* Map the domains in the store to ours.
+   */
+  extra_info_store_header *h = extra_info_store.header;
+  domain_t our_domain[EXTRA_INFO_MAX_DOMAINS];
+  for (uint32_t i = 0; i < h->n_domains; i++)
+    {
+      our_domain[i] = DOMAIN_DEFAULT;
+      for (domain_t d = 0; d < domains_number; d++)
+	if (!strncmp (h->domain_names[i], domains[d].name,
+		      EXTRA_INFO_DOMAIN_NAME_LEN))
+	  {
+	    our_domain[i] = d;
+	    break;
+	  }
+    }
+
+  for (pkgCache::PkgIterator pkg = cache.PkgBegin(); !pkg.end (); pkg++)
+    {
+      extra_info_record *r =
+	extra_info_store_find (extra_info_store.records, h->n_slots,
+			       package_name_hash (pkg.Name ()));
+      if (r->hash == 0)
+	continue;
+
+      extra_info[pkg->ID].autoinst = r->autoinst;
+      if (r->domain < h->n_domains)
+	extra_info[pkg->ID].cur_domain = our_domain[r->domain];
+    }
+}
+
+/* ALLOC_BUF and FREE_BUF can be used to manage a temporary buffer of
+   arbitrary size without having to allocate memory from the heap when
+   the buffer is small.
+   
+   The way to use them is to allocate a buffer of 'normal' but fixed
+   size statically or on the stack and the use ALLOC_BUF when the
+   actual size of the needed buffer is known.  If the actual size is
+   small enough, ALLOC_BUF will use the fixed size buffer, otherwise
+   it will allocate a new one.  FREE_BUF will free that buffer.
+*/
+
+/* Return a pointer to LEN bytes of free storage.  When LEN is less
+   than or equal to FIXED_BUF_LEN return FIXED_BUF, otherwise a newly
+   allocated block of memory is returned.  ALLOC_BUF never return
+   NULL.
+*/
+char *
+alloc_buf (int len, char *fixed_buf, int fixed_buf_len)
+{
+  if (len <= fixed_buf_len)
+    return fixed_buf;
+  else
     return new char[len];
 }
 
@@ -793,31 +1363,15 @@ block_for_read (int fd)
   FD_ZERO (&set);
   FD_SET (fd, &set);
 
-  if (select (fd+1, &set, NULL, NULL, NULL) < 0)
+  while (select (fd+1, &set, NULL, NULL, NULL) < 0)
     {
+      if (errno == EINTR)
+	continue;
       perror ("apt-worker select");
       exit (1);
     }
 }
 
-static int
-read_byte (int fd)
-{
-  unsigned char byte;
-  if (read (fd, &byte, 1) == 1)
-    return byte;
-  return -1;
-}
-
-/* DRAIN_FD reads all bytes from FD that are available.
-*/
-static void
-drain_fd (int fd)
-{
-  while (read_byte (fd) >= 0)
-    ;
-}
-
 /* Get a lock as with GetLock from libapt-pkg, breaking it if needed
    and allowed by flag_break_locks.
 
@@ -876,6 +1430,16 @@ ForceLock (string File, bool Errors = true)
 
 int input_fd, output_fd, status_fd, cancel_fd;
 
+/* Tells us cheaply whether a byte has arrived on CANCEL_FD.  See
+   <apt-worker-proto.h>.
+*/
+static apt_proto_cancel_watch cancel_watch;
+
+/* The response ring, if the frontend has given us one.  See
+   <apt-worker-proto.h>.
+*/
+static apt_proto_ring response_ring;
+
 /* MUST_READ and MUST_WRITE read and write blocks of raw bytes from
    INPUT_FD and to OUTPUT_FD.  If they return, they have succeeded and
    read or written the whole block.
@@ -889,7 +1453,9 @@ must_read (void *buf, size_t n)
   while (n > 0)
     {
       r = read (input_fd, buf, n);
-      if (r < 0)
+      if (r < 0 && errno == EINTR)
+	continue;
+      else if (r < 0)
 	{
 	  perror ("apt-worker read");
 	  exit (1);
@@ -904,25 +1470,78 @@ must_read (void *buf, size_t n)
     }
 }
 
+/* A SIGIO from the cancel_watch can interrupt a write to a full fifo
+   after some of the data has been written, so we loop.
+*/
 static void
 must_write (void *buf, ssize_t n)
 {
-  if (n > 0 && write (output_fd, buf, n) != n)
+  ssize_t r;
+
+  while (n > 0)
     {
-      perror ("apt-worker write");
-      exit (1);
+      r = write (output_fd, buf, n);
+      if (r < 0 && errno == EINTR)
+	continue;
+      else if (r <= 0)
+	{
+	  perror ("apt-worker write");
+	  exit (1);
+	}
+      n -= r;
+      buf = ((char *)buf) + r;
     }
 }
 
+/* While a query server is running, see "Queries during long
+   operations" below, it and we both send responses on OUTPUT_FD and
+   each response must be written as a whole.  The lock is a pipe with
+   a single byte in it: whoever has read the byte holds the lock.
+   There is no lock when no query server is running.
+*/
+static int output_lock_fds[2] = { -1, -1 };
+
+static void
+lock_output ()
+{
+  unsigned char byte;
+
+  if (output_lock_fds[0] < 0)
+    return;
+
+  while (read (output_lock_fds[0], &byte, 1) < 0 && errno == EINTR)
+    ;
+}
+
+static void
+unlock_output ()
+{
+  unsigned char byte = 0;
+
+  if (output_lock_fds[1] < 0)
+    return;
+
+  while (write (output_lock_fds[1], &byte, 1) < 0 && errno == EINTR)
+    ;
+}
+
 /* This function sends a response on OUTPUT_FD with the given CMD and
    SEQ.  It either succeeds or does not return.
+
+   The data goes into the response ring when it fits there, and
+   follows the header on OUTPUT_FD otherwise.
 */
 void
 send_response_raw (int cmd, int seq, void *response, size_t len)
 {
-  apt_response_header res = { cmd, seq, len };
+  apt_response_header res = { cmd, seq, len, -1 };
+
+  lock_output ();
+  res.offset = response_ring.put (response, len);
   must_write (&res, sizeof (res));
-  must_write (response, len);
+  if (res.offset < 0)
+    must_write (response, len);
+  unlock_output ();
 }
 
 /* Fabricate and send a APTCMD_STATUS response.  Parameters OP,
@@ -934,6 +1553,12 @@ send_response_raw (int cmd, int seq, void *response, size_t len)
    -1, LAST_TOTAL has changed, or OP has changed.
 */
 
+/* The encoding of all responses, see <apt-worker-proto.h>.  It is
+   changed with the SET_ENCODING command.
+*/
+static int response_encoding = encoding_classic;
+static int next_response_encoding = encoding_classic;
+
 void
 send_status (int op, int already, int total, int min_change)
 {
@@ -953,7 +1578,7 @@ send_status (int op, int already, int total, int min_change)
       last_total = total;
       last_op = op;
       
-      status_response.reset ();
+      status_response.set_encoding (response_encoding);
       status_response.encode_int (op);
       status_response.encode_int (already);
       status_response.encode_int (total);
@@ -979,8 +1604,30 @@ send_status (int op, int already, int total, int min_change)
 apt_proto_decoder request;
 apt_proto_encoder response;
 
+/* The sequence number of the request that is currently being
+   handled.  SEND_PARTIAL_RESPONSE needs it.
+*/
+static int current_seq = -1;
+
+/* Ship out what has been accumulated in RESPONSE so far as a
+   APTCMD_PARTIAL response and start over with an empty RESPONSE.
+   This is used by commands that stream their results, see
+   <apt-worker-proto.h>.
+*/
+void
+send_partial_response ()
+{
+  send_response_raw (APTCMD_PARTIAL, current_seq,
+		     response.get_buf (), response.get_len ());
+  current_response_bytes += response.get_len ();
+  response.reset ();
+}
+
 void cmd_get_package_list ();
+void cmd_get_package_list_delta ();
+void cmd_get_icons ();
 void cmd_get_package_info ();
+void cmd_get_package_infos ();
 void cmd_get_package_details ();
 int cmd_check_updates (bool with_status = true);
 void cmd_get_catalogues ();
@@ -1003,6 +1650,8 @@ void cmd_set_options ();
 void cmd_set_env ();
 void cmd_third_party_policy_check ();
 void cmd_autoremove ();
+void cmd_set_encoding ();
+void cmd_get_stats ();
 
 int cmdline_check_updates (char **argv);
 int cmdline_rescue (char **argv);
@@ -1043,6 +1692,21 @@ static xexp *map_catalogue_error_details (xexp *x);
 */
 
 void cache_init (bool with_status = true);
+void cache_refresh ();
+void cache_rebuild (bool with_status);
+static bool cache_rebuild_pending ();
+static void finish_cache_rebuild ();
+static bool is_served_during_rebuild (int cmd);
+static void wait_for_request ();
+
+/* True in the child that answers queries during a long operation.
+ */
+static bool in_query_server = false;
+static int query_server_stop_fd = -1;
+static void start_query_server ();
+static void stop_query_server ();
+static void prefetch_before_request (int cmd);
+static void remove_stale_lists_generations (bool always);
 
 void
 need_cache_init ()
@@ -1051,12 +1715,15 @@ need_cache_init ()
   awc->init_cache_after_request = true;
 }
 
-#ifdef DEBUG_COMMANDS
-static const char *cmd_names[] = {
+/* Indexed by apt_command.
+ */
+static const char *cmd_names[APTCMD_MAX] = {
   "NOOP",
   "STATUS",
   "GET_PACKAGE_LIST",
+  "GET_PACKAGE_LIST_DELTA",
   "GET_PACKAGE_INFO",
+  "GET_PACKAGE_INFOS",
   "GET_PACKAGE_DETAILS",
   "CHECK_UPDATES",
   "GET_CATALOGUES",
@@ -1065,6 +1732,7 @@ static const char *cmd_names[] = {
   "RM_TEMP_CATALOGUES",
   "GET_FREE_SPACE",
   "INSTALL_CHECK",
+  "DOWNLOAD_PACKAGE",
   "INSTALL_PACKAGE",
   "REMOVE_CHECK",
   "REMOVE_PACKAGE",
@@ -1077,9 +1745,107 @@ static const char *cmd_names[] = {
   "SET_OPTIONS",
   "SET_ENV",
   "THIRD_PARTY_POLICY_CHECK",
-  "AUTOREMOVE"
+  "AUTOREMOVE",
+  "SET_ENCODING",
+  "GET_STATS",
+  "GET_ICONS",
+  "PARTIAL",
+  "EXIT"
 };
-#endif
+
+/** STATISTICS
+
+    We always keep some statistics about how much time each command
+    takes and how much data it moves.  They can be retrieved with
+    the GET_STATS command.
+
+    The times are collected into a histogram with buckets that are
+    powers of two, in microseconds: bucket 0 counts times below 1
+    usec, and bucket N counts times from 2^(N-1) to 2^N usecs.  The
+    percentiles that we report are the upper bounds of the bucket
+    that contains them, so they are accurate to a factor of two.
+*/
+
+#define STATS_BUCKETS 36
+
+struct time_stats {
+  int count;
+  int64_t total_usecs;
+  int64_t max_usecs;
+  int histogram[STATS_BUCKETS];
+};
+
+struct cmd_stats {
+  time_stats times;
+  int64_t request_bytes;
+  int64_t response_bytes;
+};
+
+static cmd_stats command_stats[APTCMD_MAX];
+static time_stats cache_init_stats;
+static time_stats cache_refresh_stats;
+
+/* The number of response bytes sent for the current request,
+   including APTCMD_PARTIAL responses.
+*/
+static int64_t current_response_bytes;
+
+static int64_t
+get_usecs ()
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+stats_add_time (time_stats *st, int64_t usecs)
+{
+  int bucket = 0;
+
+  while (bucket < STATS_BUCKETS - 1 && (((int64_t)1) << bucket) <= usecs)
+    bucket++;
+
+  st->count++;
+  st->total_usecs += usecs;
+  if (usecs > st->max_usecs)
+    st->max_usecs = usecs;
+  st->histogram[bucket]++;
+}
+
+static int64_t
+stats_percentile (time_stats *st, int percent)
+{
+  int64_t needed = ((int64_t)st->count * percent + 99) / 100;
+  int64_t seen = 0;
+
+  for (int bucket = 0; bucket < STATS_BUCKETS; bucket++)
+    {
+      seen += st->histogram[bucket];
+      if (seen >= needed && seen > 0)
+	return (bucket == STATS_BUCKETS - 1)? st->max_usecs : ((int64_t)1) << bucket;
+    }
+
+  return 0;
+}
+
+static void
+xexp_aset_int64 (xexp *x, const char *tag, int64_t val)
+{
+  char *str = g_strdup_printf ("%lld", (long long)val);
+  xexp_aset_text (x, tag, str);
+  g_free (str);
+}
+
+static void
+encode_time_stats (xexp *x, time_stats *st)
+{
+  xexp_aset_int (x, "count", st->count);
+  xexp_aset_int64 (x, "p50-usecs", stats_percentile (st, 50));
+  xexp_aset_int64 (x, "p99-usecs", stats_percentile (st, 99));
+  xexp_aset_int64 (x, "max-usecs", st->max_usecs);
+  xexp_aset_int64 (x, "total-usecs", st->total_usecs);
+}
 
 void
 handle_request ()
@@ -1090,6 +1856,7 @@ handle_request ()
   AptWorkerCache * awc = 0;
   time_t last_modified = -1;
 
+  wait_for_request ();
   must_read (&req, sizeof (req));
 
 #ifdef DEBUG_COMMANDS
@@ -1099,10 +1866,28 @@ handle_request ()
   reqbuf = alloc_buf (req.len, stack_reqbuf, FIXED_REQUEST_BUF_SIZE);
   must_read (reqbuf, req.len);
 
-  drain_fd (cancel_fd);
+  int64_t start_usecs = get_usecs ();
+  current_response_bytes = 0;
+
+  if (cache_rebuild_pending () && !is_served_during_rebuild (req.cmd))
+    finish_cache_rebuild ();
+
+  prefetch_before_request (req.cmd);
+
+  cancel_watch.drain ();
 
   request.reset (reqbuf, req.len);
   response.reset ();
+  current_seq = req.seq;
+
+  int cmd = req.cmd;
+  if (in_query_server && !apt_proto_is_query (cmd))
+    {
+      log_stderr ("not a query: %d", cmd);
+      cmd = APTCMD_NOOP;
+    }
+  else if (apt_proto_is_long_operation (cmd))
+    start_query_server ();
 
   awc = AptWorkerCache::GetCurrent ();
   awc->init_cache_after_request = false; // let's reset it now
@@ -1112,7 +1897,7 @@ handle_request ()
   if (last_modified != domains_last_modified)
     read_domain_conf ();
 
-  switch (req.cmd)
+  switch (cmd)
     {
 
     case APTCMD_NOOP:
@@ -1123,10 +1908,18 @@ handle_request ()
       cmd_get_package_list ();
       break;
 
+    case APTCMD_GET_PACKAGE_LIST_DELTA:
+      cmd_get_package_list_delta ();
+      break;
+
     case APTCMD_GET_PACKAGE_INFO:
       cmd_get_package_info ();
       break;
 
+    case APTCMD_GET_PACKAGE_INFOS:
+      cmd_get_package_infos ();
+      break;
+
     case APTCMD_GET_PACKAGE_DETAILS:
       cmd_get_package_details ();
       break;
@@ -1215,6 +2008,18 @@ handle_request ()
       cmd_autoremove ();
       break;
 
+    case APTCMD_SET_ENCODING:
+      cmd_set_encoding ();
+      break;
+
+    case APTCMD_GET_STATS:
+      cmd_get_stats ();
+      break;
+
+    case APTCMD_GET_ICONS:
+      cmd_get_icons ();
+      break;
+
     case APTCMD_EXIT:
       exit(0);
       break;
@@ -1226,8 +2031,29 @@ handle_request ()
 
   _error->DumpErrors ();
 
+  /* The frontend sees the changes of the operation as soon as it has
+     the response, so nobody must answer from the old cache after
+     that.
+  */
+  stop_query_server ();
+
   send_response_raw (req.cmd, req.seq,
 		     response.get_buf (), response.get_len ());
+  current_response_bytes += response.get_len ();
+
+  if (req.cmd >= 0 && req.cmd < APTCMD_MAX)
+    {
+      cmd_stats *st = &command_stats[req.cmd];
+      stats_add_time (&st->times, get_usecs () - start_usecs);
+      st->request_bytes += req.len;
+      st->response_bytes += current_response_bytes;
+    }
+
+  if (next_response_encoding != response_encoding)
+    {
+      response_encoding = next_response_encoding;
+      response.set_encoding (response_encoding);
+    }
 
 #ifdef DEBUG_COMMANDS
   DBG ("sent resp %s/%d/%d",
@@ -1238,9 +2064,11 @@ handle_request ()
 
   if (awc->init_cache_after_request)
     {
-      cache_init (false);
+      cache_refresh ();
       _error->DumpErrors ();
     }
+
+  remove_stale_lists_generations (false);
 }
 
 static int index_trust_level_for_package (pkgIndexFile *index,
@@ -1450,6 +2278,52 @@ cmd_set_options ()
   set_options (options);
 }
 
+void
+cmd_set_encoding ()
+{
+  int encoding = request.decode_int ();
+
+  if (encoding != encoding_compact)
+    encoding = encoding_classic;
+
+  /* The switch happens after this response has been sent.
+   */
+  next_response_encoding = encoding;
+  response.encode_int (encoding);
+}
+
+void
+cmd_get_stats ()
+{
+  xexp *stats = xexp_list_new ("stats");
+
+  for (int cmd = 0; cmd < APTCMD_MAX; cmd++)
+    {
+      cmd_stats *st = &command_stats[cmd];
+      if (st->times.count == 0)
+	continue;
+
+      xexp *x = xexp_list_new ("command");
+      xexp_aset_text (x, "name", cmd_names[cmd]);
+      encode_time_stats (x, &st->times);
+      xexp_aset_int64 (x, "request-bytes", st->request_bytes);
+      xexp_aset_int64 (x, "response-bytes", st->response_bytes);
+      xexp_cons (stats, x);
+    }
+  xexp_reverse (stats);
+
+  xexp *x = xexp_list_new ("cache-init");
+  encode_time_stats (x, &cache_init_stats);
+  xexp_append_1 (stats, x);
+
+  x = xexp_list_new ("cache-refresh");
+  encode_time_stats (x, &cache_refresh_stats);
+  xexp_append_1 (stats, x);
+
+  response.encode_xexp (stats);
+  xexp_free (stats);
+}
+
 void
 cmd_set_env ()
 {
@@ -1518,7 +2392,7 @@ main (int argc, char **argv)
     {
       const char *options;
 
-      if (argc != 6)
+      if (argc != 6 && argc != 7)
 	{
 	  log_stderr ("wrong invocation");
 	  exit (1);
@@ -1552,6 +2426,24 @@ main (int argc, char **argv)
       g_free (status_pipe);
       g_free (cancel_pipe);
 
+      /* The optional response ring.  The frontend removes the file
+	 as soon as it sees our first response, so we must open it
+	 before sending that.  Without it, everything goes through the
+	 fifos.
+      */
+      if (argc == 7)
+	{
+	  int ring_fd = open (argv[6], O_RDWR | O_NOFOLLOW);
+	  if (ring_fd < 0)
+	    perror (argv[6]);
+	  else
+	    {
+	      if (!response_ring.attach (ring_fd))
+		log_stderr ("not using response ring %s", argv[6]);
+	      close (ring_fd);
+	    }
+	}
+
       /* This tells the frontend that the fifos are open.
        */
       send_status (op_general, 0, 0, -1);
@@ -1567,6 +2459,12 @@ main (int argc, char **argv)
       */
       must_set_flags (input_fd, O_RDONLY);
 
+      /* Only poll it when we have been told that there is something
+	 to read.
+      */
+      if (!cancel_watch.watch (cancel_fd))
+	log_stderr ("polling cancel fifo: %m");
+
       options = argv[5];
 
       DBG ("starting with pid %d, in %d, out %d, stat %d, cancel %d, options %s",
@@ -1584,6 +2482,8 @@ main (int argc, char **argv)
       get_apt_worker_lock (false);
       misc_init ();
 
+      background_rebuilds = true;
+
       while (true)
 	handle_request ();
 
@@ -1698,6 +2598,8 @@ public:
   UpdateProgress (bool ws) : with_status (ws) { }
 };
 
+static void archive_downloaded (const string &file);
+
 class DownloadStatus : public pkgAcquireStatus
 {
   virtual bool
@@ -1706,6 +2608,13 @@ class DownloadStatus : public pkgAcquireStatus
     return false;
   }
 
+  virtual void
+  Done (pkgAcquire::ItemDesc &Itm)
+  {
+    pkgAcquireStatus::Done (Itm);
+    archive_downloaded (Itm.Owner->DestFile);
+  }
+
   virtual bool
   Pulse (pkgAcquire *Owner)
   {
@@ -1713,9 +2622,7 @@ class DownloadStatus : public pkgAcquireStatus
 
     send_status (op_downloading, (int)CurrentBytes, (int)TotalBytes, 1000);
 
-    /* The cancel_fd is in non-blocking mode.
-     */
-    if (read_byte (cancel_fd) >= 0)
+    if (cancel_watch.cancelled ())
       return false;
 
     return true;
@@ -1872,6 +2779,48 @@ clear_dpkg_updates ()
 
 void cache_reset ();
 
+/* Close the write end of the pipe that keeps the query server
+   running.  Every child that we fork must do this, or the query
+   server will not exit until that child does.
+*/
+static void
+close_query_server_stop_fd ()
+{
+  if (query_server_stop_fd >= 0)
+    close (query_server_stop_fd);
+  query_server_stop_fd = -1;
+}
+
+/* A child that reads package records while we keep working needs
+   its own pkgRecords: the inherited one shares its file offsets with
+   ours.  Open it with open_child_records before forking, so that it
+   reads the same files as ours, pass it to use_child_records in the
+   child, and delete it in the parent.
+*/
+static pkgRecords *
+open_child_records ()
+{
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+  if (awc->cache == NULL)
+    return NULL;
+  return new pkgRecords (*awc->cache);
+}
+
+static void
+use_child_records (pkgRecords *records)
+{
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+  if (records)
+    {
+      delete awc->records;
+      awc->records = records;
+    }
+}
+
+/* Increased with every cache_init, see GET_PACKAGE_LIST_DELTA.
+ */
+static int cache_generation = 0;
+
 /* The operation represented by the cache.
  */
 static char *current_cache_package = NULL;
@@ -1893,30 +2842,435 @@ check_cache_state (const char *package, bool is_install)
   return false;
 }
 
-/* Initialize libapt-pkg if this has not been done already and
-   (re-)create PACKAGE_CACHE.  If the cache can not be created,
-   PACKAGE_CACHE is set to NULL and an appropriate message is output.
-   */
-void
-cache_init (bool with_status)
+/* The files that the cache is created from are described by a
+   string with their identity, size and modification time.  When the
+   description is the same after a command has asked for a new cache,
+   the cache would come out the same and resetting it is enough.
+*/
+
+static void
+describe_cache_input (GString *desc, const char *file)
 {
-  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+  struct stat st;
 
-  /* Closes the cache, to prevent getting blocked by other locks in
-   * dpkg structures. If we don't do it, changing the apt worker state
-   * does not remove the dpkg state lock and then fails on trying to
-   * run dpkg */
-  /* @todo do we really keep doing this? */
-  if (awc->cache)
-    {
-      DBG ("closing");
-      delete awc->action_group;
-      awc->cache->Close ();
-      delete awc->cache;
+  if (stat (file, &st) < 0)
+    g_string_append_printf (desc, "%s -\n", file);
+  else
+    g_string_append_printf (desc, "%s %lu %lu %lld %ld.%09ld\n", file,
+			    (unsigned long) st.st_dev,
+			    (unsigned long) st.st_ino,
+			    (long long) st.st_size,
+			    (long) st.st_mtim.tv_sec,
+			    (long) st.st_mtim.tv_nsec);
+}
+
+static void
+describe_cache_input_dir (GString *desc, const char *dir)
+{
+  describe_cache_input (desc, dir);
+
+  DIR *d = opendir (dir);
+  if (d == NULL)
+    return;
+
+  struct dirent *ent;
+  while ((ent = readdir (d)) != NULL)
+    {
+      if (ent->d_name[0] == '.')
+	continue;
+      char *file = g_build_filename (dir, ent->d_name, NULL);
+      describe_cache_input (desc, file);
+      g_free (file);
+    }
+  closedir (d);
+}
+
+/* The status of installed packages.  Dpkg replaces its status file,
+   so its identity is enough.
+*/
+static char *
+describe_cache_status ()
+{
+  GString *desc = g_string_new ("");
+  string status = _config->FindFile ("Dir::State::status");
+
+  describe_cache_input (desc, status.c_str ());
+  describe_cache_input (desc, (flNotFile (status) + "updates").c_str ());
+
+  return g_string_free (desc, FALSE);
+}
+
+/* Where packages are available from.  The lists directory is
+   replaced as a whole by update_package_cache, so its identity is
+   enough.
+*/
+static char *
+describe_cache_sources ()
+{
+  GString *desc = g_string_new ("");
+
+  describe_cache_input (desc,
+			_config->FindDir ("Dir::State::Lists").c_str ());
+  describe_cache_input (desc,
+			_config->FindFile ("Dir::Etc::sourcelist").c_str ());
+  describe_cache_input_dir (desc,
+			    _config->FindDir ("Dir::Etc::sourceparts").c_str ());
+  describe_cache_input (desc,
+			_config->FindFile ("Dir::Etc::preferences").c_str ());
+  describe_cache_input_dir (desc, PACKAGE_DOMAINS);
+
+  return g_string_free (desc, FALSE);
+}
+
+/* Background rebuilds
+
+   When only the sources of packages have changed, for example after
+   CHECK_UPDATES or SET_CATALOGUES, the new cache files are built by
+   a child process while the current cache keeps serving the commands
+   for which is_served_during_rebuild is true.  All other commands
+   first wait for the child.  When the child is done, the new cache is
+   opened from its files and replaces the current one between two
+   requests.  Opening a cache from up-to-date files is much faster
+   than building them.
+
+   Commands that are served during a rebuild see the cache as it was
+   before the change of the sources.  Package lists are not served
+   during a rebuild since the frontend asks for them right after
+   refreshing the catalogues and wants the new ones.  Package records
+   are read through the pkgRecords that was opened together with the
+   current cache, so they still come from the old package index files
+   even when those have already been replaced.  See package_record.
+
+   When the status of installed packages has changed, the cache is
+   rebuilt immediately as before, since the current one doesn't
+   describe the system anymore.
+
+   Background rebuilds are only used by the backend.
+*/
+
+static bool background_rebuilds = false;
+static pid_t cache_rebuild_pid = -1;
+static int cache_rebuild_fd = -1;
+
+/* Start building the cache files in a child process.  The child
+   closes its end of a pipe when it is done, which makes
+   CACHE_REBUILD_FD readable.
+*/
+static bool
+start_cache_rebuild ()
+{
+  int fds[2];
+
+  if (pipe (fds) < 0)
+    {
+      log_stderr ("pipe: %m");
+      return false;
+    }
+
+  /* Don't let the child inherit unflushed output.
+   */
+  fflush (stdout);
+  fflush (stderr);
+
+  pid_t pid = fork ();
+  if (pid < 0)
+    {
+      log_stderr ("fork: %m");
+      close (fds[0]);
+      close (fds[1]);
+      return false;
+    }
+
+  if (pid == 0)
+    {
+      close (fds[0]);
+      close_query_server_stop_fd ();
+      _error->Discard ();
+
+      /* The parent holds the dpkg lock for its cache.
+       */
+      OpProgress progress;
+      myCacheFile files;
+      bool success = (files.BuildCaches (progress, false)
+		      && !_error->PendingError ());
+      _error->DumpErrors ();
+      _exit (success? 0 : 1);
+    }
+
+  close (fds[1]);
+  cache_rebuild_pid = pid;
+  cache_rebuild_fd = fds[0];
+  DBG ("rebuilding cache in %d", pid);
+  return true;
+}
+
+static bool
+cache_rebuild_pending ()
+{
+  return cache_rebuild_pid > 0;
+}
+
+static void
+wait_for_cache_rebuild ()
+{
+  if (!cache_rebuild_pending ())
+    return;
+
+  int status;
+  while (waitpid (cache_rebuild_pid, &status, 0) < 0 && errno == EINTR)
+    ;
+  close (cache_rebuild_fd);
+  cache_rebuild_pid = -1;
+  cache_rebuild_fd = -1;
+}
+
+/* Wait for the child and swap in the new cache.  When the child has
+   failed, cache_init does all the work again and reports the errors.
+*/
+static void
+finish_cache_rebuild ()
+{
+  if (cache_rebuild_pending ())
+    {
+      DBG ("cache rebuilt, swapping");
+      cache_init (false);
+    }
+}
+
+/* Queries during long operations
+
+   See <apt-worker-proto.h>.  When a long operation starts, we fork a
+   child that answers the queries of the frontend from its copy of
+   the cache while we work on the operation.  The child exits when
+   QUERY_SERVER_STOP_FD is closed, but it first answers a query that
+   has already arrived, so that no request falls between the two
+   processes.
+
+   The child must not touch anything that the operation uses: it
+   leaves the response ring and the cancel fifo alone, and it doesn't
+   store package lists or search indices.  The statistics of the
+   queries that it answers are lost when it exits.
+*/
+
+static pid_t query_server_pid = -1;
+
+static void
+close_output_lock ()
+{
+  close (output_lock_fds[0]);
+  close (output_lock_fds[1]);
+  output_lock_fds[0] = output_lock_fds[1] = -1;
+}
+
+static void
+start_query_server ()
+{
+  int stop_fds[2];
+
+  if (AptWorkerCache::GetCurrent ()->cache == NULL)
+    return;
+
+  if (pipe (output_lock_fds) < 0)
+    {
+      log_stderr ("pipe: %m");
+      output_lock_fds[0] = output_lock_fds[1] = -1;
+      return;
+    }
+
+  if (pipe (stop_fds) < 0)
+    {
+      log_stderr ("pipe: %m");
+      close_output_lock ();
+      return;
+    }
+
+  unlock_output ();
+
+  pkgRecords *records = open_child_records ();
+
+  /* Don't let the child inherit unflushed output.
+   */
+  fflush (stdout);
+  fflush (stderr);
+
+  pid_t pid = fork ();
+  if (pid < 0)
+    {
+      log_stderr ("fork: %m");
+      delete records;
+      close (stop_fds[0]);
+      close (stop_fds[1]);
+      close_output_lock ();
+      return;
+    }
+
+  if (pid == 0)
+    {
+      use_child_records (records);
+      close (stop_fds[1]);
+      in_query_server = true;
+      query_server_stop_fd = stop_fds[0];
+      response_ring.detach ();
+      cancel_watch = apt_proto_cancel_watch ();
+      _error->Discard ();
+
+      while (true)
+	handle_request ();
+    }
+
+  delete records;
+
+  /* Programs that we run, like dpkg and its maintainer scripts,
+     must not keep the pipe open either.
+  */
+  fcntl (stop_fds[1], F_SETFD, FD_CLOEXEC);
+
+  close (stop_fds[0]);
+  query_server_pid = pid;
+  query_server_stop_fd = stop_fds[1];
+  DBG ("serving queries in %d", pid);
+}
+
+static void
+stop_query_server ()
+{
+  if (query_server_pid < 0)
+    return;
+
+  close (query_server_stop_fd);
+
+  int status;
+  while (waitpid (query_server_pid, &status, 0) < 0 && errno == EINTR)
+    ;
+  close_output_lock ();
+  query_server_pid = -1;
+  query_server_stop_fd = -1;
+}
+
+/* In the child, wait until a query arrives, or exit when we have
+   been told to stop and no query is waiting.
+*/
+static void
+wait_for_query ()
+{
+  while (true)
+    {
+      fd_set set;
+      FD_ZERO (&set);
+      FD_SET (input_fd, &set);
+      FD_SET (query_server_stop_fd, &set);
+
+      if (select (MAX (input_fd, query_server_stop_fd) + 1, &set,
+		  NULL, NULL, NULL) < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  perror ("apt-worker select");
+	  _exit (1);
+	}
+
+      if (FD_ISSET (input_fd, &set))
+	return;
+
+      fflush (stdout);
+      fflush (stderr);
+      _exit (0);
+    }
+}
+
+/* Wait until a request arrives.  When the child finishes first, its
+   cache is swapped in.
+*/
+static void
+wait_for_request ()
+{
+  if (in_query_server)
+    {
+      wait_for_query ();
+      return;
+    }
+
+  while (cache_rebuild_pending ())
+    {
+      fd_set set;
+      FD_ZERO (&set);
+      FD_SET (input_fd, &set);
+      FD_SET (cache_rebuild_fd, &set);
+
+      if (select (MAX (input_fd, cache_rebuild_fd) + 1, &set,
+		  NULL, NULL, NULL) < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  perror ("apt-worker select");
+	  exit (1);
+	}
+
+      if (FD_ISSET (cache_rebuild_fd, &set))
+	finish_cache_rebuild ();
+      else
+	return;
+    }
+}
+
+static bool
+is_served_during_rebuild (int cmd)
+{
+  switch (cmd)
+    {
+    case APTCMD_NOOP:
+    case APTCMD_GET_PACKAGE_INFO:
+    case APTCMD_GET_PACKAGE_DETAILS:
+    case APTCMD_GET_CATALOGUES:
+    case APTCMD_GET_FREE_SPACE:
+    case APTCMD_GET_STATS:
+    case APTCMD_GET_ICONS:
+    case APTCMD_SET_ENCODING:
+      return true;
+    default:
+      return false;
+    }
+}
+
+/* Initialize libapt-pkg if this has not been done already and
+   (re-)create PACKAGE_CACHE.  If the cache can not be created,
+   PACKAGE_CACHE is set to NULL and an appropriate message is output.
+   */
+void
+cache_init (bool with_status)
+{
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+  int64_t start_usecs = get_usecs ();
+
+  /* A child that is building the cache files must be done before we
+     can use them.
+  */
+  wait_for_cache_rebuild ();
+
+  /* Closes the cache, to prevent getting blocked by other locks in
+   * dpkg structures. If we don't do it, changing the apt worker state
+   * does not remove the dpkg state lock and then fails on trying to
+   * run dpkg */
+  /* @todo do we really keep doing this? */
+  if (awc->cache)
+    {
+      DBG ("closing");
+      delete awc->records;
+      awc->records = 0;
+      delete awc->action_group;
+      awc->cache->Close ();
+      delete awc->cache;
       awc->cache = 0;
       DBG ("done");
     }
 
+  /* Everything that is kept per generation, such as VERSION_FIELDS
+     and PACKAGE_SETS, points into the cache that was just deleted.
+     Start the new generation before anything looks at the new
+     cache, write_available_updates_file below included.
+  */
+  cache_generation++;
+
   /* We need to dump the errors here since any pending errors will
      cause the following operations to fail.
   */
@@ -1926,6 +3280,14 @@ cache_init (bool with_status)
    */
   clear_dpkg_updates ();
 
+  /* Describe the inputs before reading them so that changes made
+     while we read them are noticed by the next cache_refresh.
+  */
+  g_free (awc->cache_status);
+  g_free (awc->cache_sources);
+  awc->cache_status = describe_cache_status ();
+  awc->cache_sources = describe_cache_sources ();
+
   UpdateProgress progress (with_status);
   awc->cache = new myCacheFile;
 
@@ -1947,12 +3309,78 @@ cache_init (bool with_status)
       */
       pkgDepCache &cache = *awc->cache;
       awc->action_group = new pkgDepCache::ActionGroup (cache);
+
+      /* Open the package records right away, see package_record.
+       */
+      awc->records = new pkgRecords (*awc->cache);
     }
 
   cache_reset ();
 
   if (awc->cache)
     write_available_updates_file ();
+
+  stats_add_time (&cache_init_stats, get_usecs () - start_usecs);
+}
+
+static bool
+same_description (const char *old_desc, char *new_desc)
+{
+  bool same = old_desc && strcmp (old_desc, new_desc) == 0;
+  g_free (new_desc);
+  return same;
+}
+
+/* Rebuild the cache after the sources of packages have changed,
+   in the background when possible.
+*/
+void
+cache_rebuild (bool with_status)
+{
+  wait_for_cache_rebuild ();
+
+  if (background_rebuilds
+      && AptWorkerCache::GetCurrent ()->cache
+      && start_cache_rebuild ())
+    return;
+
+  cache_init (with_status);
+}
+
+/* Bring PACKAGE_CACHE up to date after a command has called
+   NEED_CACHE_INIT.  When none of the files that it is created from
+   have changed, the command hasn't changed anything that the cache
+   represents and only the 'desired' state needs to be reset, which
+   is much faster than cache_init.  This happens for example when an
+   installation failed before running dpkg, or was cancelled.  When
+   only the sources have changed, the cache is rebuilt in the
+   background.
+
+   The autoinst flags are taken from extra_info, which is kept up to
+   date by save_extra_info.
+*/
+void
+cache_refresh ()
+{
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+  int64_t start_usecs = get_usecs ();
+
+  if (awc->cache == NULL
+      || !same_description (awc->cache_status, describe_cache_status ()))
+    {
+      cache_init (false);
+      return;
+    }
+
+  if (!same_description (awc->cache_sources, describe_cache_sources ()))
+    {
+      cache_rebuild (false);
+      return;
+    }
+
+  DBG ("cache inputs unchanged, resetting");
+  cache_reset ();
+  stats_add_time (&cache_refresh_stats, get_usecs () - start_usecs);
 }
 
 bool
@@ -2034,6 +3462,11 @@ cache_reset_package (pkgCache::PkgIterator &pkg)
 
   cache.MarkKeep (pkg);
 
+  /* mark_related might have asked for a reinstallation.
+   */
+  if (cache[pkg].iFlags & pkgDepCache::ReInstall)
+    cache.SetReInstall (pkg, false);
+
   if (awc->cache->extra_info[pkg->ID].autoinst)
     cache[pkg].Flags |= pkgCache::Flag::Auto;
   else
@@ -2539,13 +3972,24 @@ mark_for_remove (pkgCache::PkgIterator &pkg)
 }
 
 /* Getting the package record in a nicely parsable form.
- */
+
+   All records are read through the pkgRecords of the cache, which
+   cache_init opens together with the cache.  pkgRecords opens all
+   package index files up front, so the records stay readable when
+   the files are replaced later, by CHECK_UPDATES swapping the lists
+   or by dpkg writing a new status file.  This lets the query server
+   and the commands that are served during a background rebuild use
+   the old cache for as long as it is around.
+
+   The record is copied out of the parser, since the next lookup of
+   any package_record reuses its buffer.
+*/
 
 struct package_record {
   package_record ();
 
-  pkgRecords Recs;
   pkgRecords::Parser *P;
+  string text;
   pkgTagSection section;
   bool valid;
 
@@ -2559,6 +4003,7 @@ struct package_record {
   void lookup(const pkgCache::VerIterator &ver)
     {
   const char *start, *stop;
+      pkgRecords &Recs = *(AptWorkerCache::GetCurrent ()->records);
       P = &Recs.Lookup (ver.FileList ());
 
       P->GetRec (start, stop);
@@ -2570,13 +4015,13 @@ struct package_record {
            pass one more character to Scan.
   */
   
-  valid = section.Scan (start, stop-start+1);
+  text.assign (start, stop-start+1);
+  valid = section.Scan (text.data (), text.size ());
     }
 };
 
 package_record::package_record ()
-  : Recs (*(AptWorkerCache::GetCurrent ()->cache)),
-    P(NULL),
+  : P(NULL),
     valid(false)
 {
 }
@@ -2690,14 +4135,14 @@ description_matches_pattern (pkgCache::VerIterator &ver,
   char **words = g_strsplit (pattern, " ", 0);
   package_record rec;
   rec.lookup(ver);
-  const char *desc = rec.P->LongDesc().c_str();
+  string desc = rec.P->LongDesc();
   int i;
 
   if (words == NULL)
     return false;
 
   for (i = 0; words[i] != NULL; i++)
-    if (strcasestr (desc, words[i]))  // XXX - UTF8?
+    if (strcasestr (desc.c_str(), words[i]))  // XXX - UTF8?
       match = true;
     else
       {
@@ -2730,18 +4175,6 @@ get_description (int summary_kind,
   return res;
 }
 
-static string
-get_short_description (int summary_kind,
-		       pkgCache::PkgIterator &pkg,
-		       package_record &rec)
-{
-  string res = get_description (summary_kind, pkg, rec);
-  string::size_type pos = res.find('\n');
-  if (pos != string::npos)
-    return string (res,0,pos);
-  return res;
-}
-
 static string
 get_long_description (int summary_kind,
 		      pkgCache::PkgIterator &pkg,
@@ -2756,6 +4189,37 @@ get_icon (package_record &rec)
   return rec.get ("Maemo-Icon-26");
 }
 
+/* The icons that have been sent as hashes in package lists, by their
+   hash, so that GET_ICONS can find them.  Identical icons are only
+   stored once.  GET_ICONS can find any icon of the current package
+   list again, so the store is emptied when it has grown larger than
+   MAX_STORED_ICONS.
+*/
+static GHashTable *icon_store = NULL;
+
+#define MAX_STORED_ICONS 1000
+
+static char *
+parse_icon_hash (package_record &rec)
+{
+  char *icon = get_icon (rec);
+  if (icon == NULL)
+    return NULL;
+
+  char *hash = g_compute_checksum_for_string (G_CHECKSUM_SHA1, icon, -1);
+
+  if (icon_store == NULL)
+    icon_store = g_hash_table_new_full (g_str_hash, g_str_equal,
+					g_free, g_free);
+
+  if (g_hash_table_lookup (icon_store, hash) == NULL)
+    g_hash_table_insert (icon_store, g_strdup (hash), icon);
+  else
+    g_free (icon);
+
+  return hash;
+}
+
 struct flag_struct {
   const char *name;
   int flag;
@@ -2769,7 +4233,7 @@ struct flag_struct {
 };
 
 static int
-get_flags (package_record &rec)
+parse_flags (package_record &rec)
 {
   int flags = 0;
   char *flag_string = rec.get ("Maemo-Flags");
@@ -2788,48 +4252,179 @@ get_flags (package_record &rec)
   return flags;
 }
 
-static string
-get_pretty_name (package_record &rec)
-{
-  return rec.get_localized_string ("Maemo-Display-Name");
-}
+/* The Maemo specific fields of versions
 
-static int64_t
-get_required_free_space (package_record &rec)
+   The fields that are needed for package lists, operations and the
+   available updates file are parsed at most once per version and
+   cache generation.  They are kept in VERSION_FIELDS with one array
+   per field, indexed by version ID, so that looking at the same
+   field of many versions does not touch the others.  A row is filled
+   the first time that one of its fields is needed.
+
+   Use get_pretty_name, get_short_description, get_icon_hash,
+   get_flags and get_required_free_space to read the table.
+*/
+
+struct version_fields_table {
+  int generation;
+  unsigned n_versions;
+  package_record *rec;
+  GStringChunk *strings;
+  bool *have;
+  const char **pretty_names;          // "" when there is none
+  const char **short_descriptions;
+  const char **upgrade_descriptions;  // NULL when there is none
+  const char **icon_hashes;           // NULL when there is none
+  int *flags;
+  int64_t *required_free_space;
+};
+
+static version_fields_table version_fields = { -1 };
+
+static void
+version_fields_free ()
 {
-  return 1024 * (int64_t) rec.get_int ("Maemo-Required-Free-Space", 0);
+  version_fields_table *t = &version_fields;
+
+  delete t->rec;
+  if (t->strings)
+    g_string_chunk_free (t->strings);
+  g_free (t->have);
+  g_free (t->pretty_names);
+  g_free (t->short_descriptions);
+  g_free (t->upgrade_descriptions);
+  g_free (t->icon_hashes);
+  g_free (t->flags);
+  g_free (t->required_free_space);
+
+  memset (t, 0, sizeof (*t));
+  t->generation = -1;
 }
 
-static void
-encode_version_info (int summary_kind, package_record &rec,
-		     const pkgCache::VerIterator &ver, bool include_size)
+static const char *
+version_fields_first_line (const string &str)
 {
-  char *icon;
+  string::size_type pos = str.find ('\n');
+  return g_string_chunk_insert_const (version_fields.strings,
+				      (pos == string::npos
+				       ? str
+				       : string (str, 0, pos)).c_str ());
+}
 
-  response.encode_string (ver.VerStr ());
-  if (include_size)
-    response.encode_int64 (ver->InstalledSize);
-  response.encode_string (ver.Section ());
-  string pretty = get_pretty_name (rec);
-  response.encode_string (pretty.empty()? NULL : pretty.c_str());
-  pkgCache::PkgIterator pkg = ver.ParentPkg();
-  response.encode_string 
-    (get_short_description (summary_kind, pkg, rec).c_str());
-  icon = get_icon (rec);
-  response.encode_string (icon);
-  g_free (icon);
+/* Return the row of VER in VERSION_FIELDS, filling it if necessary.
+ */
+static unsigned
+version_fields_row (const pkgCache::VerIterator &ver)
+{
+  version_fields_table *t = &version_fields;
+
+  if (t->generation != cache_generation)
+    {
+      AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+      pkgDepCache &cache = *(awc->cache);
+      unsigned n = cache.GetCache ().Head ().VersionCount;
+
+      version_fields_free ();
+      t->generation = cache_generation;
+      t->n_versions = n;
+      t->rec = new package_record;
+      t->strings = g_string_chunk_new (16 * 1024);
+      t->have = g_new0 (bool, n);
+      t->pretty_names = g_new0 (const char *, n);
+      t->short_descriptions = g_new0 (const char *, n);
+      t->upgrade_descriptions = g_new0 (const char *, n);
+      t->icon_hashes = g_new0 (const char *, n);
+      t->flags = g_new0 (int, n);
+      t->required_free_space = g_new0 (int64_t, n);
+    }
+
+  unsigned id = ver->ID;
+  if (t->have[id])
+    return id;
+
+  package_record &rec = *(t->rec);
+  rec.lookup (ver);
+
+  t->pretty_names[id] =
+    g_string_chunk_insert_const (t->strings,
+				 rec.get_localized_string
+				 ("Maemo-Display-Name").c_str ());
+
+  /* XXX - support apt's own method of localizing descriptions as
+           well.
+  */
+  t->short_descriptions[id] =
+    version_fields_first_line (rec.get_localized_string ("Description"));
+
+  string upgrade = rec.get_localized_string ("Maemo-Upgrade-Description");
+  if (!upgrade.empty ())
+    t->upgrade_descriptions[id] = version_fields_first_line (upgrade);
+
+  char *icon_hash = parse_icon_hash (rec);
+  if (icon_hash)
+    {
+      t->icon_hashes[id] = g_string_chunk_insert_const (t->strings,
+							icon_hash);
+      g_free (icon_hash);
+    }
+
+  t->flags[id] = parse_flags (rec);
+  t->required_free_space[id] =
+    1024 * (int64_t) rec.get_int ("Maemo-Required-Free-Space", 0);
+
+  t->have[id] = true;
+  return id;
 }
 
-static void
-encode_empty_version_info (bool include_size)
+static const char *
+get_pretty_name (const pkgCache::VerIterator &ver)
 {
-  response.encode_string (NULL);
-  if (include_size)
-    response.encode_int64 (0);
-  response.encode_string (NULL);
-  response.encode_string (NULL);
-  response.encode_string (NULL);
-  response.encode_string (NULL);
+  if (ver.end ())
+    return "";
+  return version_fields.pretty_names[version_fields_row (ver)];
+}
+
+static const char *
+get_short_description (int summary_kind,
+		       pkgCache::PkgIterator &pkg,
+		       const pkgCache::VerIterator &ver)
+{
+  if (ver.end ())
+    return "";
+
+  unsigned id = version_fields_row (ver);
+  if (summary_kind == 1
+      && !pkg.CurrentVer().end()
+      && version_fields.upgrade_descriptions[id])
+    return version_fields.upgrade_descriptions[id];
+  return version_fields.short_descriptions[id];
+}
+
+/* The icon itself can be found with find_icon once this has
+   returned its hash.
+*/
+static const char *
+get_icon_hash (const pkgCache::VerIterator &ver)
+{
+  if (ver.end ())
+    return NULL;
+  return version_fields.icon_hashes[version_fields_row (ver)];
+}
+
+static int
+get_flags (const pkgCache::VerIterator &ver)
+{
+  if (ver.end ())
+    return 0;
+  return version_fields.flags[version_fields_row (ver)];
+}
+
+static int64_t
+get_required_free_space (const pkgCache::VerIterator &ver)
+{
+  if (ver.end ())
+    return 0;
+  return version_fields.required_free_space[version_fields_row (ver)];
 }
 
 static void
@@ -2860,202 +4455,1805 @@ ssu_packages_set (GSList *ssu_list)
     }
 }
 
-void
-cmd_get_package_list ()
+/* Package sets
+
+   The properties of packages that the filters of package lists, the
+   available updates file and GET_SYSTEM_UPDATE_PACKAGES look at are
+   computed in one pass over the cache, once per cache generation,
+   and kept as bitsets.  Bits are indexed by the position of a package
+   in the iteration order of the cache, so that iterating over the set
+   bits visits packages in the same order as PkgBegin.
+
+   The system-update set needs the flags of the candidates and thus
+   their records.  It is only computed when it is first needed.
+*/
+
+enum package_set {
+  pset_installed,
+  pset_available,           // has a candidate version
+  pset_installed_user,
+  pset_candidate_user,
+  pset_upgradeable,         // the candidate is newer than the installed one
+  pset_broken,
+  pset_system_update,       // installed, and the candidate has the flag
+  pset_n_sets
+};
+
+struct package_sets_struct {
+  int generation;
+  unsigned n_packages;
+  unsigned n_words;
+  pkgCache::Package **packages;
+  guint32 *sets[pset_n_sets];
+  bool have_system_update;
+};
+
+static package_sets_struct package_sets = { -1 };
+
+static bool
+pset_has (const guint32 *set, unsigned i)
 {
-  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
-  bool only_user = request.decode_int ();
-  bool only_installed = request.decode_int ();
-  bool only_available = request.decode_int ();
-  const char *pattern = request.decode_string_in_place ();
-  bool show_magic_sys = request.decode_int ();
-  GSList *ssu_pkgs_found = NULL;
+  return (set[i / 32] & (1u << (i % 32))) != 0;
+}
 
-  if (!ensure_cache (true))
+static void
+pset_add (guint32 *set, unsigned i)
+{
+  set[i / 32] |= 1u << (i % 32);
+}
+
+/* Return the first bit in SET at or after I, or N_BITS when there is
+   none.
+*/
+static unsigned
+pset_next (const guint32 *set, unsigned n_bits, unsigned i)
+{
+  unsigned n_words = (n_bits + 31) / 32;
+
+  for (unsigned w = i / 32; w < n_words; w++)
     {
-      response.encode_int (0);
-      return;
+      gulong word = set[w];
+      if (w == i / 32)
+	word &= ~0ul << (i % 32);
+      if (word)
+	{
+	  unsigned bit = w * 32 + g_bit_nth_lsf (word, -1);
+	  return bit < n_bits ? bit : n_bits;
+	}
     }
+  return n_bits;
+}
 
-  response.encode_int (1);
+static void
+free_package_sets ()
+{
+  g_free (package_sets.packages);
+  for (int s = 0; s < pset_n_sets; s++)
+    g_free (package_sets.sets[s]);
+  memset (&package_sets, 0, sizeof (package_sets));
+  package_sets.generation = -1;
+}
+
+static void
+ensure_package_sets ()
+{
+  if (package_sets.generation == cache_generation)
+    return;
+
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
   pkgDepCache &cache = *(awc->cache);
+  unsigned n = cache.GetCache ().Head ().PackageCount;
 
-  package_record irec;
-  package_record crec;
+  free_package_sets ();
+  package_sets.generation = cache_generation;
+  package_sets.n_words = (n + 31) / 32;
+  package_sets.packages = g_new (pkgCache::Package *, n);
+  for (int s = 0; s < pset_n_sets; s++)
+    package_sets.sets[s] = g_new0 (guint32, package_sets.n_words);
 
-  for (pkgCache::PkgIterator pkg = cache.PkgBegin(); !pkg.end (); pkg++)
-    {
-      int flags = 0;
-      bool crec_looked = false;
-      bool irec_looked = false;
+  guint32 **sets = package_sets.sets;
+  unsigned i = 0;
 
-      if (read_byte (cancel_fd) >= 0)
-        return;
+  for (pkgCache::PkgIterator pkg = cache.PkgBegin();
+       !pkg.end () && i < n; pkg++, i++)
+    {
+      package_sets.packages[i] = pkg;
 
-      /* Get installed and candidate iterators for current package */
       pkgCache::VerIterator installed = pkg.CurrentVer ();
       pkgDepCache::StateCache& sc = cache[pkg];
       pkgCache::VerIterator candidate = sc.CandidateVerIter(cache);
 
-      bool iend = installed.end ();
-      bool cend = candidate.end ();
+      if (!installed.end ())
+	{
+	  pset_add (sets[pset_installed], i);
+	  if (is_user_package (installed))
+	    pset_add (sets[pset_installed_user], i);
+	}
 
-      // skip non user packages if requested.  Both the installed and
-      // candidate versions must be non-user packages for a package to
-      // be skipped completely.
-      //
-      if (only_user
-	  && (iend || !is_user_package (installed))
-	  && (cend || !is_user_package (candidate)))
-	continue;
+      if (!candidate.end ())
+	{
+	  pset_add (sets[pset_available], i);
+	  if (is_user_package (candidate))
+	    pset_add (sets[pset_candidate_user], i);
+	  if (!installed.end () && installed.CompareVer (candidate) < 0)
+	    pset_add (sets[pset_upgradeable], i);
+	}
 
-      // skip not-installed packages if requested
-      //
-      if (only_installed && iend)
-	continue;
+      if (sc.NowBroken()
+	  || (pkg.State () != pkgCache::PkgIterator::NeedsNothing))
+	pset_add (sets[pset_broken], i);
+    }
 
-      // skip non-available packages if requested
-      //
-      if (only_available && cend)
-	continue;
+  package_sets.n_packages = i;
+}
 
-      // skip packages that are not installed and not available
-      //
-      if (iend && cend)
+static void
+ensure_system_update_set ()
+{
+  ensure_package_sets ();
+
+  if (package_sets.have_system_update)
+    return;
+
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+  pkgDepCache &cache = *(awc->cache);
+  guint32 **sets = package_sets.sets;
+  unsigned n = package_sets.n_packages;
+
+  for (unsigned i = pset_next (sets[pset_installed], n, 0);
+       i < n;
+       i = pset_next (sets[pset_installed], n, i + 1))
+    {
+      if (!pset_has (sets[pset_available], i))
 	continue;
 
-      // skip packages that don't match the pattern if requested
-      //
-      if (pattern
-	  && !(name_matches_pattern (pkg, pattern)
-	       || (!iend && description_matches_pattern (installed, pattern))
-	       || (!cend && description_matches_pattern (candidate, pattern))))
+      pkgCache::PkgIterator pkg (cache.GetCache (),
+				 package_sets.packages[i]);
+      if (get_flags (cache[pkg].CandidateVerIter(cache))
+	  & pkgflag_system_update)
+	pset_add (sets[pset_system_update], i);
+    }
+
+  package_sets.have_system_update = true;
+}
+
+/* Package list snapshots
+
+   To support GET_PACKAGE_LIST_DELTA, we remember what we have sent
+   with the last complete GET_PACKAGE_LIST or GET_PACKAGE_LIST_DELTA
+   that had no pattern.  For each listed package, we store a
+   fingerprint of everything that goes into its entry, and its flags.
+   A later delta request then only needs to compare fingerprints and
+   can skip looking up and encoding the records of unchanged
+   packages.
+
+   CACHE_GENERATION is increased with every cache_init.  When the
+   snapshot was taken with the current cache, there can't be any
+   changes at all.
+*/
+
+struct package_list_entry_state {
+  char *fingerprint;
+  int flags;
+};
+
+struct package_list_snapshot {
+  int generation;
+  bool only_user, only_installed, only_available, show_magic_sys;
+  GHashTable *entries;
+};
+
+static package_list_snapshot list_snapshot = { -1 };
+
+static void
+free_package_list_entry_state (gpointer data)
+{
+  package_list_entry_state *st = (package_list_entry_state *)data;
+  g_free (st->fingerprint);
+  delete st;
+}
+
+static GHashTable *
+package_list_state_new ()
+{
+  return g_hash_table_new_full (g_str_hash, g_str_equal,
+				g_free, free_package_list_entry_state);
+}
+
+static void
+set_package_list_snapshot (GHashTable *entries,
+			   bool only_user, bool only_installed,
+			   bool only_available, bool show_magic_sys)
+{
+  if (list_snapshot.entries)
+    g_hash_table_destroy (list_snapshot.entries);
+
+  list_snapshot.generation = cache_generation;
+  list_snapshot.only_user = only_user;
+  list_snapshot.only_installed = only_installed;
+  list_snapshot.only_available = only_available;
+  list_snapshot.show_magic_sys = show_magic_sys;
+  list_snapshot.entries = entries;
+}
+
+static void
+append_version_fingerprint (GString *fp, pkgCache::VerIterator &ver)
+{
+  if (ver.end ())
+    {
+      g_string_append (fp, "-|");
+      return;
+    }
+
+  g_string_append_printf (fp, "%s %lu %lu",
+			  ver.VerStr (),
+			  (unsigned long) ver->Size,
+			  (unsigned long) ver->InstalledSize);
+
+  pkgCache::VerFileIterator vf = ver.FileList ();
+  if (!vf.end ())
+    g_string_append_printf (fp, " %s %lu %lu",
+			    vf.File ().FileName (),
+			    (unsigned long) vf->Offset,
+			    (unsigned long) vf.File ()->mtime);
+  g_string_append_c (fp, '|');
+}
+
+static char *
+package_fingerprint (pkgCache::VerIterator &installed,
+		     pkgCache::VerIterator &candidate,
+		     bool broken)
+{
+  GString *fp = g_string_new ("");
+  append_version_fingerprint (fp, installed);
+  append_version_fingerprint (fp, candidate);
+  g_string_append_c (fp, broken? 'b' : '-');
+  return g_string_free (fp, FALSE);
+}
+
+/* The package list file
+
+   Looking up and parsing the records of all packages is the most
+   expensive part of GET_PACKAGE_LIST.  Therefore, everything that
+   goes into a package list entry and doesn't depend on the request
+   is stored in PACKAGE_LIST_FILE the first time that a list is
+   needed after the cache has been built.  Later lists, also those of
+   later apt-worker processes, are served from the mmapped file for
+   as long as the cache doesn't change.
+
+   The file starts with a package_list_file_header, which is followed
+   by the entries and then by the strings.  Strings are referenced by
+   their offset into the string area, and an offset of 0 means NULL.
+
+   The KEY of the file identifies the cache that it has been made
+   from.  It is a hash over the installed and candidate versions of
+   all packages, including where their records are, and over the
+   language that is used for the localized fields.  The cache is
+   built anyway when apt-worker starts, and computing the key only
+   needs to look at the cache, not at the records.
+
+   When the file has been made with ONLY_USER, it only contains
+   packages that have a user version and can't be used for requests
+   that want all packages.
+*/
+
+#define PACKAGE_LIST_FILE "/var/lib/hildon-application-manager/package-list"
+#define PACKAGE_LIST_FILE_MAGIC   0x504c5354
+#define PACKAGE_LIST_FILE_VERSION 1
+
+enum {
+  plf_broken         = 1 << 0,
+  plf_installed      = 1 << 1,
+  plf_available      = 1 << 2,
+  plf_installed_user = 1 << 3,
+  plf_candidate_user = 1 << 4
+};
+
+struct package_list_file_header {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t key;
+  uint32_t only_user;
+  uint32_t n_entries;
+  uint32_t strings_offset;
+  uint32_t size;
+};
+
+#define N_ENTRY_STRINGS 12
+
+struct package_list_file_entry {
+  uint32_t name;
+  uint32_t fingerprint;
+  uint32_t installed_version;
+  uint32_t installed_section;
+  uint32_t installed_pretty_name;
+  uint32_t installed_short_description;
+  uint32_t installed_icon_hash;
+  uint32_t available_version;
+  uint32_t available_section;
+  uint32_t available_pretty_name;
+  uint32_t available_short_description;
+  uint32_t available_icon_hash;
+  int64_t installed_size;
+  int32_t flags;
+  uint32_t bits;
+};
+
+struct stored_package_list {
+  int generation;     // the CACHE_GENERATION it is valid for, or -1
+  char *data;
+  size_t size;
+  bool mapped;
+  package_list_file_header *header;
+  package_list_file_entry *entries;
+  const char *strings;
+
+  // Bitsets over the entries, for the filters of GET_PACKAGE_LIST.
+  guint32 *user_entries;
+  guint32 *installed_entries;
+  guint32 *available_entries;
+};
+
+static stored_package_list stored_list = { -1 };
+
+static const char *
+stored_string (const char *strings, uint32_t offset)
+{
+  return offset ? strings + offset : NULL;
+}
+
+static void
+free_stored_list ()
+{
+  if (stored_list.data)
+    {
+      if (stored_list.mapped)
+	munmap (stored_list.data, stored_list.size);
+      else
+	g_free (stored_list.data);
+    }
+
+  g_free (stored_list.user_entries);
+  g_free (stored_list.installed_entries);
+  g_free (stored_list.available_entries);
+
+  stored_list.generation = -1;
+  stored_list.data = NULL;
+  stored_list.header = NULL;
+  stored_list.entries = NULL;
+  stored_list.strings = NULL;
+  stored_list.user_entries = NULL;
+  stored_list.installed_entries = NULL;
+  stored_list.available_entries = NULL;
+}
+
+static uint64_t
+hash_version (uint64_t h, pkgCache::VerIterator &ver)
+{
+  if (ver.end ())
+    return hash_str (h, NULL);
+
+  uint64_t sizes[2] = { ver->Size, ver->InstalledSize };
+  h = hash_str (h, ver.VerStr ());
+  h = hash_mem (h, sizes, sizeof (sizes));
+
+  pkgCache::VerFileIterator vf = ver.FileList ();
+  if (!vf.end ())
+    {
+      uint64_t pos[2] = { vf->Offset, (uint64_t) vf.File ()->mtime };
+      h = hash_str (h, vf.File ().FileName ());
+      h = hash_mem (h, pos, sizeof (pos));
+    }
+  return h;
+}
+
+static uint64_t
+package_list_key ()
+{
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+  pkgDepCache &cache = *(awc->cache);
+  uint64_t h = FNV_OFFSET_BASIS;
+
+  h = hash_str (h, lc_messages);
+
+  for (pkgCache::PkgIterator pkg = cache.PkgBegin(); !pkg.end (); pkg++)
+    {
+      pkgCache::VerIterator installed = pkg.CurrentVer ();
+      pkgDepCache::StateCache& sc = cache[pkg];
+      pkgCache::VerIterator candidate = sc.CandidateVerIter(cache);
+
+      if (installed.end () && candidate.end ())
 	continue;
 
-      // Look for the SSU package if needed
-      //
-      if (!iend || !cend)
-        {
-          if(!cend)
-            {
-              crec.lookup(candidate);
-              crec_looked = true;
-              flags = get_flags (crec);
-            }
-          else
-            {
-              irec.lookup(installed);
-              irec_looked = true;
-              flags = get_flags (irec);
-            }
-          if (flags & pkgflag_system_update)
-            {
-              if (ssu_packages_needs_refresh)
-                {
-                  /* Add it to the local GSList */
-                  ssu_pkgs_found = g_slist_prepend (ssu_pkgs_found,
-                                                    g_strdup (pkg.Name ()));
-                }
+      unsigned char broken =
+	(sc.NowBroken()
+	 || (pkg.State () != pkgCache::PkgIterator::NeedsNothing));
+
+      h = hash_str (h, pkg.Name ());
+      h = hash_version (h, installed);
+      h = hash_version (h, candidate);
+      h = hash_mem (h, &broken, 1);
+    }
+
+  return h;
+}
+
+/* Check the package list in DATA and make it the current one when
+   it is good.  Otherwise, DATA is left alone.
+*/
+static bool
+use_stored_list (char *data, size_t size, bool mapped,
+		 uint64_t key, bool only_user)
+{
+  package_list_file_header *h = (package_list_file_header *)data;
+
+  if (size < sizeof (*h)
+      || h->magic != PACKAGE_LIST_FILE_MAGIC
+      || h->version != PACKAGE_LIST_FILE_VERSION
+      || h->key != key
+      || (h->only_user && !only_user)
+      || h->size != size
+      || h->strings_offset > size
+      || h->strings_offset != (sizeof (*h)
+			       + ((uint64_t) h->n_entries
+				  * sizeof (package_list_file_entry)))
+      || h->strings_offset == size
+      || data[size-1] != '\0')
+    return false;
+
+  package_list_file_entry *entries =
+    (package_list_file_entry *)(data + sizeof (*h));
+  uint32_t strings_size = size - h->strings_offset;
+
+  for (uint32_t i = 0; i < h->n_entries; i++)
+    {
+      uint32_t *offsets = &entries[i].name;
+      for (int j = 0; j < N_ENTRY_STRINGS; j++)
+	if (offsets[j] >= strings_size)
+	  return false;
+      if (entries[i].name == 0 || entries[i].fingerprint == 0)
+	return false;
+    }
+
+  free_stored_list ();
+
+  stored_list.generation = cache_generation;
+  stored_list.data = data;
+  stored_list.size = size;
+  stored_list.mapped = mapped;
+  stored_list.header = h;
+  stored_list.entries = entries;
+  stored_list.strings = data + h->strings_offset;
+
+  unsigned n_words = (h->n_entries + 31) / 32;
+  stored_list.user_entries = g_new0 (guint32, n_words);
+  stored_list.installed_entries = g_new0 (guint32, n_words);
+  stored_list.available_entries = g_new0 (guint32, n_words);
+
+  for (uint32_t i = 0; i < h->n_entries; i++)
+    {
+      uint32_t bits = entries[i].bits;
+      if (bits & (plf_installed_user | plf_candidate_user))
+	pset_add (stored_list.user_entries, i);
+      if (bits & plf_installed)
+	pset_add (stored_list.installed_entries, i);
+      if (bits & plf_available)
+	pset_add (stored_list.available_entries, i);
+    }
+
+  return true;
+}
+
+/* Return the entries of the current package list that pass the
+   filters, or NULL when there are no filters.
+*/
+static guint32 *
+stored_list_filter (bool only_user, bool only_installed, bool only_available)
+{
+  if (!only_user && !only_installed && !only_available)
+    return NULL;
+
+  unsigned n_words = (stored_list.header->n_entries + 31) / 32;
+  guint32 *wanted = g_new (guint32, n_words);
+
+  for (unsigned w = 0; w < n_words; w++)
+    {
+      wanted[w] = ~0u;
+      if (only_user)
+	wanted[w] &= stored_list.user_entries[w];
+      if (only_installed)
+	wanted[w] &= stored_list.installed_entries[w];
+      if (only_available)
+	wanted[w] &= stored_list.available_entries[w];
+    }
+
+  return wanted;
+}
+
+static bool
+map_stored_list (uint64_t key, bool only_user)
+{
+  struct stat st;
+  void *data = MAP_FAILED;
+
+  int fd = open (PACKAGE_LIST_FILE, O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  if (fstat (fd, &st) == 0 && st.st_size > 0)
+    data = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+
+  if (data == MAP_FAILED)
+    return false;
+
+  if (!use_stored_list ((char *)data, st.st_size, true, key, only_user))
+    {
+      munmap (data, st.st_size);
+      return false;
+    }
+
+  return true;
+}
+
+static void
+write_stored_file (const char *file, const char *data, size_t size)
+{
+  /* The operation might be writing the same file.
+   */
+  if (in_query_server)
+    return;
+
+  char *tmp = g_strdup_printf ("%s.new", file);
+
+  int fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    {
+      log_stderr ("%s: %m", tmp);
+      g_free (tmp);
+      return;
+    }
+
+  while (size > 0)
+    {
+      ssize_t n = write (fd, data, size);
+      if (n < 0 && errno == EINTR)
+	continue;
+      else if (n <= 0)
+	{
+	  log_stderr ("%s: %m", tmp);
+	  close (fd);
+	  unlink (tmp);
+	  g_free (tmp);
+	  return;
+	}
+      data += n;
+      size -= n;
+    }
+
+  // The file is only a cache and it is checked when it is used, so
+  // we don't need to sync it.
+  if (close (fd) < 0 || rename (tmp, file) < 0)
+    {
+      log_stderr ("%s: %m", file);
+      unlink (tmp);
+    }
+  g_free (tmp);
+}
+
+struct stored_list_builder {
+  GString *strings;
+  GHashTable *string_offsets;
+};
+
+static uint32_t
+store_string (stored_list_builder *b, const char *str)
+{
+  gpointer offset;
+
+  if (str == NULL)
+    return 0;
+
+  if (g_hash_table_lookup_extended (b->string_offsets, str, NULL, &offset))
+    return GPOINTER_TO_UINT (offset);
+
+  uint32_t new_offset = b->strings->len;
+  g_string_append_len (b->strings, str, strlen (str) + 1);
+  g_hash_table_insert (b->string_offsets, g_strdup (str),
+		       GUINT_TO_POINTER (new_offset));
+  return new_offset;
+}
+
+static void
+store_version_info (stored_list_builder *b,
+		    int summary_kind, const pkgCache::VerIterator &ver,
+		    uint32_t *strings)
+{
+  pkgCache::PkgIterator pkg = ver.ParentPkg();
+  const char *pretty = get_pretty_name (ver);
+
+  strings[0] = store_string (b, ver.VerStr ());
+  strings[1] = store_string (b, ver.Section ());
+  strings[2] = store_string (b, *pretty? pretty : NULL);
+  strings[3] = store_string (b, get_short_description (summary_kind,
+							pkg, ver));
+  strings[4] = store_string (b, get_icon_hash (ver));
+}
+
+typedef void stored_entry_func (package_list_file_entry *e,
+				const char *strings, void *data);
+
+/* Make a new package list from the cache, write it to
+   PACKAGE_LIST_FILE, and make it the current one.  Each entry is
+   passed to EMIT as soon as it is ready, so that the caller doesn't
+   have to wait for the whole list.
+
+   Returns false when the operation has been cancelled.
+*/
+static bool
+build_stored_list (uint64_t key, bool only_user,
+		   stored_entry_func *emit, void *emit_data)
+{
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+  pkgDepCache &cache = *(awc->cache);
+  stored_list_builder b;
+  GArray *entries;
+  bool cancelled = false;
+
+  b.strings = g_string_new ("");
+  g_string_append_c (b.strings, '\0');   // offset 0 is NULL
+  b.string_offsets = g_hash_table_new_full (g_str_hash, g_str_equal,
+					    g_free, NULL);
+  entries = g_array_new (FALSE, FALSE, sizeof (package_list_file_entry));
+
+  ensure_package_sets ();
+
+  guint32 **sets = package_sets.sets;
+  unsigned n = package_sets.n_packages;
+
+  // Only packages that are installed or available are listed.  Non
+  // user packages are skipped if requested, but both the installed
+  // and candidate versions must be non-user packages for a package to
+  // be skipped completely.
+  //
+  guint32 *wanted = g_new (guint32, package_sets.n_words);
+  for (unsigned w = 0; w < package_sets.n_words; w++)
+    {
+      wanted[w] = sets[pset_installed][w] | sets[pset_available][w];
+      if (only_user)
+	wanted[w] &= (sets[pset_installed_user][w]
+		      | sets[pset_candidate_user][w]);
+    }
+
+  for (unsigned i = pset_next (wanted, n, 0);
+       i < n;
+       i = pset_next (wanted, n, i + 1))
+    {
+      if (cancel_watch.cancelled ())
+	{
+	  cancelled = true;
+	  break;
+	}
+
+      pkgCache::PkgIterator pkg (cache.GetCache (), package_sets.packages[i]);
+      pkgCache::VerIterator installed = pkg.CurrentVer ();
+      pkgCache::VerIterator candidate = cache[pkg].CandidateVerIter(cache);
+
+      bool iend = !pset_has (sets[pset_installed], i);
+      bool cend = !pset_has (sets[pset_available], i);
+      bool installed_user = pset_has (sets[pset_installed_user], i);
+      bool candidate_user = pset_has (sets[pset_candidate_user], i);
+      bool broken = pset_has (sets[pset_broken], i);
+
+      package_list_file_entry e;
+      memset (&e, 0, sizeof (e));
+
+      e.name = store_string (&b, pkg.Name ());
+
+      char *fingerprint = package_fingerprint (installed, candidate, broken);
+      e.fingerprint = store_string (&b, fingerprint);
+      g_free (fingerprint);
+
+      e.bits = ((broken? plf_broken : 0)
+		| (iend? 0 : plf_installed)
+		| (cend? 0 : plf_available)
+		| (installed_user? plf_installed_user : 0)
+		| (candidate_user? plf_candidate_user : 0));
+
+      if (!cend)
+	e.flags = get_flags (candidate);
+
+      if (!iend)
+	{
+	  if (cend)
+	    e.flags = get_flags (installed);
+	  e.installed_size = installed->InstalledSize;
+	  store_version_info (&b, 2, installed, &e.installed_version);
+	}
+
+      // We only offer an available version if the package is not
+      // installed at all, or if the available version is newer than
+      // the installed one, or if the installed version is broken.
+      //
+      if (!cend && (iend
+		    || pset_has (sets[pset_upgradeable], i)
+		    || broken))
+	store_version_info (&b, 1, candidate, &e.available_version);
+
+      g_array_append_val (entries, e);
+
+      if (emit)
+	emit (&e, b.strings->str, emit_data);
+    }
+
+  if (!cancelled)
+    {
+      package_list_file_header h;
+      memset (&h, 0, sizeof (h));
+      h.magic = PACKAGE_LIST_FILE_MAGIC;
+      h.version = PACKAGE_LIST_FILE_VERSION;
+      h.key = key;
+      h.only_user = only_user;
+      h.n_entries = entries->len;
+      h.strings_offset = (sizeof (h)
+			  + entries->len * sizeof (package_list_file_entry));
+      h.size = h.strings_offset + b.strings->len;
+
+      char *data = (char *)g_malloc (h.size);
+      memcpy (data, &h, sizeof (h));
+      memcpy (data + sizeof (h), entries->data,
+	      entries->len * sizeof (package_list_file_entry));
+      memcpy (data + h.strings_offset, b.strings->str, b.strings->len);
+
+      write_stored_file (PACKAGE_LIST_FILE, data, h.size);
+      if (!use_stored_list (data, h.size, false, key, only_user))
+	g_free (data);
+    }
+
+  g_free (wanted);
+  g_array_free (entries, TRUE);
+  g_string_free (b.strings, TRUE);
+  g_hash_table_destroy (b.string_offsets);
+
+  return !cancelled;
+}
+
+/* Make sure that there is a current stored package list that covers
+   ONLY_USER.  When the list has to be built, its entries are passed
+   to EMIT while that happens, and *EMITTED is set to true.
+
+   Returns false when the operation has been cancelled.
+*/
+static bool
+ensure_stored_list (bool only_user,
+		    stored_entry_func *emit, void *emit_data,
+		    bool *emitted)
+{
+  *emitted = false;
+
+  if (stored_list.generation == cache_generation
+      && (only_user || !stored_list.header->only_user))
+    return true;
+
+  uint64_t key = package_list_key ();
+  if (map_stored_list (key, only_user))
+    return true;
+
+  *emitted = true;
+  return build_stored_list (key, only_user, emit, emit_data);
+}
+
+/* Encode the package list entries into RESPONSE, as described for
+   GET_PACKAGE_LIST.
+
+   When OLD_STATE is not NULL, this is for a delta: each entry is
+   preceded by a 1 (int), and packages whose fingerprint is unchanged
+   in OLD_STATE are not encoded at all.  All listed packages are
+   removed from OLD_STATE, so that afterwards it only contains the
+   packages that have disappeared.
+
+   When NEW_STATE is not NULL, the fingerprint and flags of every
+   listed package are recorded in it.
+
+   Returns false when the operation has been cancelled.
+*/
+
+struct package_list_request {
+  bool only_user, only_installed, only_available;
+  const char *pattern;
+  int chunk_size;
+  GHashTable *old_state, *new_state;
+  GPtrArray *changed;
+  GSList *ssu_pkgs_found;
+};
+
+static bool
+stored_entry_matches_pattern (const char *name, const char *pattern)
+{
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+  pkgDepCache &cache = *(awc->cache);
+
+  pkgCache::PkgIterator pkg = cache.FindPkg (name);
+  if (pkg.end ())
+    return false;
+
+  pkgCache::VerIterator installed = pkg.CurrentVer ();
+  pkgCache::VerIterator candidate = cache[pkg].CandidateVerIter(cache);
+
+  return (name_matches_pattern (pkg, pattern)
+	  || (!installed.end ()
+	      && description_matches_pattern (installed, pattern))
+	  || (!candidate.end ()
+	      && description_matches_pattern (candidate, pattern)));
+}
+
+/* The search index
+
+   Matching a pattern against the long descriptions of packages needs
+   their records, and looking them up is slow.  Therefore, the first
+   search in a stored package list makes an index of the trigrams in
+   the names and long descriptions of its entries.  The index is
+   written to SEARCH_INDEX_FILE next to PACKAGE_LIST_FILE, for the
+   same key, so that later apt-worker processes can use it too.
+
+   A search then only looks at the entries that have all trigrams of
+   all words of the pattern, and checks them with
+   stored_entry_matches_pattern as before.  Thus, the results are
+   exactly the same as without the index, and only the matching
+   entries need their records looked up.  Words shorter than three
+   bytes don't narrow the search, and when there are only such words,
+   all entries are checked.
+
+   Trigrams are bytes folded with tolower, which is also what
+   strcasestr uses.  Any case-insensitive match of a word thus has all
+   its trigrams in the index.
+
+   The file starts with a search_index_header, followed by the
+   search_index_trigrams in ascending order, followed by the postings:
+   the indices of the entries that contain each trigram, in ascending
+   order.
+*/
+
+#define SEARCH_INDEX_FILE "/var/lib/hildon-application-manager/search-index"
+#define SEARCH_INDEX_MAGIC   0x53494458
+#define SEARCH_INDEX_VERSION 1
+
+struct search_index_header {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t key;          // same as in the package list
+  uint32_t only_user;    // same as in the package list
+  uint32_t n_entries;    // same as in the package list
+  uint32_t n_trigrams;
+  uint32_t n_postings;
+};
+
+struct search_index_trigram {
+  uint32_t trigram;
+  uint32_t first;        // index of the first posting
+  uint32_t n_postings;
+};
+
+static struct {
+  char *data;
+  size_t size;
+  bool mapped;
+  search_index_header *header;
+  search_index_trigram *trigrams;
+  uint32_t *postings;
+} search_index;
+
+static uint32_t
+search_trigram (const char *p)
+{
+  return (((uint32_t) (unsigned char) tolower ((unsigned char) p[0]) << 16)
+	  | ((uint32_t) (unsigned char) tolower ((unsigned char) p[1]) << 8)
+	  | (uint32_t) (unsigned char) tolower ((unsigned char) p[2]));
+}
+
+static bool
+search_index_is_current ()
+{
+  search_index_header *h = search_index.header;
+  package_list_file_header *lh = stored_list.header;
+
+  return (h
+	  && h->key == lh->key
+	  && h->only_user == lh->only_user
+	  && h->n_entries == lh->n_entries);
+}
+
+static void
+free_search_index ()
+{
+  if (search_index.data)
+    {
+      if (search_index.mapped)
+	munmap (search_index.data, search_index.size);
+      else
+	g_free (search_index.data);
+    }
+
+  search_index.data = NULL;
+  search_index.header = NULL;
+  search_index.trigrams = NULL;
+  search_index.postings = NULL;
+}
+
+/* Check the index in DATA and make it the current one when it is
+   good and belongs to the current package list.  Otherwise, DATA is
+   left alone.
+*/
+static bool
+use_search_index (char *data, size_t size, bool mapped)
+{
+  search_index_header *h = (search_index_header *)data;
+  package_list_file_header *lh = stored_list.header;
+
+  if (size < sizeof (*h)
+      || h->magic != SEARCH_INDEX_MAGIC
+      || h->version != SEARCH_INDEX_VERSION
+      || h->key != lh->key
+      || h->only_user != lh->only_user
+      || h->n_entries != lh->n_entries
+      || size != (sizeof (*h)
+		  + (uint64_t) h->n_trigrams * sizeof (search_index_trigram)
+		  + (uint64_t) h->n_postings * sizeof (uint32_t)))
+    return false;
+
+  search_index_trigram *trigrams =
+    (search_index_trigram *)(data + sizeof (*h));
+  uint32_t *postings = (uint32_t *)(trigrams + h->n_trigrams);
+
+  for (uint32_t i = 0; i < h->n_trigrams; i++)
+    if ((i > 0 && trigrams[i].trigram <= trigrams[i-1].trigram)
+	|| trigrams[i].first > h->n_postings
+	|| trigrams[i].n_postings > h->n_postings - trigrams[i].first)
+      return false;
+
+  for (uint32_t i = 0; i < h->n_postings; i++)
+    if (postings[i] >= h->n_entries)
+      return false;
+
+  free_search_index ();
+
+  search_index.data = data;
+  search_index.size = size;
+  search_index.mapped = mapped;
+  search_index.header = h;
+  search_index.trigrams = trigrams;
+  search_index.postings = postings;
+  return true;
+}
+
+static bool
+map_search_index ()
+{
+  struct stat st;
+  void *data = MAP_FAILED;
+
+  int fd = open (SEARCH_INDEX_FILE, O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  if (fstat (fd, &st) == 0 && st.st_size > 0)
+    data = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+
+  if (data == MAP_FAILED)
+    return false;
+
+  if (!use_search_index ((char *)data, st.st_size, true))
+    {
+      munmap (data, st.st_size);
+      return false;
+    }
+
+  return true;
+}
+
+static void
+free_postings (gpointer data)
+{
+  g_array_free ((GArray *)data, TRUE);
+}
+
+static void
+add_search_trigrams (GHashTable *postings, const char *text, uint32_t entry)
+{
+  for (const char *p = text; p[0] && p[1] && p[2]; p++)
+    {
+      gpointer key = GUINT_TO_POINTER (search_trigram (p));
+      GArray *a = (GArray *) g_hash_table_lookup (postings, key);
+      if (a == NULL)
+	{
+	  a = g_array_new (FALSE, FALSE, sizeof (uint32_t));
+	  g_hash_table_insert (postings, key, a);
+	}
+      if (a->len == 0 || g_array_index (a, uint32_t, a->len - 1) != entry)
+	g_array_append_val (a, entry);
+    }
+}
+
+static gint
+compare_trigrams (gconstpointer a, gconstpointer b)
+{
+  uint32_t ta = GPOINTER_TO_UINT (*(gconstpointer *)a);
+  uint32_t tb = GPOINTER_TO_UINT (*(gconstpointer *)b);
+  return (ta > tb) - (ta < tb);
+}
+
+/* Make the index for the current package list, write it to
+   SEARCH_INDEX_FILE, and make it the current one.
+
+   Returns false when the operation has been cancelled.
+*/
+static bool
+build_search_index ()
+{
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+  pkgDepCache &cache = *(awc->cache);
+  package_list_file_header *lh = stored_list.header;
+  GHashTable *postings = g_hash_table_new_full (NULL, NULL,
+						NULL, free_postings);
+  package_record rec;
+
+  for (uint32_t i = 0; i < lh->n_entries; i++)
+    {
+      if (cancel_watch.cancelled ())
+	{
+	  g_hash_table_destroy (postings);
+	  return false;
+	}
+
+      const char *name = stored_list.strings + stored_list.entries[i].name;
+      pkgCache::PkgIterator pkg = cache.FindPkg (name);
+      if (pkg.end ())
+	continue;
+
+      add_search_trigrams (postings, name, i);
+
+      pkgCache::VerIterator installed = pkg.CurrentVer ();
+      pkgCache::VerIterator candidate = cache[pkg].CandidateVerIter(cache);
+
+      if (!installed.end ())
+	{
+	  rec.lookup (installed);
+	  add_search_trigrams (postings, rec.P->LongDesc().c_str(), i);
+	}
+      if (!candidate.end () && candidate != installed)
+	{
+	  rec.lookup (candidate);
+	  add_search_trigrams (postings, rec.P->LongDesc().c_str(), i);
+	}
+    }
+
+  GPtrArray *keys = g_ptr_array_new ();
+  uint32_t n_postings = 0;
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_hash_table_iter_init (&iter, postings);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      g_ptr_array_add (keys, key);
+      n_postings += ((GArray *)value)->len;
+    }
+  g_ptr_array_sort (keys, compare_trigrams);
+
+  search_index_header h;
+  memset (&h, 0, sizeof (h));
+  h.magic = SEARCH_INDEX_MAGIC;
+  h.version = SEARCH_INDEX_VERSION;
+  h.key = lh->key;
+  h.only_user = lh->only_user;
+  h.n_entries = lh->n_entries;
+  h.n_trigrams = keys->len;
+  h.n_postings = n_postings;
+
+  size_t size = (sizeof (h)
+		 + h.n_trigrams * sizeof (search_index_trigram)
+		 + h.n_postings * sizeof (uint32_t));
+  char *data = (char *)g_malloc (size);
+  memcpy (data, &h, sizeof (h));
+
+  search_index_trigram *trigrams =
+    (search_index_trigram *)(data + sizeof (h));
+  uint32_t *p = (uint32_t *)(trigrams + h.n_trigrams);
+  uint32_t first = 0;
+
+  for (guint i = 0; i < keys->len; i++)
+    {
+      GArray *a = (GArray *) g_hash_table_lookup (postings,
+						  keys->pdata[i]);
+      trigrams[i].trigram = GPOINTER_TO_UINT (keys->pdata[i]);
+      trigrams[i].first = first;
+      trigrams[i].n_postings = a->len;
+      memcpy (p + first, a->data, a->len * sizeof (uint32_t));
+      first += a->len;
+    }
+
+  g_ptr_array_free (keys, TRUE);
+  g_hash_table_destroy (postings);
+
+  write_stored_file (SEARCH_INDEX_FILE, data, size);
+  if (!use_search_index (data, size, false))
+    g_free (data);
+
+  return true;
+}
+
+/* Make sure that there is a search index for the current package
+   list.  Returns false when there isn't one, and sets *CANCELLED
+   when that is because the operation has been cancelled.
+*/
+static bool
+ensure_search_index (bool *cancelled)
+{
+  *cancelled = false;
+
+  if (search_index_is_current () || map_search_index ())
+    return true;
+
+  if (!build_search_index ())
+    {
+      *cancelled = true;
+      return false;
+    }
+
+  return search_index_is_current ();
+}
+
+static const search_index_trigram *
+find_search_trigram (uint32_t trigram)
+{
+  uint32_t lo = 0, hi = search_index.header->n_trigrams;
+
+  while (lo < hi)
+    {
+      uint32_t mid = lo + (hi - lo) / 2;
+      if (search_index.trigrams[mid].trigram < trigram)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+
+  if (lo < search_index.header->n_trigrams
+      && search_index.trigrams[lo].trigram == trigram)
+    return &search_index.trigrams[lo];
+  return NULL;
+}
+
+/* Return the indices of the entries of the current package list that
+   might match PATTERN, in ascending order, or NULL when the index
+   can't tell and all of them might.
+*/
+static GArray *
+search_index_candidates (const char *pattern)
+{
+  char **words = g_strsplit (pattern, " ", 0);
+  GArray *result = NULL;
+
+  for (int i = 0; words[i]; i++)
+    {
+      for (const char *w = words[i]; w[0] && w[1] && w[2]; w++)
+	{
+	  const search_index_trigram *t = find_search_trigram
+	    (search_trigram (w));
+	  const uint32_t *postings = (t
+				      ? search_index.postings + t->first
+				      : NULL);
+	  uint32_t n = t? t->n_postings : 0;
+
+	  if (result == NULL)
+	    {
+	      result = g_array_sized_new (FALSE, FALSE, sizeof (uint32_t), n);
+	      g_array_append_vals (result, postings, n);
+	    }
+	  else
+	    {
+	      /* Intersect in place.
+	       */
+	      uint32_t *r = (uint32_t *)result->data;
+	      guint len = 0, j = 0;
+	      for (guint k = 0; k < result->len && j < n; k++)
+		{
+		  while (j < n && postings[j] < r[k])
+		    j++;
+		  if (j < n && postings[j] == r[k])
+		    r[len++] = r[k];
+		}
+	      g_array_set_size (result, len);
+	    }
+
+	  if (result->len == 0)
+	    break;
+	}
+
+      if (result && result->len == 0)
+	break;
+    }
+
+  g_strfreev (words);
+  return result;
+}
+
+static void
+encode_stored_entry (package_list_file_entry *e, const char *strings,
+		     void *data)
+{
+  package_list_request *req = (package_list_request *)data;
+  const char *name = strings + e->name;
+  const char *fingerprint = strings + e->fingerprint;
+  bool iend = !(e->bits & plf_installed);
+  bool cend = !(e->bits & plf_available);
+
+  // skip non user packages if requested
+  //
+  if (req->only_user
+      && !(e->bits & (plf_installed_user | plf_candidate_user)))
+    return;
+
+  // skip not-installed packages if requested
+  //
+  if (req->only_installed && iend)
+    return;
+
+  // skip non-available packages if requested
+  //
+  if (req->only_available && cend)
+    return;
+
+  // skip packages that don't match the pattern if requested
+  //
+  if (req->pattern && !stored_entry_matches_pattern (name, req->pattern))
+    return;
+
+  if (e->flags & pkgflag_system_update)
+    {
+      if (ssu_packages_needs_refresh)
+	req->ssu_pkgs_found = g_slist_prepend (req->ssu_pkgs_found,
+					       g_strdup (name));
+
+      // skip system update meta-packages that are not installed
+      //
+      if (req->only_user && iend && !cend)
+	return;
+    }
+
+  if (req->new_state)
+    {
+      package_list_entry_state *st = new package_list_entry_state;
+      st->fingerprint = g_strdup (fingerprint);
+      st->flags = e->flags;
+      g_hash_table_insert (req->new_state, g_strdup (name), st);
+    }
+
+  if (req->old_state)
+    {
+      // Compare with what the client already has.
+      //
+      package_list_entry_state *old = (package_list_entry_state *)
+	g_hash_table_lookup (req->old_state, name);
+      bool unchanged = old && !strcmp (old->fingerprint, fingerprint);
+
+      g_hash_table_remove (req->old_state, name);
+      if (unchanged)
+	return;
+
+      if (req->changed)
+	g_ptr_array_add (req->changed, (gpointer) name);
+
+      response.encode_int (1);
+    }
+
+  response.encode_string (name);
+  response.encode_int (e->bits & plf_broken);
+
+  response.encode_string (stored_string (strings, e->installed_version));
+  response.encode_int64 (e->installed_size);
+  response.encode_string (stored_string (strings, e->installed_section));
+  response.encode_string (stored_string (strings, e->installed_pretty_name));
+  response.encode_string
+    (stored_string (strings, e->installed_short_description));
+  response.encode_string (stored_string (strings, e->installed_icon_hash));
+
+  response.encode_string (stored_string (strings, e->available_version));
+  response.encode_string (stored_string (strings, e->available_section));
+  response.encode_string (stored_string (strings, e->available_pretty_name));
+  response.encode_string
+    (stored_string (strings, e->available_short_description));
+  response.encode_string (stored_string (strings, e->available_icon_hash));
+
+  response.encode_int (e->flags);
+
+  // Ship out a piece when streaming and enough has accumulated.
+  //
+  if (req->chunk_size > 0 && response.get_len () >= req->chunk_size)
+    {
+      send_partial_response ();
+      response.encode_int (1);
+    }
+}
+
+static bool
+encode_package_list (bool only_user, bool only_installed,
+		     bool only_available, const char *pattern,
+		     int chunk_size,
+		     GHashTable *old_state, GHashTable *new_state,
+		     GPtrArray *changed)
+{
+  package_list_request req;
+  bool emitted;
+  bool ok;
+
+  req.only_user = only_user;
+  req.only_installed = only_installed;
+  req.only_available = only_available;
+  req.pattern = pattern;
+  req.chunk_size = chunk_size;
+  req.old_state = old_state;
+  req.new_state = new_state;
+  req.changed = changed;
+  req.ssu_pkgs_found = NULL;
+
+  ok = ensure_stored_list (only_user, encode_stored_entry, &req, &emitted);
+
+  if (ok && !emitted)
+    {
+      GArray *candidates = NULL;
+      bool cancelled;
+
+      if (pattern)
+	{
+	  if (ensure_search_index (&cancelled))
+	    candidates = search_index_candidates (pattern);
+	  else if (cancelled)
+	    ok = false;
+	}
+
+      // Only visit the entries that pass the filters, and of those
+      // only the ones that might match the pattern.
+      //
+      uint32_t n_entries = stored_list.header->n_entries;
+      guint32 *wanted = stored_list_filter (only_user, only_installed,
+					    only_available);
+      uint32_t k = 0;
+
+      while (ok)
+	{
+	  uint32_t i;
+
+	  if (candidates)
+	    {
+	      if (k >= candidates->len)
+		break;
+	      i = g_array_index (candidates, uint32_t, k++);
+	      if (wanted && !pset_has (wanted, i))
+		continue;
+	    }
+	  else
+	    {
+	      i = wanted? pset_next (wanted, n_entries, k) : k;
+	      if (i >= n_entries)
+		break;
+	      k = i + 1;
+	    }
+
+	  if (cancel_watch.cancelled ())
+	    {
+	      ok = false;
+	      break;
+	    }
+
+	  encode_stored_entry (&stored_list.entries[i], stored_list.strings,
+			       &req);
+	}
+
+      g_free (wanted);
+      if (candidates)
+	g_array_free (candidates, TRUE);
+    }
+
+  if (!ok)
+    {
+      g_slist_foreach (req.ssu_pkgs_found, (GFunc) g_free, NULL);
+      g_slist_free (req.ssu_pkgs_found);
+      return false;
+    }
+
+  /* Update the global GArray, if needed */
+  if (ssu_packages_needs_refresh)
+    {
+      ssu_packages_set (req.ssu_pkgs_found);
+
+      if (req.ssu_pkgs_found != NULL)
+        {
+          /* Free local GSList */
+          g_slist_free (req.ssu_pkgs_found);
+          req.ssu_pkgs_found = NULL;
+        }
+
+      /* Update global flag */
+      ssu_packages_needs_refresh = false;
+    }
+
+  return true;
+}
+
+void
+cmd_get_package_list ()
+{
+  bool only_user = request.decode_int ();
+  bool only_installed = request.decode_int ();
+  bool only_available = request.decode_int ();
+  const char *pattern = request.decode_string_in_place ();
+  bool show_magic_sys = request.decode_int ();
+  int chunk_size = request.decode_int ();
+
+  if (!ensure_cache (true))
+    {
+      response.encode_int (0);
+      return;
+    }
+
+  response.encode_int (1);
+
+  GHashTable *new_state = pattern ? NULL : package_list_state_new ();
+
+  if (!encode_package_list (only_user, only_installed, only_available,
+			    pattern, chunk_size, NULL, new_state, NULL))
+    {
+      if (new_state)
+	g_hash_table_destroy (new_state);
+      return;
+    }
+
+  if (new_state)
+    set_package_list_snapshot (new_state,
+			       only_user, only_installed, only_available,
+			       show_magic_sys);
+
+  if (show_magic_sys)
+    {
+      // Append the "magic:sys" package that represents all system
+      // packages.  This artificial package is identified by its name
+      // and handled specially by MARK_NAMED_PACKAGE_FOR_INSTALL, etc.
+
+      // Name
+      response.encode_string ("magic:sys");
+
+      // Broken?  XXX - give real information here
+      response.encode_int (FALSE);
+
+      // Installed version
+      response.encode_string ("");
+      response.encode_int64 (1000);
+      response.encode_string ("user/system");
+      response.encode_string ("Operating System");
+      response.encode_string ("All system packages");
+      response.encode_string (NULL);
+
+      // Available version
+      response.encode_string ("");
+      response.encode_string ("user/system");
+      response.encode_string ("Operating System");
+      response.encode_string ("Updates to all system packages");
+      response.encode_string (NULL);
+    }
+}
+
+static void
+encode_removed_package (gpointer key, gpointer value, gpointer data)
+{
+  response.encode_string ((const char *)key);
+}
+
+/* Whether a package can be installed depends on the packages that it
+   depends on, all the way down, so when a package has changed, the
+   packages that depend on it, all the way up, might have changed as
+   well.  What would be removed together with a package depends on the
+   packages that depend on it, so when a package has changed, the
+   packages that it depends on directly might have changed.  We
+   follow the dependencies in these directions to find the packages
+   whose GET_PACKAGE_INFO might be different, even if their entries in
+   the package list are the same.
+
+   Only the reverse dependencies of the changed packages, and of the
+   virtual packages that they provide, are followed transitively; the
+   packages that a changed package depends on are added afterwards
+   and not followed any further.  Following both directions from
+   every package that is found would reach almost the whole cache
+   through libraries that everything uses.
+   Only the dependencies in the current cache are known, so a
+   dependency that a changed package has dropped is not followed.
+*/
+
+struct affected_packages {
+  pkgDepCache *cache;
+  bool *seen;
+  vector<pkgCache::Package *> found;
+};
+
+static void
+affect_package (affected_packages *a, pkgCache::PkgIterator pkg)
+{
+  if (pkg.end () || a->seen[pkg->ID])
+    return;
+
+  a->seen[pkg->ID] = true;
+  a->found.push_back (pkg);
+}
+
+static bool
+is_strong_dependency (pkgCache::DepIterator &dep)
+{
+  return (dep->Type == pkgCache::Dep::Depends
+	  || dep->Type == pkgCache::Dep::PreDepends
+	  || dep->Type == pkgCache::Dep::Conflicts);
+}
+
+static void
+affect_provides (affected_packages *a, pkgCache::VerIterator ver)
+{
+  if (ver.end ())
+    return;
+
+  for (pkgCache::PrvIterator prv = ver.ProvidesList (); !prv.end (); prv++)
+    affect_package (a, prv.ParentPkg ());
+}
+
+static void
+affect_dependencies (affected_packages *a, pkgCache::VerIterator ver)
+{
+  if (ver.end ())
+    return;
+
+  for (pkgCache::DepIterator dep = ver.DependsList (); !dep.end (); dep++)
+    if (is_strong_dependency (dep))
+      affect_package (a, dep.TargetPkg ());
+}
+
+static void
+affect_changed_package (gpointer key, gpointer value, gpointer data)
+{
+  affected_packages *a = (affected_packages *)data;
+  affect_package (a, a->cache->FindPkg ((const char *)key));
+}
+
+static void
+encode_affected_packages (GPtrArray *changed, GHashTable *removed,
+			  GHashTable *listed)
+{
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+  pkgDepCache &cache = *(awc->cache);
+  unsigned n = cache.GetCache ().Head ().PackageCount;
+  affected_packages a;
+
+  a.cache = &cache;
+  a.seen = g_new0 (bool, n);
+
+  for (guint i = 0; i < changed->len; i++)
+    affect_changed_package (g_ptr_array_index (changed, i), NULL, &a);
+  g_hash_table_foreach (removed, affect_changed_package, &a);
+
+  /* The changed packages themselves are sent in full anyway.
+   */
+  size_t n_changed = a.found.size ();
+
+  for (size_t i = 0; i < n_changed; i++)
+    {
+      pkgCache::PkgIterator pkg (cache.GetCache (), a.found[i]);
+      affect_provides (&a, pkg.CurrentVer ());
+      affect_provides (&a, cache[pkg].CandidateVerIter (cache));
+    }
+
+  for (size_t i = 0; i < a.found.size (); i++)
+    {
+      pkgCache::PkgIterator pkg (cache.GetCache (), a.found[i]);
+
+      for (pkgCache::DepIterator dep = pkg.RevDependsList ();
+	   !dep.end (); dep++)
+	if (is_strong_dependency (dep))
+	  affect_package (&a, dep.ParentPkg ());
+
+      for (pkgCache::PrvIterator prv = pkg.ProvidesList ();
+	   !prv.end (); prv++)
+	affect_package (&a, prv.OwnerPkg ());
+    }
+
+  for (size_t i = 0; i < n_changed; i++)
+    {
+      pkgCache::PkgIterator pkg (cache.GetCache (), a.found[i]);
+      affect_dependencies (&a, pkg.CurrentVer ());
+      affect_dependencies (&a, cache[pkg].CandidateVerIter (cache));
+    }
+
+  for (size_t i = n_changed; i < a.found.size (); i++)
+    {
+      pkgCache::PkgIterator pkg (cache.GetCache (), a.found[i]);
+      if (g_hash_table_lookup (listed, pkg.Name ()))
+	response.encode_string (pkg.Name ());
+    }
+
+  g_free (a.seen);
+}
+
+void
+cmd_get_package_list_delta ()
+{
+  int generation = request.decode_int ();
+  bool only_user = request.decode_int ();
+  bool only_installed = request.decode_int ();
+  bool only_available = request.decode_int ();
+  bool show_magic_sys = request.decode_int ();
+
+  if (!ensure_cache (true))
+    {
+      response.encode_int (-1);
+      response.encode_int (0);
+      return;
+    }
+
+  if (list_snapshot.entries == NULL
+      || generation < 0
+      || generation != list_snapshot.generation
+      || only_user != list_snapshot.only_user
+      || only_installed != list_snapshot.only_installed
+      || only_available != list_snapshot.only_available
+      || show_magic_sys != list_snapshot.show_magic_sys)
+    {
+      // The client needs the full list.
+      response.encode_int (cache_generation);
+      response.encode_int (0);
+      return;
+    }
+
+  response.encode_int (cache_generation);
+  response.encode_int (1);
+
+  if (generation == cache_generation)
+    {
+      // Nothing can have changed.
+      response.encode_int (0);
+      response.encode_string (NULL);
+      response.encode_string (NULL);
+      return;
+    }
+
+  GHashTable *new_state = package_list_state_new ();
+  GPtrArray *changed = g_ptr_array_new ();
+
+  if (!encode_package_list (only_user, only_installed, only_available,
+			    NULL, 0, list_snapshot.entries, new_state,
+			    changed))
+    {
+      // OLD_STATE has been modified, so we can't use it anymore.
+      g_ptr_array_free (changed, TRUE);
+      g_hash_table_destroy (new_state);
+      g_hash_table_destroy (list_snapshot.entries);
+      list_snapshot.entries = NULL;
+
+      response.reset ();
+      response.encode_int (cache_generation);
+      response.encode_int (0);
+      return;
+    }
+
+  response.encode_int (0);
+
+  // What is left in the old snapshot is gone now.
+  g_hash_table_foreach (list_snapshot.entries, encode_removed_package, NULL);
+  response.encode_string (NULL);
+
+  encode_affected_packages (changed, list_snapshot.entries, new_state);
+  response.encode_string (NULL);
+  g_ptr_array_free (changed, TRUE);
+
+  set_package_list_snapshot (new_state,
+			     only_user, only_installed, only_available,
+			     show_magic_sys);
+}
+
+/* APTCMD_GET_ICONS
+
+   When the package list has been served from PACKAGE_LIST_FILE, the
+   icons have not been put into ICON_STORE yet.  In that case, we find
+   the packages with the wanted icons in the stored list and look at
+   their records.
+*/
 
-              // skip system update meta-packages that are not installed
-              //
-              if (only_user && iend && !cend)
-                continue;
-            }
-        }
+static const char *
+lookup_icon (const char *hash)
+{
+  return (icon_store
+	  ? (const char *) g_hash_table_lookup (icon_store, hash)
+	  : NULL);
+}
 
-      // Name
-      response.encode_string (pkg.Name ());
+static void
+store_icon_of_version (const char *name, bool installed)
+{
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+  pkgDepCache &cache = *(awc->cache);
 
-      // Broken.
-      bool broken = (sc.NowBroken()
-		     || (pkg.State () != pkgCache::PkgIterator::NeedsNothing));
-      response.encode_int (broken);
+  pkgCache::PkgIterator pkg = cache.FindPkg (name);
+  if (pkg.end ())
+    return;
 
-      // Installed version
-      if (!iend)
-        {
-          if (!irec_looked)
-            {
-              irec.lookup(installed);
-              irec_looked = true;
-            }
-	  encode_version_info (2, irec, installed, true);
-        }
-      else
-	encode_empty_version_info (true);
+  pkgCache::VerIterator ver = (installed
+			       ? pkg.CurrentVer ()
+			       : cache[pkg].CandidateVerIter(cache));
+  if (ver.end ())
+    return;
 
-      // Available version
-      //
-      // We only offer an available version if the package is not
-      // installed at all, or if the available version is newer than
-      // the installed one, or if the installed version is broken.
+  /* The hash in VERSION_FIELDS might still be there while the icon
+     has been dropped from ICON_STORE, so we always read the record.
+  */
+  package_record rec;
+  rec.lookup (ver);
+  g_free (parse_icon_hash (rec));
+}
 
-      if (!cend && (iend
-	      || installed.CompareVer (candidate) < 0
-	      || broken))
-      {
-        if (!crec_looked)
-          {
-            crec.lookup(candidate);
-            crec_looked = true;
-          }
-	encode_version_info (1, crec, candidate, false);
-      }
-      else
-	encode_empty_version_info (false);
+static void
+store_icons_from_stored_list (GHashTable *wanted)
+{
+  const char *strings = stored_list.strings;
 
-      if (flags == 0 && !cend && !crec_looked)
-	{
-	  crec.lookup(candidate);
-	  flags = get_flags (crec);
-	}
-      response.encode_int (flags);
-    }
+  if (stored_list.data == NULL || !ensure_cache (true))
+    return;
 
-  /* Update the global GArray, if needed */
-  if (ssu_packages_needs_refresh)
+  for (uint32_t i = 0; i < stored_list.header->n_entries; i++)
     {
-      ssu_packages_set (ssu_pkgs_found);
+      package_list_file_entry *e = &stored_list.entries[i];
+      const char *installed_hash =
+	stored_string (strings, e->installed_icon_hash);
+      const char *available_hash =
+	stored_string (strings, e->available_icon_hash);
 
-      if (ssu_pkgs_found != NULL)
-        {
-          /* Free local GSList */
-          g_slist_free (ssu_pkgs_found);
-          ssu_pkgs_found = NULL;
-        }
+      if (installed_hash
+	  && g_hash_table_lookup (wanted, installed_hash)
+	  && !lookup_icon (installed_hash))
+	store_icon_of_version (strings + e->name, true);
 
-      /* Update global flag */
-      ssu_packages_needs_refresh = false;
+      if (available_hash
+	  && g_hash_table_lookup (wanted, available_hash)
+	  && !lookup_icon (available_hash))
+	store_icon_of_version (strings + e->name, false);
     }
+}
 
-  if (show_magic_sys)
-    {
-      // Append the "magic:sys" package that represents all system
-      // packages.  This artificial package is identified by its name
-      // and handled specially by MARK_NAMED_PACKAGE_FOR_INSTALL, etc.
-
-      // Name
-      response.encode_string ("magic:sys");
+void
+cmd_get_icons ()
+{
+  GPtrArray *hashes = g_ptr_array_new ();
+  GHashTable *missing = NULL;
+  const char *hash;
 
-      // Broken?  XXX - give real information here
-      response.encode_int (FALSE);
+  if (icon_store && g_hash_table_size (icon_store) > MAX_STORED_ICONS)
+    g_hash_table_remove_all (icon_store);
 
-      // Installed version
-      response.encode_string ("");
-      response.encode_int64 (1000);
-      response.encode_string ("user/system");
-      response.encode_string ("Operating System");
-      response.encode_string ("All system packages");
-      response.encode_string (NULL);
+  while ((hash = request.decode_string_in_place ()))
+    {
+      g_ptr_array_add (hashes, (gpointer) hash);
+      if (!lookup_icon (hash))
+	{
+	  if (missing == NULL)
+	    missing = g_hash_table_new (g_str_hash, g_str_equal);
+	  g_hash_table_insert (missing, (gpointer) hash, (gpointer) hash);
+	}
+    }
 
-      // Available version
-      response.encode_string ("");
-      response.encode_string ("user/system");
-      response.encode_string ("Operating System");
-      response.encode_string ("Updates to all system packages");
-      response.encode_string (NULL);
+  if (missing)
+    {
+      store_icons_from_stored_list (missing);
+      g_hash_table_destroy (missing);
     }
+
+  for (guint i = 0; i < hashes->len; i++)
+    response.encode_string (lookup_icon ((const char *)
+					 g_ptr_array_index (hashes, i)));
+  g_ptr_array_free (hashes, TRUE);
 }
 
 void
@@ -3068,19 +6266,15 @@ cmd_get_system_update_packages ()
 
   pkgDepCache &cache = *(awc->cache);
 
-  for (pkgCache::PkgIterator pkg = cache.PkgBegin(); !pkg.end (); pkg++)
-    {
-      pkgCache::VerIterator installed = pkg.CurrentVer ();
-      pkgCache::VerIterator candidate = cache[pkg].CandidateVerIter(cache);
+  ensure_system_update_set ();
 
-      if (installed.end () || candidate.end ())
-	continue;
+  guint32 *set = package_sets.sets[pset_system_update];
+  unsigned n = package_sets.n_packages;
 
-      package_record rec;
-      rec.lookup(candidate);
-      int flags = get_flags (rec);
-      if (flags & pkgflag_system_update)
-	response.encode_string (pkg.Name ());
+  for (unsigned i = pset_next (set, n, 0); i < n; i = pset_next (set, n, i + 1))
+    {
+      pkgCache::PkgIterator pkg (cache.GetCache (), package_sets.packages[i]);
+      response.encode_string (pkg.Name ());
     }
 
   response.encode_string (NULL);
@@ -3187,14 +6381,10 @@ removable_status ()
   return status_unable;
 }
 
-void
-cmd_get_package_info ()
+static void
+get_package_info (const char *package, bool only_installable_info,
+		  apt_proto_package_info &info)
 {
-  const char *package = request.decode_string_in_place ();
-  bool only_installable_info = request.decode_int ();
-
-  apt_proto_package_info info;
-
   info.installable_status = status_unknown;
   info.download_size = 0;
   info.install_user_size_delta = 0;
@@ -3208,7 +6398,6 @@ cmd_get_package_info ()
       AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
       pkgDepCache &cache = *(awc->cache);
       pkgCache::PkgIterator pkg = cache.FindPkg (package);
-      package_record rec;
 
       // simulate install
 
@@ -3230,9 +6419,8 @@ cmd_get_package_info ()
 	    {
 	      pkgCache::VerIterator ver = cache[pkg].CandidateVerIter(cache);
 
-	      rec.lookup(ver);
-	      info.install_flags |= get_flags (rec);
-	      info.required_free_space += get_required_free_space (rec);
+	      info.install_flags |= get_flags (ver);
+	      info.required_free_space += get_required_free_space (ver);
 	    }
 	}
 
@@ -3257,8 +6445,7 @@ cmd_get_package_info ()
 		    {
 		      pkgCache::VerIterator ver = pkg.CurrentVer ();
 
-		      rec.lookup(ver);
-		      int flags = get_flags (rec);
+		      int flags = get_flags (ver);
 		      if (flags & pkgflag_system_update)
 			{
 			  info.removable_status =
@@ -3279,10 +6466,40 @@ cmd_get_package_info ()
 	    }
 	}
     }
+}
+
+void
+cmd_get_package_info ()
+{
+  const char *package = request.decode_string_in_place ();
+  bool only_installable_info = request.decode_int ();
 
+  apt_proto_package_info info;
+  get_package_info (package, only_installable_info, info);
   response.encode_mem (&info, sizeof (apt_proto_package_info));
 }
 
+/* APTCMD_GET_PACKAGE_INFOS
+
+   The same as APTCMD_GET_PACKAGE_INFO, but for a whole list of
+   packages in one go.
+ */
+
+void
+cmd_get_package_infos ()
+{
+  bool only_installable_info = request.decode_int ();
+  const char *package;
+
+  while ((package = request.decode_string_in_place ()))
+    {
+      apt_proto_package_info info;
+      get_package_info (package, only_installable_info, info);
+      response.encode_mem (&info, sizeof (apt_proto_package_info));
+    }
+}
+
+
 /* APTCMD_GET_PACKAGE_DETAILS
    
    Like APTCMD_GET_PACKAGE_INFO, this command performs a simulated
@@ -3296,12 +6513,10 @@ append_display_name (GString *str, const pkgCache::PkgIterator &pkg)
   pkgCache::VerIterator ver = pkg.CurrentVer();
   if (!ver.end())
     {
-      package_record rec;
-      rec.lookup(ver);
-      string pretty_name = get_pretty_name (rec);
-      if (!pretty_name.empty())
+      const char *pretty_name = get_pretty_name (ver);
+      if (*pretty_name)
 	{
-	  g_string_append (str, pretty_name.c_str());
+	  g_string_append (str, pretty_name);
 	  return;
 	}
     }
@@ -3605,14 +6820,12 @@ encode_package_repository (pkgCache::VerIterator Version, int summary_kind)
 }
 
 void
-encode_package_and_version (const pkgCache::VerIterator ver,
-                            package_record &rec)
+encode_package_and_version (const pkgCache::VerIterator ver)
 {
-  rec.lookup(ver);
   GString *str = g_string_new ("");
-  string pretty = get_pretty_name (rec);
-  if (!pretty.empty())
-    g_string_append (str, pretty.c_str());
+  const char *pretty = get_pretty_name (ver);
+  if (*pretty)
+    g_string_append (str, pretty);
   else
     g_string_append (str, ver.ParentPkg().Name());
   g_string_append_printf (str, " (%s)", ver.VerStr());
@@ -3625,7 +6838,6 @@ encode_install_summary (const char *want)
 {
   AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
   pkgDepCache &cache = *(awc->cache);
-  package_record rec;
 
   if (cache.BrokenCount() > 0)
     fprintf (stderr, "[ Some installed packages are broken! ]\n");
@@ -3641,17 +6853,17 @@ encode_install_summary (const char *want)
       if (sc.NewInstall())
 	{
 	  response.encode_int (sumtype_installing);
-	  encode_package_and_version (sc.CandidateVerIter(cache), rec);
+	  encode_package_and_version (sc.CandidateVerIter(cache));
 	}
       else if (sc.Upgrade())
 	{
 	  response.encode_int (sumtype_upgrading);
-	  encode_package_and_version (sc.CandidateVerIter(cache), rec);
+	  encode_package_and_version (sc.CandidateVerIter(cache));
 	}
       else if (sc.Delete())
 	{
 	  response.encode_int (sumtype_removing);
-	  encode_package_and_version (pkg.CurrentVer(), rec);
+	  encode_package_and_version (pkg.CurrentVer());
 	}
 
       if (sc.InstBroken())
@@ -3661,7 +6873,7 @@ encode_install_summary (const char *want)
 	  else if (!sc.NowBroken())
 	    {
 	      response.encode_int (sumtype_conflicting);
-	      encode_package_and_version (pkg.CurrentVer(), rec);
+	      encode_package_and_version (pkg.CurrentVer());
 	    }
 	}
     }
@@ -3674,7 +6886,6 @@ encode_remove_summary (pkgCache::PkgIterator &want)
 {
   AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
   pkgDepCache &cache = *(awc->cache);
-  package_record rec;
 
   if (cache.BrokenCount() > 0)
     log_stderr ("[ Some installed packages are broken! ]\n");
@@ -3690,13 +6901,13 @@ encode_remove_summary (pkgCache::PkgIterator &want)
       if (sc.Delete())
 	{
 	  response.encode_int (sumtype_removing);
-	  encode_package_and_version (pkg.CurrentVer(), rec);
+	  encode_package_and_version (pkg.CurrentVer());
 	}
 
       if (sc.InstBroken() && !sc.NowBroken())
 	{
 	  response.encode_int (sumtype_needed_by);
-	  encode_package_and_version (pkg.CurrentVer(), rec);
+	  encode_package_and_version (pkg.CurrentVer());
 	}
     }
 
@@ -3822,9 +7033,7 @@ cmd_third_party_policy_check ()
     {
       pkgDepCache &cache = *(awc->cache);
       pkgCache::VerIterator candidate = cache[pkg].CandidateVerIter (cache);
-      package_record rec;
-      rec.lookup(candidate);
-      int flags = get_flags (rec);
+      int flags = get_flags (candidate);
 
       // skip non available packages and system update meta-packages
       if (!candidate.end () && !(flags & pkgflag_system_update))
@@ -4054,114 +7263,476 @@ download_lists (xexp *catalogues_for_report,
 		  xexp_append_1 (cat, errors);
 		}
 
-	      xexp *error = xexp_list_new ("error");
-	      xexp_aset_text (error, "uri", (*I)->DescURI().c_str());
-	      xexp_aset_text (error, "msg", (*I)->ErrorText.c_str());
+	      xexp *error = xexp_list_new ("error");
+	      xexp_aset_text (error, "uri", (*I)->DescURI().c_str());
+	      xexp_aset_text (error, "msg", (*I)->ErrorText.c_str());
+
+	      xexp_append_1 (errors, error);
+	    }
+	}
+
+      if (cat_glist != NULL)
+	g_list_free (cat_glist);
+
+      _error->Error ("Failed to fetch %s  %s", (*I)->DescURI().c_str(),
+                     (*I)->ErrorText.c_str());
+      some_failed = true;
+    }
+
+  // Clean out any old list files
+  if (_config->FindB("APT::Get::List-Cleanup",true) == true)
+    {
+      Fetcher.Clean (_config->FindDir("Dir::State::lists"));
+      Fetcher.Clean (_config->FindDir("Dir::State::lists") + "partial/");
+    }
+
+  if (some_failed)
+    *result = rescode_partial_success;
+  else
+    *result = rescode_success;
+
+  return true;
+}
+
+/* Unlink a directory hirarchy.
+ */
+
+int
+unlink_callback (const char *name, const struct stat *, int m, struct FTW *f)
+{
+  // fprintf (stderr, "- %s\n", name);
+
+  if (m == FTW_DP)
+    {
+      if (rmdir (name))
+	perror (name);
+    }
+  else if (m == FTW_F)
+    {
+      if (unlink (name))
+	perror (name);
+    }
+
+  return 0;
+}
+
+int
+unlink_file_tree (const char *tree)
+{
+  return nftw (tree, unlink_callback, 10, FTW_DEPTH);
+}
+
+/* Versioned lists directories
+
+   Dir::State::Lists is a symlink to a directory next to it whose
+   name ends with a generation number, such as "lists.12".
+   update_package_cache downloads into the next generation and
+   activates it by replacing the symlink, which is atomic.  Until
+   then, the current generation is left alone, and giving up on the
+   new one means just not touching the symlink.
+
+   The new generation starts out with hard links to the files of the
+   current one since libapt-pkg needs them for its If-Modified-Since
+   requests and to resume partial downloads.  The lists directory is
+   flat except for "partial/", so this is a single readdir pass over
+   each of them instead of a nftw walk.
+
+   Removing a generation takes one unlink per index, so
+   update_package_cache doesn't do it.  The generations that it has
+   superseded or given up on are left in place and removed after the
+   response has been sent, and CLEAN removes all generations other
+   than the current one, in case we were interrupted before.  A new
+   generation always gets a number above all the ones on disk, so it
+   never has to wait for an old one to be removed.
+*/
+
+static string
+lists_generation_dir (const string &lists_dir, int generation)
+{
+  char *dir = g_strdup_printf ("%s.%d", lists_dir.c_str (), generation);
+  string res = dir;
+  g_free (dir);
+  return res;
+}
+
+/* Return the generation that LISTS_DIR points to, or -1 when it
+   isn't a symlink to a generation.
+*/
+static int
+lists_generation (const string &lists_dir)
+{
+  char target[PATH_MAX];
+  ssize_t n = readlink (lists_dir.c_str (), target, sizeof (target) - 1);
+  if (n < 0)
+    return -1;
+  target[n] = '\0';
+
+  string base = flNotDir (lists_dir) + ".";
+  if (strncmp (target, base.c_str (), base.length ()) != 0)
+    return -1;
+
+  const char *num = target + base.length ();
+  char *end;
+  long generation = strtol (num, &end, 10);
+  if (end == num || *end != '\0' || generation < 0 || generation > INT_MAX)
+    return -1;
+  return generation;
+}
+
+/* Make LISTS_DIR point to GENERATION.  The new symlink is created
+   next to it and renamed over it.
+*/
+static bool
+set_lists_generation (const string &lists_dir, int generation)
+{
+  string target = flNotDir (lists_generation_dir (lists_dir, generation));
+  string tmp = lists_dir + ".link";
+
+  unlink (tmp.c_str ());
+  if (symlink (target.c_str (), tmp.c_str ()) < 0)
+    {
+      log_stderr ("%s: %m", tmp.c_str ());
+      return false;
+    }
+
+  if (rename (tmp.c_str (), lists_dir.c_str ()) < 0)
+    {
+      log_stderr ("%s: %m", lists_dir.c_str ());
+      unlink (tmp.c_str ());
+      return false;
+    }
+
+  return true;
+}
+
+/* Find the current generation of LISTS_DIR, turning a plain
+   directory into generation 0 first.  When we were interrupted
+   between renaming the directory and creating the symlink, the
+   symlink is created now.
+*/
+static int
+ensure_lists_generation (const string &lists_dir)
+{
+  int generation = lists_generation (lists_dir);
+  if (generation >= 0)
+    return generation;
+
+  string first = lists_generation_dir (lists_dir, 0);
+  struct stat st;
+
+  if (lstat (lists_dir.c_str (), &st) == 0)
+    {
+      if (!S_ISDIR (st.st_mode))
+	{
+	  log_stderr ("%s: not a directory", lists_dir.c_str ());
+	  return -1;
+	}
+      if (rename (lists_dir.c_str (), first.c_str ()) < 0)
+	{
+	  log_stderr ("%s: %m", first.c_str ());
+	  return -1;
+	}
+    }
+  else if (stat (first.c_str (), &st) < 0
+	   && mkdir (first.c_str (), 0755) < 0)
+    {
+      log_stderr ("%s: %m", first.c_str ());
+      return -1;
+    }
+
+  return set_lists_generation (lists_dir, 0)? 0 : -1;
+}
+
+static bool
+is_lists_subdir (const char *dir, struct dirent *ent)
+{
+  if (ent->d_type != DT_UNKNOWN)
+    return ent->d_type == DT_DIR;
+
+  struct stat st;
+  char *name = g_strdup_printf ("%s/%s", dir, ent->d_name);
+  bool res = lstat (name, &st) == 0 && S_ISDIR (st.st_mode);
+  g_free (name);
+  return res;
+}
+
+static bool
+is_dot_or_dotdot (const char *name)
+{
+  return (name[0] == '.'
+	  && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')));
+}
+
+/* Create NEW_DIR with hard links to the files in OLD_DIR, and the
+   same for its subdirectories.
+*/
+static bool
+link_lists_dir (const char *old_dir, const char *new_dir)
+{
+  if (mkdir (new_dir, 0755) < 0)
+    {
+      log_stderr ("%s: %m", new_dir);
+      return false;
+    }
+
+  DIR *d = opendir (old_dir);
+  if (d == NULL)
+    {
+      log_stderr ("%s: %m", old_dir);
+      return false;
+    }
+
+  bool success = true;
+  struct dirent *ent;
+  while (success && (ent = readdir (d)) != NULL)
+    {
+      if (is_dot_or_dotdot (ent->d_name))
+	continue;
+
+      char *old_name = g_strdup_printf ("%s/%s", old_dir, ent->d_name);
+      char *new_name = g_strdup_printf ("%s/%s", new_dir, ent->d_name);
 
-	      xexp_append_1 (errors, error);
-	    }
+      if (is_lists_subdir (old_dir, ent))
+	success = link_lists_dir (old_name, new_name);
+      else if (link (old_name, new_name) < 0)
+	{
+	  log_stderr ("%s: %m", new_name);
+	  success = false;
 	}
 
-      if (cat_glist != NULL)
-	g_list_free (cat_glist);
-
-      _error->Error ("Failed to fetch %s  %s", (*I)->DescURI().c_str(),
-                     (*I)->ErrorText.c_str());
-      some_failed = true;
+      g_free (old_name);
+      g_free (new_name);
     }
 
-  // Clean out any old list files
-  if (_config->FindB("APT::Get::List-Cleanup",true) == true)
+  closedir (d);
+  return success;
+}
+
+static void
+remove_lists_dir (const char *dir)
+{
+  DIR *d = opendir (dir);
+  if (d == NULL)
+    return;
+
+  struct dirent *ent;
+  while ((ent = readdir (d)) != NULL)
     {
-      Fetcher.Clean (_config->FindDir("Dir::State::lists"));
-      Fetcher.Clean (_config->FindDir("Dir::State::lists") + "partial/");
-    }
+      if (is_dot_or_dotdot (ent->d_name))
+	continue;
 
-  if (some_failed)
-    *result = rescode_partial_success;
-  else
-    *result = rescode_success;
+      char *name = g_strdup_printf ("%s/%s", dir, ent->d_name);
+      if (is_lists_subdir (dir, ent))
+	remove_lists_dir (name);
+      else if (unlink (name) < 0)
+	log_stderr ("%s: %m", name);
+      g_free (name);
+    }
 
-  return true;
+  closedir (d);
+  if (rmdir (dir) < 0)
+    log_stderr ("%s: %m", dir);
 }
 
-/* Duplicate the directory hierarchy at OLD to NEW by creating hard
-   links for all the regular files.
+/* Return the generation of the directory NAME next to LISTS_DIR,
+   or -1 when it isn't one.
 */
+static long
+lists_generation_of_name (const string &lists_dir, const char *name)
+{
+  string base = flNotDir (lists_dir) + ".";
+  if (strncmp (name, base.c_str (), base.length ()) != 0)
+    return -1;
 
-static int duplink_base;
-static const char *duplink_new;
+  const char *num = name + base.length ();
+  char *end;
+  long generation = strtol (num, &end, 10);
+  if (end == num || *end != '\0' || generation < 0)
+    return -1;
+  return generation;
+}
 
-int
-duplink_callback (const char *name, const struct stat *, int m, struct FTW *f)
+/* Return the highest generation of LISTS_DIR on disk, or CURRENT
+   when there is none above it.
+*/
+static int
+newest_lists_generation (const string &lists_dir, int current)
 {
-  char *new_name = g_strdup_printf ("%s/%s",
-				    duplink_new, name + duplink_base);
-
-  // fprintf (stderr, "%s -> %s\n", new_name, name);
+  DIR *d = opendir (flNotFile (lists_dir).c_str ());
+  if (d == NULL)
+    return current;
 
-  if (m == FTW_D)
+  int newest = current;
+  struct dirent *ent;
+  while ((ent = readdir (d)) != NULL)
     {
-      if (mkdir (new_name, 0777))
-	{
-	  perror (new_name);
-	  g_free (new_name);
-	  return -1;
-	}
+      long generation = lists_generation_of_name (lists_dir, ent->d_name);
+      if (generation > newest && generation < INT_MAX)
+	newest = generation;
     }
-  else if (m == FTW_F)
+
+  closedir (d);
+  return newest;
+}
+
+/* Remove all generations of LISTS_DIR except CURRENT.
+ */
+static void
+remove_old_lists_generations (const string &lists_dir, int current)
+{
+  string parent = flNotFile (lists_dir);
+
+  DIR *d = opendir (parent.c_str ());
+  if (d == NULL)
+    return;
+
+  struct dirent *ent;
+  while ((ent = readdir (d)) != NULL)
     {
-      if (link (name, new_name))
-	{
-	  perror (new_name);
-	  g_free (new_name);
-	  return -1;
-	}
+      long generation = lists_generation_of_name (lists_dir, ent->d_name);
+      if (generation < 0 || generation == current)
+	continue;
+
+      remove_lists_dir ((parent + ent->d_name).c_str ());
     }
 
-  g_free (new_name);
-  return 0;
+  closedir (d);
 }
 
-int
-duplink_file_tree (const char *old_tree, const char *new_tree)
+static string
+lists_dir_name ()
 {
-  duplink_base = strlen (old_tree);
-  duplink_new = new_tree;
-  return nftw (old_tree, duplink_callback, 10, 0);
+  string lists_dir = _config->FindDir("Dir::State::Lists");
+  if (lists_dir.length() > 0 && lists_dir[lists_dir.length()-1] == '/')
+    lists_dir.erase(lists_dir.length()-1, 1);
+  return lists_dir;
 }
 
-/* Unlink a directory hirarchy.
+/* Set when update_package_cache has left a generation behind.
  */
+static bool lists_generations_stale = false;
 
-int
-unlink_callback (const char *name, const struct stat *, int m, struct FTW *f)
+/* Remove the generations of the lists directory other than the
+   current one.  Unless ALWAYS is true, this is only done when
+   update_package_cache has left one behind.
+*/
+static void
+remove_stale_lists_generations (bool always)
 {
-  // fprintf (stderr, "- %s\n", name);
+  if (!always && !lists_generations_stale)
+    return;
 
-  if (m == FTW_DP)
-    {
-      if (rmdir (name))
-	perror (name);
-    }
-  else if (m == FTW_F)
+  string lists_dir = lists_dir_name ();
+  int generation = lists_generation (lists_dir);
+  if (generation >= 0)
+    remove_old_lists_generations (lists_dir, generation);
+  lists_generations_stale = false;
+}
+
+/* Return true when the files FILE_A and FILE_B have the same
+   contents.
+*/
+static bool
+same_file_contents (const char *file_a, const char *file_b)
+{
+  int fd_a = open (file_a, O_RDONLY);
+  int fd_b = open (file_b, O_RDONLY);
+  bool same = fd_a >= 0 && fd_b >= 0;
+
+  while (same)
     {
-      if (unlink (name))
-	perror (name);
+      char buf_a[4096], buf_b[4096];
+      ssize_t n_a = read (fd_a, buf_a, sizeof (buf_a));
+      ssize_t n_b = n_a > 0? read (fd_b, buf_b, n_a) : 0;
+
+      if (n_a < 0 || n_b != n_a)
+	same = false;
+      else if (n_a == 0)
+	break;
+      else
+	same = memcmp (buf_a, buf_b, n_a) == 0;
     }
 
-  return 0;
+  if (fd_a >= 0)
+    close (fd_a);
+  if (fd_b >= 0)
+    close (fd_b);
+  return same;
 }
 
-int
-unlink_file_tree (const char *tree)
+/* Return true when the indices in the generation directory NEW_DIR
+   are the same as the ones in OLD_DIR.  A file that libapt-pkg has
+   not downloaded again is still a hard link to the old one, and a
+   file that it has downloaded again is compared byte for byte since
+   not all servers honor If-Modified-Since.  The "lock" file and
+   "partial/" don't count.
+*/
+static bool
+same_lists_generation (const char *old_dir, const char *new_dir)
 {
-  return nftw (tree, unlink_callback, 10, FTW_DEPTH);
+  DIR *d = opendir (new_dir);
+  if (d == NULL)
+    return false;
+
+  bool same = true;
+  int n_files = 0;
+  struct dirent *ent;
+  while (same && (ent = readdir (d)) != NULL)
+    {
+      if (is_dot_or_dotdot (ent->d_name)
+	  || !strcmp (ent->d_name, "lock")
+	  || is_lists_subdir (new_dir, ent))
+	continue;
+
+      char *old_name = g_strdup_printf ("%s/%s", old_dir, ent->d_name);
+      char *new_name = g_strdup_printf ("%s/%s", new_dir, ent->d_name);
+      struct stat old_st, new_st;
+
+      if (stat (old_name, &old_st) < 0 || stat (new_name, &new_st) < 0)
+	same = false;
+      else if (old_st.st_dev == new_st.st_dev
+	       && old_st.st_ino == new_st.st_ino)
+	;
+      else
+	same = (old_st.st_size == new_st.st_size
+		&& same_file_contents (old_name, new_name));
+
+      g_free (old_name);
+      g_free (new_name);
+      n_files++;
+    }
+  closedir (d);
+
+  if (!same)
+    return false;
+
+  /* Files that have been cleaned out of the new generation.
+   */
+  d = opendir (old_dir);
+  if (d == NULL)
+    return false;
+
+  while ((ent = readdir (d)) != NULL)
+    {
+      if (is_dot_or_dotdot (ent->d_name)
+	  || !strcmp (ent->d_name, "lock")
+	  || is_lists_subdir (old_dir, ent))
+	continue;
+      n_files--;
+    }
+  closedir (d);
+
+  return n_files == 0;
 }
 
+/* Download the indices of all catalogues and rebuild the cache from
+   them.  When none of the indices has changed, which is the common
+   case for periodic checks, the new generation is dropped and the
+   cache is left alone, and *CHANGED is set to false.
+*/
 int
 update_package_cache (xexp *catalogues_for_report,
-		      bool with_status)
+		      bool with_status, bool *changed)
 {
   /* XXX - We do the downloading in a 'transaction'.  If we get
            interrupted half-way through, all the old files are kept in
@@ -4178,35 +7749,56 @@ update_package_cache (xexp *catalogues_for_report,
 
   int result = rescode_failure;
 
+  *changed = false;
+
   string lists_val = _config->Find("Dir::State::Lists");
-  string lists_dir = _config->FindDir("Dir::State::Lists");
-  if (lists_dir.length() > 0 && lists_dir[lists_dir.length()-1] == '/')
-    lists_dir.erase(lists_dir.length()-1, 1);
+  string lists_dir = lists_dir_name ();
 
-  string lists_dir_new = lists_dir + ".new";
-  string lists_dir_old = lists_dir + ".old";
+  int generation = ensure_lists_generation (lists_dir);
+  if (generation < 0)
+    return result;
 
-  unlink_file_tree (lists_dir_new.c_str());
-  duplink_file_tree (lists_dir.c_str(), lists_dir_new.c_str());
+  int new_generation = newest_lists_generation (lists_dir, generation) + 1;
+  if (new_generation <= generation)
+    {
+      log_stderr ("%s: out of generations", lists_dir.c_str ());
+      return result;
+    }
+
+  string lists_dir_cur = lists_generation_dir (lists_dir, generation);
+  string lists_dir_new = lists_generation_dir (lists_dir, new_generation);
+
+  /* Whatever happens from now on, a generation other than the
+     current one is left behind.
+  */
+  lists_generations_stale = true;
+
+  if (!link_lists_dir (lists_dir_cur.c_str(), lists_dir_new.c_str()))
+    return result;
   _config->Set ("Dir::State::Lists", lists_dir_new);
 
-  if (download_lists (catalogues_for_report, 
-		      with_status, &result))
+  bool success = download_lists (catalogues_for_report, 
+				 with_status, &result);
+  _config->Set ("Dir::State::Lists", lists_val);
+
+  if (success && same_lists_generation (lists_dir_cur.c_str(),
+					lists_dir_new.c_str()))
     {
-      /* complete transaction */
-      unlink_file_tree (lists_dir_old.c_str());
-      rename (lists_dir.c_str(), lists_dir_old.c_str());
-      rename (lists_dir_new.c_str(), lists_dir.c_str());
-      unlink_file_tree (lists_dir_old.c_str());
-      _config->Set ("Dir::State::Lists", lists_val);
+      DBG ("package lists unchanged");
+      return result;
+    }
 
-      cache_init (with_status);
+  if (success && !set_lists_generation (lists_dir, new_generation))
+    {
+      result = rescode_failure;
+      success = false;
     }
-  else
+
+  if (success)
     {
-      /* cleanup */
-      _config->Set ("Dir::State::Lists", lists_val);
-      unlink_file_tree (lists_dir_new.c_str());
+      /* complete transaction */
+      *changed = true;
+      cache_rebuild (with_status);
     }
 
   return result;
@@ -4258,10 +7850,12 @@ cmd_check_updates (bool with_status)
   /* Update sources.list file before refreshing */
   update_sources_list (catalogues);
 
-  int result_code = update_package_cache (catalogues, with_status);
+  bool changed;
+  int result_code = update_package_cache (catalogues, with_status, &changed);
 
-  if ((result_code == rescode_success)
-      || (result_code == rescode_partial_success))
+  if (changed
+      && ((result_code == rescode_success)
+	  || (result_code == rescode_partial_success)))
     {
       /* Some packages with the 'system-update' could
          appear / disappear under this conditions */
@@ -4302,6 +7896,10 @@ cmdline_check_updates (char **argv)
   request.reset (NULL, 0);
   result_code = cmd_check_updates (false);
 
+  /* Nobody is waiting for us here.
+   */
+  remove_stale_lists_generations (false);
+
   _error->DumpErrors ();
 
   if (result_code == rescode_success
@@ -4666,12 +8264,14 @@ volume_path_is_mounted_writable (const gchar *path)
   return result;
 }
 
-void
-cmd_download_package ()
+/* Download the archives of the packages that are marked for
+   install.  When downloading to the MMCs is allowed, they are tried
+   first, then the home directory, and then the default location.
+   ALT_DOWNLOAD_ROOT is set to where the archives have been put.
+*/
+static int
+download_marked_packages (const char **alt_download_root, bool with_status)
 {
-  const char *package = request.decode_string_in_place ();
-
-  const char *alt_download_root = NULL;
   int result_code = rescode_out_of_space;
 
   const char *internal_mmc_mountpoint = getenv ("INTERNAL_MMC_MOUNTPOINT");
@@ -4682,51 +8282,287 @@ cmd_download_package ()
   if (!removable_mmc_mountpoint)
     removable_mmc_mountpoint = REMOVABLE_MMC_MOUNTPOINT;
 
+  *alt_download_root = NULL;
+
+  if (flag_download_packages_to_mmc
+      && internal_mmc_mountpoint
+      && volume_path_is_mounted_writable (internal_mmc_mountpoint))
+    {
+      *alt_download_root = internal_mmc_mountpoint;
+      result_code = operation (false, *alt_download_root, true,
+			       true, with_status);
+    }
+
+  if (flag_download_packages_to_mmc
+      && result_code == rescode_out_of_space
+      && removable_mmc_mountpoint
+      && volume_path_is_mounted_writable (removable_mmc_mountpoint))
+    {
+      *alt_download_root = removable_mmc_mountpoint;
+      result_code = operation (false, *alt_download_root, true,
+			       true, with_status);
+    }
+
+  if (result_code == rescode_out_of_space
+      && volume_path_is_mounted_writable (HOME_MOUNTPOINT))
+    {
+      *alt_download_root = HOME_MOUNTPOINT;
+      result_code = operation (false, *alt_download_root, true,
+			       true, with_status);
+    }
+
+  /* default or bailout option */
+  if (!flag_download_packages_to_mmc ||
+      result_code == rescode_out_of_space)
+    {
+      *alt_download_root = NULL;
+      result_code = operation (false, *alt_download_root, true,
+			       true, with_status);
+    }
+
+  return result_code;
+}
+
+void
+cmd_download_package ()
+{
+  const char *package = request.decode_string_in_place ();
+
+  const char *alt_download_root = NULL;
+  int result_code = rescode_out_of_space;
+
   if (ensure_cache (true))
     {
       if (mark_named_package_for_install (package))
-        {
-          if (flag_download_packages_to_mmc
-	      && internal_mmc_mountpoint
-              && volume_path_is_mounted_writable (internal_mmc_mountpoint))
-            {
-              alt_download_root = internal_mmc_mountpoint;
-              result_code = operation (false, alt_download_root, true);
-            }
+        result_code = download_marked_packages (&alt_download_root, true);
+      else
+        result_code = rescode_packages_not_found;
+    }
 
-          if (flag_download_packages_to_mmc
-	      && result_code == rescode_out_of_space
-	      && removable_mmc_mountpoint
-              && volume_path_is_mounted_writable (removable_mmc_mountpoint))
-            {
-              alt_download_root = removable_mmc_mountpoint;
-              result_code = operation (false, alt_download_root, true);
-            }
+  response.encode_int (result_code);
+  response.encode_int64 (download_size);
+  response.encode_string (alt_download_root);
 
-          if (result_code == rescode_out_of_space
-              && volume_path_is_mounted_writable (HOME_MOUNTPOINT))
-            {
-              alt_download_root = HOME_MOUNTPOINT;
-              result_code = operation (false, alt_download_root, true);
-            }
+  download_size = 0;
+}
+
+/* Prefetching
+
+   When the frontend installs several packages in a row, it names the
+   next one in the INSTALL_PACKAGE request for the current one.  Right
+   before dpkg runs for the current package, we fork a child that
+   downloads the archives of the next one like DOWNLOAD_PACKAGE
+   would, so that the network is busy while dpkg is.  The child
+   reports the names of the archives as soon as it knows them.
+
+   The frontend still sends DOWNLOAD_PACKAGE for the next package as
+   usual.  That request stops the child and then finds the archives,
+   complete or partial, in place, resumes the download with progress
+   reports and reports all errors exactly as before.  A CLEAN in
+   between also stops the child, but keeps its archives.  Any other
+   request that isn't served while the child runs, and a failed or
+   cancelled installation, stops the child and forgets its archives,
+   so that the next CLEAN removes them.  The child is never waited
+   for.
+
+   The child works with the cache from before the installation, so
+   it might fetch an archive that turns out not to be needed.  When
+   it checks for free space, it adds the space that the installation
+   will use to the size of its download, so that both fit.
+
+   The child locks the archives directory that it uses, unless it is
+   the one that we have locked for the installation.
+*/
+
+static const char *prefetch_package;
+static char *prefetching_package;
+static pid_t prefetch_pid = -1;
+static int prefetch_fd = -1;
+static vector<string> prefetched_archives;
+
+/* In the child, where to report the archives and which archives
+   directory the parent has locked.
+*/
+static int prefetch_report_fd = -1;
+static char *prefetch_parent_archives;
+
+/* The space that operation () leaves free when it downloads.
+ */
+static int64_t reserved_free_space = 0;
+
+static bool
+archives_locked_by_parent ()
+{
+  return (prefetch_parent_archives
+	  && _config->FindDir ("Dir::Cache::Archives")
+	     == prefetch_parent_archives);
+}
+
+static void
+report_prefetched_archives (const vector<string> &archives)
+{
+  for (size_t i = 0; i < archives.size (); i++)
+    {
+      string line = archives[i] + "\n";
+      if (write (prefetch_report_fd, line.data (), line.size ()) < 0)
+	log_stderr ("write: %m");
+    }
+}
+
+static void
+start_prefetch (int64_t reserve)
+{
+  int fds[2];
+
+  if (prefetch_package == NULL || prefetch_pid > 0)
+    return;
+
+  if (pipe (fds) < 0)
+    {
+      log_stderr ("pipe: %m");
+      return;
+    }
+
+  pkgRecords *records = open_child_records ();
+
+  /* Don't let the child inherit unflushed output.
+   */
+  fflush (stdout);
+  fflush (stderr);
+
+  pid_t pid = fork ();
+  if (pid < 0)
+    {
+      log_stderr ("fork: %m");
+      delete records;
+      close (fds[0]);
+      close (fds[1]);
+      return;
+    }
+
+  if (pid == 0)
+    {
+      use_child_records (records);
+
+      /* Put the child and the download methods that it runs into
+	 their own process group, so that they can be stopped
+	 together.
+      */
+      setpgid (0, 0);
+
+      close (fds[0]);
+      close_query_server_stop_fd ();
+      fcntl (fds[1], F_SETFD, FD_CLOEXEC);
+      cancel_watch = apt_proto_cancel_watch ();
+      _error->Discard ();
+
+      prefetch_report_fd = fds[1];
+      prefetch_parent_archives =
+	g_strdup (_config->FindDir ("Dir::Cache::Archives").c_str ());
+
+      const char *alt_download_root;
+
+      cache_reset ();
+      if (mark_named_package_for_install (prefetch_package))
+	{
+	  reserved_free_space = reserve;
+	  download_marked_packages (&alt_download_root, false);
+	}
+
+      _error->DumpErrors ();
+      fflush (stdout);
+      fflush (stderr);
+      _exit (0);
+    }
+
+  delete records;
+  setpgid (pid, pid);
+  close (fds[1]);
+  prefetch_pid = pid;
+  prefetch_fd = fds[0];
+  prefetching_package = g_strdup (prefetch_package);
+  prefetched_archives.clear ();
+  DBG ("prefetching %s in %d", prefetch_package, pid);
+}
+
+/* Stop the child and, when KEEP is true, remember the archives that
+   it has reported.  Otherwise forget all about the prefetch.
+*/
+static void
+stop_prefetch (bool keep)
+{
+  if (prefetch_pid > 0)
+    {
+      kill (-prefetch_pid, SIGTERM);
+      while (waitpid (prefetch_pid, NULL, 0) < 0 && errno == EINTR)
+	;
+      prefetch_pid = -1;
+
+      GString *names = g_string_new ("");
+      char buf[4096];
+      ssize_t n;
+
+      while ((n = read (prefetch_fd, buf, sizeof (buf))) != 0)
+	{
+	  if (n < 0 && errno == EINTR)
+	    continue;
+	  else if (n < 0)
+	    break;
+	  g_string_append_len (names, buf, n);
+	}
+      close (prefetch_fd);
+      prefetch_fd = -1;
+
+      char **lines = g_strsplit (names->str, "\n", 0);
+      for (int i = 0; lines[i]; i++)
+	if (lines[i][0])
+	  prefetched_archives.push_back (lines[i]);
+      g_strfreev (lines);
+      g_string_free (names, TRUE);
+
+      DBG ("prefetched %d archives", (int) prefetched_archives.size ());
+    }
+
+  if (!keep)
+    {
+      prefetched_archives.clear ();
+      g_free (prefetching_package);
+      prefetching_package = NULL;
+    }
+}
+
+static bool
+is_served_during_prefetch (int cmd)
+{
+  if (apt_proto_is_query (cmd))
+    return true;
 
-          /* default or bailout option */
-          if (!flag_download_packages_to_mmc ||
-              result_code == rescode_out_of_space)
-            {
-              alt_download_root = NULL;
-              result_code = operation (false, alt_download_root, true);
-            }
-        }
-      else
-        result_code = rescode_packages_not_found;
+  switch (cmd)
+    {
+    case APTCMD_NOOP:
+    case APTCMD_INSTALL_CHECK:
+    case APTCMD_REMOVE_CHECK:
+    case APTCMD_THIRD_PARTY_POLICY_CHECK:
+    case APTCMD_SAVE_BACKUP_DATA:
+    case APTCMD_SET_ENV:
+    case APTCMD_SET_ENCODING:
+      return true;
+    default:
+      return false;
     }
+}
 
-  response.encode_int (result_code);
-  response.encode_int64 (download_size);
-  response.encode_string (alt_download_root);
+/* Called with each request before it is handled.  A DOWNLOAD_PACKAGE
+   for the prefetched package doesn't need to know what the child has
+   fetched: it uses whatever it finds in the archives directory.
+*/
+static void
+prefetch_before_request (int cmd)
+{
+  if (prefetching_package == NULL || is_served_during_prefetch (cmd))
+    return;
 
-  download_size = 0;
+  stop_prefetch (cmd == APTCMD_CLEAN);
 }
 
 /* APTCMD_INSTALL_PACKAGE
@@ -4878,6 +8714,11 @@ cmd_install_package ()
   const char *package = request.decode_string_in_place ();
   const char *alt_download_root = request.decode_string_in_place ();
 
+  /* Older frontends don't send this.
+   */
+  prefetch_package = (request.at_end ()
+		      ? NULL : request.decode_string_in_place ());
+
   int result_code = rescode_failure;
 
   if (ensure_cache (true))
@@ -4891,6 +8732,9 @@ cmd_install_package ()
              temporal docsfs */
           if (pkg_is_ssu)
             {
+              /* Leave the disk alone during system updates */
+              prefetch_package = NULL;
+
               tmpfs = choose_tmpfs_for_docs ();
               maybe_bindmount_docsfs (tmpfs);
               rootfs_set_compression_level (true);
@@ -4900,6 +8744,10 @@ cmd_install_package ()
 	  save_operation_record (package, alt_download_root);
  	  result_code = operation (false, alt_download_root, false);
 
+          /* The next package won't be installed now */
+          if (result_code != rescode_success)
+            stop_prefetch (false);
+
           /* Delete journal on succesful operations only */
           if ((result_code == rescode_success) || !pkg_is_ssu)
             erase_operation_record ();
@@ -4917,6 +8765,8 @@ cmd_install_package ()
 	result_code = rescode_packages_not_found;
     }
 
+  prefetch_package = NULL;
+
   need_cache_init ();
   response.encode_int (result_code);
 }
@@ -5150,155 +9000,556 @@ get_domain (pkgIndexFile *index)
     return DOMAIN_UNSIGNED;
 }
 
-static bool
-domain_dominates_or_is_equal (int a, int b)
+static bool
+domain_dominates_or_is_equal (int a, int b)
+{
+  return domains[a].trust_level >= domains[b].trust_level;
+}
+
+static void
+reset_new_domains ()
+{
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+
+  pkgDepCache &cache = *(awc->cache);
+  int package_count = cache.Head().PackageCount;
+
+  for (int i = 0; i < package_count; i++)
+    awc->cache->extra_info[i].new_domain = DOMAIN_UNSIGNED;
+}
+
+static void
+collect_new_domains ()
+{
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+
+  pkgDepCache &cache = *(awc->cache);
+  int package_count = cache.Head().PackageCount;
+
+  for (int i = 0; i < package_count; i++)
+    if (awc->cache->extra_info[i].related)
+      awc->cache->extra_info[i].cur_domain
+        = awc->cache->extra_info[i].new_domain;
+}
+
+static int
+index_trust_level_for_package (pkgIndexFile *index,
+			       const pkgCache::VerIterator &ver)
+{
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+  pkgDepCache &cache = *(awc->cache);
+  pkgCache::PkgIterator pkg = ver.ParentPkg();
+
+  int cur_level =
+    domains[awc->cache->extra_info[pkg->ID].cur_domain].trust_level;
+
+  int index_domain = get_domain (index);
+  int index_level = domains[index_domain].trust_level;
+
+  DBG ("trust_level: cur %d index %d (%s)",
+       cur_level, index_level, domains[index_domain].name);
+
+  /* If we have already found a good domain, accept this one only if
+     it is the same domain, or strictly better.
+   */
+  if (awc->cache->extra_info[pkg->ID].new_domain != DOMAIN_UNSIGNED)
+    {
+      int new_level =
+	domains[awc->cache->extra_info[pkg->ID].new_domain].trust_level;
+
+      if (index_domain == awc->cache->extra_info[pkg->ID].new_domain
+	  || index_level > new_level)
+	{
+	  awc->cache->extra_info[pkg->ID].new_domain = index_domain;
+	  return index_level;
+	}
+      else
+	return -1;
+    }
+
+  /* If this is a new install, accept the first domain that comes
+     along.
+   */
+  if (cache[pkg].NewInstall())
+    {
+      DBG ("new: accept index");
+      awc->cache->extra_info[pkg->ID].new_domain = index_domain;
+      return index_level;
+    }
+
+  /* This is an upgrade, only accept the current domain, or ones that
+     dominate it.
+  */
+  if (index_level >= cur_level)
+    {
+      DBG ("upgrade: accept better");
+      awc->cache->extra_info[pkg->ID].new_domain = index_domain;
+      return index_level;
+    }
+
+  /* This index is as good as any other.
+   */
+  DBG ("Hmm");
+  return cur_level;
+}
+
+static void
+encode_trust_summary ()
+{
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+  pkgDepCache &cache = *(awc->cache);
+
+  for (pkgCache::PkgIterator pkg = cache.PkgBegin();
+       pkg.end() != true;
+       pkg++)
+    {
+      domain_t cur_domain = awc->cache->extra_info[pkg->ID].cur_domain;
+      domain_t new_domain = awc->cache->extra_info[pkg->ID].new_domain;
+
+      if (cache[pkg].Upgrade() && !domains[new_domain].is_certified)
+	{
+	  DBG ("not certified: %s", pkg.Name());
+	  response.encode_int (pkgtrust_not_certified);
+	  response.encode_string (pkg.Name());
+	}
+
+      if (cache[pkg].Upgrade() && !cache[pkg].NewInstall()
+	  && !domain_dominates_or_is_equal (new_domain, cur_domain))
+	{
+	  log_stderr ("domain change: %s (%s -> %s)",
+		      pkg.Name(),
+		      domains[cur_domain].name,
+		      domains[new_domain].name);
+	  response.encode_int (pkgtrust_domains_violated);
+	  response.encode_string (pkg.Name());
+	}
+    }
+
+  response.encode_int (pkgtrust_end);
+}
+
+static void
+encode_upgrades ()
+{
+  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+  if (ensure_cache (true))
+    {
+      pkgDepCache &cache = *(awc->cache);
+
+      for (pkgCache::PkgIterator pkg = cache.PkgBegin();
+	   pkg.end() != true;
+	   pkg++)
+	{
+	  if (cache[pkg].Upgrade() && !cache[pkg].NewInstall())
+	    {
+	      response.encode_string (pkg.Name());
+	      response.encode_string (cache[pkg].CandVersion);
+	    }
+	}
+    }
+
+  response.encode_string (NULL);
+}
+
+/* Archive verification
+
+   The downloaded archives of an operation are checked against the
+   SHA256, SHA1, or MD5 sums of their packages by a few child
+   processes in parallel.  A check is started as soon as an archive
+   has been downloaded, while the fetcher continues with the next
+   ones, so most of the work is done by the time CheckDownloadedPkgs
+   wants the results.  Archives that were already in the cache are
+   checked by CheckDownloadedPkgs itself, in parallel as well.
+
+   A result is only used when the archive still has the inode, size
+   and mtime that it had when its check was started; otherwise it is
+   checked again.
+
+   We use child processes instead of threads, like for the
+   background rebuilds of the cache.  Each child reports its result
+   with its exit status, 0 when the archive is good and 1 when it is
+   bad.  A child that dies in any other way leaves its archive
+   unchecked, and CheckDownloadedPkgs checks it again itself.
+
+   Archives that have passed are remembered in a ledger in the
+   archives directory, with their identity and the sum that they
+   have passed against, so that a retry of an operation doesn't
+   check them again.  An entry only counts while the file still has
+   the same identity.
+*/
+
+#define ARCHIVE_CHECK_MAX_JOBS 4
+
+enum archive_check_state {
+  archive_unchecked,
+  archive_checking,
+  archive_good,
+  archive_bad
+};
+
+struct archive_check {
+  string file;
+  string kind;         // "SHA256", "SHA1", "MD5sum", or empty
+  string expected;
+  int state;
+  pid_t pid;
+  struct stat st;
+};
+
+static vector<archive_check> archive_checks;
+static int archive_checks_running;
+
+static int
+archive_check_jobs ()
+{
+  long n = sysconf (_SC_NPROCESSORS_ONLN);
+  if (n < 1)
+    return 1;
+  return n < ARCHIVE_CHECK_MAX_JOBS? n : ARCHIVE_CHECK_MAX_JOBS;
+}
+
+static bool
+archive_sum_matches (archive_check &c)
+{
+  int fd = open (c.file.c_str (), O_RDONLY);
+  struct stat st;
+
+  if (fd < 0 || fstat (fd, &st) < 0)
+    {
+      if (fd >= 0)
+	close (fd);
+      return false;
+    }
+
+  string sum;
+  if (c.kind == "SHA256")
+    {
+      SHA256Summation SHA256;
+      SHA256.AddFD (fd, st.st_size);
+      sum = string (SHA256.Result ());
+    }
+  else if (c.kind == "SHA1")
+    {
+      SHA1Summation SHA1;
+      SHA1.AddFD (fd, st.st_size);
+      sum = string (SHA1.Result ());
+    }
+  else
+    {
+      MD5Summation MD5;
+      MD5.AddFD (fd, st.st_size);
+      sum = (string)MD5.Result ();
+    }
+
+  close (fd);
+  return sum == c.expected;
+}
+
+static bool
+same_archive_identity (const struct stat *a, const struct stat *b)
+{
+  return (a->st_dev == b->st_dev
+	  && a->st_ino == b->st_ino
+	  && a->st_size == b->st_size
+	  && a->st_mtim.tv_sec == b->st_mtim.tv_sec
+	  && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec);
+}
+
+static bool
+archive_unchanged (archive_check &c)
+{
+  struct stat st;
+
+  return (stat (c.file.c_str (), &st) == 0
+	  && same_archive_identity (&st, &c.st));
+}
+
+static void
+record_archive_check_status (archive_check &c, int status)
+{
+  if (WIFEXITED (status) && WEXITSTATUS (status) == 0)
+    c.state = archive_good;
+  else if (WIFEXITED (status) && WEXITSTATUS (status) == 1)
+    c.state = archive_bad;
+  else
+    c.state = archive_unchecked;
+  archive_checks_running--;
+}
+
+/* Wait for one child to finish and record its result.  We only wait
+   for the pids of our own children, since the query server and the
+   prefetch might be running as well.
+*/
+static void
+wait_for_archive_check ()
+{
+  int first = -1;
+  int status;
+  pid_t pid;
+
+  for (size_t i = 0; i < archive_checks.size (); i++)
+    {
+      archive_check &c = archive_checks[i];
+      if (c.state != archive_checking)
+	continue;
+
+      while ((pid = waitpid (c.pid, &status, WNOHANG)) < 0
+	     && errno == EINTR)
+	;
+      if (pid == c.pid)
+	{
+	  record_archive_check_status (c, status);
+	  return;
+	}
+      else if (pid < 0)
+	{
+	  log_stderr ("waitpid: %m");
+	  c.state = archive_unchecked;
+	  archive_checks_running--;
+	  return;
+	}
+
+      if (first < 0)
+	first = i;
+    }
+
+  if (first < 0)
+    {
+      archive_checks_running = 0;
+      return;
+    }
+
+  archive_check &c = archive_checks[first];
+  while ((pid = waitpid (c.pid, &status, 0)) < 0 && errno == EINTR)
+    ;
+  if (pid == c.pid)
+    record_archive_check_status (c, status);
+  else
+    {
+      log_stderr ("waitpid: %m");
+      c.state = archive_unchecked;
+      archive_checks_running--;
+    }
+}
+
+static void
+wait_for_archive_checks ()
 {
-  return domains[a].trust_level >= domains[b].trust_level;
+  while (archive_checks_running > 0)
+    wait_for_archive_check ();
 }
 
 static void
-reset_new_domains ()
+clear_archive_checks ()
 {
-  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
-
-  pkgDepCache &cache = *(awc->cache);
-  int package_count = cache.Head().PackageCount;
-
-  for (int i = 0; i < package_count; i++)
-    awc->cache->extra_info[i].new_domain = DOMAIN_UNSIGNED;
+  wait_for_archive_checks ();
+  archive_checks.clear ();
 }
 
+/* Start checking the archive at INDEX.  When there is no child for
+   it, it is checked right here.
+*/
 static void
-collect_new_domains ()
+start_archive_check (int index)
 {
-  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
+  archive_check &c = archive_checks[index];
 
-  pkgDepCache &cache = *(awc->cache);
-  int package_count = cache.Head().PackageCount;
+  if (stat (c.file.c_str (), &c.st) < 0)
+    {
+      c.state = archive_unchecked;
+      return;
+    }
 
-  for (int i = 0; i < package_count; i++)
-    if (awc->cache->extra_info[i].related)
-      awc->cache->extra_info[i].cur_domain
-        = awc->cache->extra_info[i].new_domain;
+  while (archive_checks_running >= archive_check_jobs ())
+    wait_for_archive_check ();
+
+  fflush (stdout);
+  fflush (stderr);
+  pid_t pid = fork ();
+  if (pid < 0)
+    log_stderr ("fork: %m");
+
+  if (pid == 0)
+    {
+      close_query_server_stop_fd ();
+      _exit (archive_sum_matches (c)? 0 : 1);
+    }
+  else if (pid > 0)
+    {
+      c.state = archive_checking;
+      c.pid = pid;
+      archive_checks_running++;
+    }
+  else
+    c.state = archive_sum_matches (c)? archive_good : archive_bad;
 }
 
 static int
-index_trust_level_for_package (pkgIndexFile *index,
-			       const pkgCache::VerIterator &ver)
+find_archive_check (const string &file)
 {
-  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
-  pkgDepCache &cache = *(awc->cache);
-  pkgCache::PkgIterator pkg = ver.ParentPkg();
+  for (size_t i = 0; i < archive_checks.size (); i++)
+    if (archive_checks[i].file == file)
+      return i;
+  return -1;
+}
 
-  int cur_level =
-    domains[awc->cache->extra_info[pkg->ID].cur_domain].trust_level;
+/* Called by DownloadStatus when FILE has been downloaded.
+ */
+static void
+archive_downloaded (const string &file)
+{
+  int index = find_archive_check (file);
+  if (index >= 0 && archive_checks[index].state == archive_unchecked
+      && !archive_checks[index].kind.empty ())
+    start_archive_check (index);
+}
 
-  int index_domain = get_domain (index);
-  int index_level = domains[index_domain].trust_level;
+/* The ledger has one line per archive:
 
-  DBG ("trust_level: cur %d index %d (%s)",
-       cur_level, index_level, domains[index_domain].name);
+     <dev> <ino> <size> <mtime-sec>.<mtime-nsec> <kind> <sum> <name>
 
-  /* If we have already found a good domain, accept this one only if
-     it is the same domain, or strictly better.
-   */
-  if (awc->cache->extra_info[pkg->ID].new_domain != DOMAIN_UNSIGNED)
-    {
-      int new_level =
-	domains[awc->cache->extra_info[pkg->ID].new_domain].trust_level;
+   where NAME is relative to the archives directory.
+*/
 
-      if (index_domain == awc->cache->extra_info[pkg->ID].new_domain
-	  || index_level > new_level)
-	{
-	  awc->cache->extra_info[pkg->ID].new_domain = index_domain;
-	  return index_level;
-	}
-      else
-	return -1;
-    }
+#define ARCHIVE_LEDGER "verified"
 
-  /* If this is a new install, accept the first domain that comes
-     along.
-   */
-  if (cache[pkg].NewInstall())
-    {
-      DBG ("new: accept index");
-      awc->cache->extra_info[pkg->ID].new_domain = index_domain;
-      return index_level;
-    }
+struct archive_ledger_entry {
+  struct stat st;
+  char kind[16];
+  char sum[129];
+  char name[256];
+};
 
-  /* This is an upgrade, only accept the current domain, or ones that
-     dominate it.
-  */
-  if (index_level >= cur_level)
-    {
-      DBG ("upgrade: accept better");
-      awc->cache->extra_info[pkg->ID].new_domain = index_domain;
-      return index_level;
-    }
+static string
+archive_ledger_file ()
+{
+  return _config->FindDir ("Dir::Cache::Archives") + ARCHIVE_LEDGER;
+}
 
-  /* This index is as good as any other.
-   */
-  DBG ("Hmm");
-  return cur_level;
+static bool
+parse_archive_ledger_entry (const char *line, archive_ledger_entry *e)
+{
+  unsigned long dev, ino;
+  long long size;
+  long sec, nsec;
+
+  if (sscanf (line, "%lu %lu %lld %ld.%ld %15s %128s %255s",
+	      &dev, &ino, &size, &sec, &nsec,
+	      e->kind, e->sum, e->name) != 8)
+    return false;
+
+  memset (&e->st, 0, sizeof (e->st));
+  e->st.st_dev = dev;
+  e->st.st_ino = ino;
+  e->st.st_size = size;
+  e->st.st_mtim.tv_sec = sec;
+  e->st.st_mtim.tv_nsec = nsec;
+  return true;
 }
 
 static void
-encode_trust_summary ()
+write_archive_ledger_entry (FILE *f, const struct stat *st,
+			    const char *kind, const char *sum,
+			    const char *name)
 {
-  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
-  pkgDepCache &cache = *(awc->cache);
+  fprintf (f, "%lu %lu %lld %ld.%09ld %s %s %s\n",
+	   (unsigned long) st->st_dev,
+	   (unsigned long) st->st_ino,
+	   (long long) st->st_size,
+	   (long) st->st_mtim.tv_sec,
+	   (long) st->st_mtim.tv_nsec,
+	   kind, sum, name);
+}
 
-  for (pkgCache::PkgIterator pkg = cache.PkgBegin();
-       pkg.end() != true;
-       pkg++)
+/* Mark the archives that have passed before as good.
+ */
+static void
+load_archive_ledger ()
+{
+  string dir = _config->FindDir ("Dir::Cache::Archives");
+  FILE *f = fopen (archive_ledger_file ().c_str (), "r");
+  if (f == NULL)
+    return;
+
+  char line[1024];
+  archive_ledger_entry e;
+  while (fgets (line, sizeof (line), f))
     {
-      domain_t cur_domain = awc->cache->extra_info[pkg->ID].cur_domain;
-      domain_t new_domain = awc->cache->extra_info[pkg->ID].new_domain;
+      if (!parse_archive_ledger_entry (line, &e))
+	continue;
 
-      if (cache[pkg].Upgrade() && !domains[new_domain].is_certified)
-	{
-	  DBG ("not certified: %s", pkg.Name());
-	  response.encode_int (pkgtrust_not_certified);
-	  response.encode_string (pkg.Name());
-	}
+      int index = find_archive_check (dir + e.name);
+      if (index < 0)
+	continue;
 
-      if (cache[pkg].Upgrade() && !cache[pkg].NewInstall()
-	  && !domain_dominates_or_is_equal (new_domain, cur_domain))
+      archive_check &c = archive_checks[index];
+      struct stat st;
+      if (c.state == archive_unchecked
+	  && c.kind == e.kind
+	  && c.expected == e.sum
+	  && stat (c.file.c_str (), &st) == 0
+	  && same_archive_identity (&st, &e.st))
 	{
-	  log_stderr ("domain change: %s (%s -> %s)",
-		      pkg.Name(),
-		      domains[cur_domain].name,
-		      domains[new_domain].name);
-	  response.encode_int (pkgtrust_domains_violated);
-	  response.encode_string (pkg.Name());
+	  c.st = st;
+	  c.state = archive_good;
 	}
     }
 
-  response.encode_int (pkgtrust_end);
+  fclose (f);
 }
 
+/* Write the archives that have passed into the ledger, together with
+   the old entries that are still valid.
+*/
 static void
-encode_upgrades ()
+save_archive_ledger ()
 {
-  AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
-  if (ensure_cache (true))
+  string dir = _config->FindDir ("Dir::Cache::Archives");
+  string ledger = archive_ledger_file ();
+  string tmp = ledger + ".new";
+
+  FILE *f = fopen (tmp.c_str (), "w");
+  if (f == NULL)
     {
-      pkgDepCache &cache = *(awc->cache);
+      log_stderr ("%s: %m", tmp.c_str ());
+      return;
+    }
 
-      for (pkgCache::PkgIterator pkg = cache.PkgBegin();
-	   pkg.end() != true;
-	   pkg++)
+  FILE *old = fopen (ledger.c_str (), "r");
+  if (old)
+    {
+      char line[1024];
+      archive_ledger_entry e;
+      while (fgets (line, sizeof (line), old))
 	{
-	  if (cache[pkg].Upgrade() && !cache[pkg].NewInstall())
-	    {
-	      response.encode_string (pkg.Name());
-	      response.encode_string (cache[pkg].CandVersion);
-	    }
+	  if (!parse_archive_ledger_entry (line, &e))
+	    continue;
+
+	  string file = dir + e.name;
+	  struct stat st;
+	  if (find_archive_check (file) < 0
+	      && stat (file.c_str (), &st) == 0
+	      && same_archive_identity (&st, &e.st))
+	    write_archive_ledger_entry (f, &e.st, e.kind, e.sum, e.name);
 	}
+      fclose (old);
     }
 
-  response.encode_string (NULL);
+  for (size_t i = 0; i < archive_checks.size (); i++)
+    {
+      archive_check &c = archive_checks[i];
+      if (c.state == archive_good
+	  && c.file.compare (0, dir.length (), dir) == 0)
+	write_archive_ledger_entry (f, &c.st, c.kind.c_str (),
+				    c.expected.c_str (),
+				    c.file.c_str () + dir.length ());
+    }
+
+  if (fclose (f) != 0 || rename (tmp.c_str (), ledger.c_str ()) < 0)
+    {
+      log_stderr ("%s: %m", ledger.c_str ());
+      unlink (tmp.c_str ());
+    }
 }
 
 /* We modify the pkgDPkgPM package manager so that we can provide our
@@ -5317,6 +9568,8 @@ class myDPkgPM : public pkgDPkgPM
 {
 public:
 
+  void PrepareArchiveChecks ();
+  void ListArchives (vector<string> &files);
   bool CheckDownloadedPkgs (bool clear_corrupted);
 
   bool CreateOrderList ();
@@ -5367,83 +9620,118 @@ myDPkgPM::CreateOrderList ()
   return true;
 }
 
-bool
-myDPkgPM::CheckDownloadedPkgs (bool clean_corrupted)
+/* Set up the archive checks for the packages in the order list that
+   don't have one yet, so that the checks can start while the
+   archives are being downloaded.
+*/
+void
+myDPkgPM::PrepareArchiveChecks ()
 {
-  bool result = true;
   package_record rec;
 
   for (pkgOrderList::iterator I = pkgPackageManager::List->begin(); 
        I != pkgPackageManager::List->end(); I++)
     {
-      bool partial_result = true;
       PkgIterator Pkg(Cache,*I);
       pkgCache::VerIterator cand_ver = Cache[Pkg].CandidateVerIter(Cache);
 
+      string File = FileNames[Pkg->ID];
+      if (File.empty() || find_archive_check (File) >= 0)
+        continue;
+
+      archive_check c;
+      c.file = File;
+      c.state = archive_unchecked;
+      c.pid = -1;
+
       rec.lookup(cand_ver);
+      if (!(c.expected = rec.get_string("SHA256")).empty())
+        c.kind = "SHA256";
+      else if (!(c.expected = rec.get_string("SHA1")).empty())
+        c.kind = "SHA1";
+      else if (!(c.expected = rec.get_string("MD5sum")).empty())
+        c.kind = "MD5sum";
+
+      archive_checks.push_back (c);
+    }
+
+  load_archive_ledger ();
+}
+
+bool
+myDPkgPM::CheckDownloadedPkgs (bool clean_corrupted)
+{
+  bool result = true;
+  vector<int> checked;
+
+  PrepareArchiveChecks ();
+
+  for (pkgOrderList::iterator I = pkgPackageManager::List->begin(); 
+       I != pkgPackageManager::List->end(); I++)
+    {
+      PkgIterator Pkg(Cache,*I);
+
       string File = FileNames[Pkg->ID];
       if (File.empty())
         continue;
       FileFd Fd (File, FileFd::ReadOnly);
       if (_error->PendingError() == true) // return false?
         continue;
+      Fd.Close();
 
-      string ExpectedSHA256 = rec.get_string("SHA256");
-
-      if (!ExpectedSHA256.empty())
-        {
-          SHA256Summation SHA256;
-          SHA256.AddFD(Fd.Fd(), Fd.Size());
-          string file_sha256 = string(SHA256.Result());
+      int index = find_archive_check (File);
+      archive_check &c = archive_checks[index];
+      if (c.kind.empty ())
+        continue;
 
-          if (file_sha256 != ExpectedSHA256)
-            {
-              log_stderr ("File %s is corrupted (SHA256).", File.c_str());
-              partial_result = false;
-            }
-        }
-      else
-        {
-          string ExpectedSHA1 = rec.get_string("SHA1");
+      if (c.state == archive_unchecked)
+        start_archive_check (index);
+      checked.push_back (index);
+    }
 
-          if (!ExpectedSHA1.empty())
-            {
-              SHA1Summation SHA1;
-              SHA1.AddFD(Fd.Fd(), Fd.Size());
-              string file_sha1 = string(SHA1.Result());
+  /* Archives that have changed while they were checked are checked
+     again.
+  */
+  wait_for_archive_checks ();
+  for (size_t i = 0; i < checked.size (); i++)
+    if (!archive_unchanged (archive_checks[checked[i]]))
+      start_archive_check (checked[i]);
+  wait_for_archive_checks ();
 
-              if (file_sha1 != ExpectedSHA1)
-                {
-                  log_stderr ("File %s is corrupted (SHA1).", File.c_str());
-                  partial_result = false;
-                }
-            }
-          else
-            {
-              string ExpectedMD5 = rec.get_string("MD5sum");
+  for (size_t i = 0; i < checked.size (); i++)
+    {
+      archive_check &c = archive_checks[checked[i]];
 
-              if (!ExpectedMD5.empty())
-                {
-                  MD5Summation sum;
-                  sum.AddFD (Fd.Fd(), Fd.Size());
-                  string MD5 = (string)sum.Result();
+      if (c.state == archive_unchecked)
+        c.state = archive_sum_matches (c)? archive_good : archive_bad;
 
-                  if (MD5 != ExpectedMD5)
-                    {
-                      log_stderr ("File %s is corrupted (MD5sum).", File.c_str());
-                      partial_result = false;
-                    }
-                }
-            }
+      if (c.state == archive_bad)
+        {
+          log_stderr ("File %s is corrupted (%s).",
+                      c.file.c_str(), c.kind.c_str());
+          result = false;
+          if (clean_corrupted)
+            unlink (c.file.c_str());
         }
-      Fd.Close();
-      result = result && partial_result;
-      if (clean_corrupted && !partial_result)
-        unlink (File.c_str());
     }
+
+  save_archive_ledger ();
+  clear_archive_checks ();
   return result;
 }
 
+void
+myDPkgPM::ListArchives (vector<string> &files)
+{
+  for (pkgOrderList::iterator I = pkgPackageManager::List->begin(); 
+       I != pkgPackageManager::List->end(); I++)
+    {
+      PkgIterator Pkg(Cache,*I);
+      if (!FileNames[Pkg->ID].empty())
+        files.push_back (FileNames[Pkg->ID]);
+    }
+}
+
 myDPkgPM::myDPkgPM (pkgDepCache *Cache)
   : pkgDPkgPM (Cache)
 {
@@ -5518,7 +9806,6 @@ get_pkg_required_free_space ()
 {
   AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
   pkgDepCache &cache = *(awc->cache);
-  package_record rec;
   int64_t retval = 0;
 
   for (pkgCache::PkgIterator pkg = cache.PkgBegin (); pkg.end () != true; pkg++)
@@ -5529,8 +9816,7 @@ get_pkg_required_free_space ()
         {
           pkgCache::VerIterator ver = cache[pkg].CandidateVerIter (cache);
 
-          rec.lookup(ver);
-          retval += get_required_free_space (rec);
+          retval += get_required_free_space (ver);
         }
     }
 
@@ -5634,7 +9920,8 @@ operation (bool check_only,
 
   // Lock the archive directory
   FileFd Lock;
-  if (_config->FindB("Debug::NoLocking",false) == false)
+  if (_config->FindB("Debug::NoLocking",false) == false
+      && !archives_locked_by_parent ())
     {
       Lock.Fd(ForceLock(_config->FindDir("Dir::Cache::Archives") + "lock"));
       if (_error->PendingError() == true)
@@ -5675,6 +9962,19 @@ operation (bool check_only,
       _error->PendingError() == true)
     return rescode_failure;
 
+  if (prefetch_report_fd >= 0)
+    {
+      vector<string> archives;
+      Pm->ListArchives (archives);
+      report_prefetched_archives (archives);
+    }
+
+  // Verify the archives while they are being downloaded
+  //
+  clear_archive_checks ();
+  if (!download_only)
+    Pm->PrepareArchiveChecks ();
+
   double FetchBytes = Fetcher.FetchNeeded();
   double FetchPBytes = Fetcher.PartialPresent();
 
@@ -5710,7 +10010,8 @@ operation (bool check_only,
 
       download_size = FetchBytes - FetchPBytes;
       if (!is_there_enough_free_space
-          (_config->FindDir ("Dir::Cache::Archives").c_str (), download_size))
+          (_config->FindDir ("Dir::Cache::Archives").c_str (),
+	   download_size + reserved_free_space))
             return rescode_out_of_space;
       
       /* Send a status report now if we are going to download
@@ -5781,6 +10082,9 @@ operation (bool check_only,
       if (Pm->CheckDownloadedPkgs (true) == false)
         return rescode_package_corrupted;
 
+      // Download the next package while dpkg installs this one
+      start_prefetch ((int64_t) MAX (Cache->UsrSize (), 0));
+
       // sync before installing
       sync ();
 
@@ -5805,6 +10109,39 @@ operation (bool check_only,
 /* APTCMD_CLEAN
  */
 
+/* Like pkgAcquire::Clean, but keep the archives of the last
+   prefetch, and their partial downloads.
+*/
+static void
+clean_archives_except_prefetched (string dir)
+{
+  DIR *d = opendir (dir.c_str ());
+  if (d == NULL)
+    {
+      _error->Errno ("opendir", "Unable to read %s", dir.c_str ());
+      return;
+    }
+
+  struct dirent *ent;
+  while ((ent = readdir (d)) != NULL)
+    {
+      if (!strcmp (ent->d_name, "lock")
+	  || !strcmp (ent->d_name, "partial")
+	  || !strcmp (ent->d_name, ".")
+	  || !strcmp (ent->d_name, ".."))
+	continue;
+
+      bool keep = false;
+      for (size_t i = 0; !keep && i < prefetched_archives.size (); i++)
+	keep = flNotDir (prefetched_archives[i]) == ent->d_name;
+
+      if (!keep)
+	unlink ((dir + ent->d_name).c_str ());
+    }
+
+  closedir (d);
+}
+
 void
 cmd_clean ()
 {
@@ -5840,8 +10177,21 @@ cmd_clean ()
   if (success)
     {
       pkgAcquire Fetcher;
-      Fetcher.Clean(_config->FindDir("Dir::Cache::archives"));
-      Fetcher.Clean(_config->FindDir("Dir::Cache::archives") + "partial/");
+      string dir = _config->FindDir("Dir::Cache::archives");
+      if (prefetched_archives.empty ())
+	{
+	  Fetcher.Clean(dir);
+	  Fetcher.Clean(dir + "partial/");
+	}
+      else
+	{
+	  clean_archives_except_prefetched (dir);
+	  clean_archives_except_prefetched (dir + "partial/");
+	}
+
+      // Old generations of the package lists, see
+      // update_package_cache.
+      remove_stale_lists_generations (true);
 
       // Make sure the filesystem is aware of the space freed
       sync();
@@ -6418,11 +10768,22 @@ write_available_updates_file ()
     return;
 
   xexp *x_updates = xexp_list_new ("updates");
-  package_record rec;
   AptWorkerCache *awc = AptWorkerCache::GetCurrent ();
   pkgDepCache &cache = *(awc->cache);
 
-  for (pkgCache::PkgIterator pkg = cache.PkgBegin(); !pkg.end (); pkg++)
+  ensure_package_sets ();
+
+  guint32 **sets = package_sets.sets;
+  unsigned n = package_sets.n_packages;
+  guint32 *shown = g_new (guint32, package_sets.n_words);
+  for (unsigned w = 0; w < package_sets.n_words; w++)
+    shown[w] = (sets[pset_upgradeable][w]
+		& sets[pset_candidate_user][w]
+		& ~sets[pset_broken][w]);
+
+  for (unsigned i = pset_next (shown, n, 0);
+       i < n;
+       i = pset_next (shown, n, i + 1))
     {
       /* This duplicates the logic that determines which packages
 	 would be shown in the "Check for Updates" view in blue-pill
@@ -6443,41 +10804,29 @@ write_available_updates_file ()
 	       course.
       */
 
-      pkgCache::VerIterator installed = pkg.CurrentVer ();
+      pkgCache::PkgIterator pkg (cache.GetCache (), package_sets.packages[i]);
       pkgCache::VerIterator candidate = cache[pkg].CandidateVerIter(cache);
-      bool broken = (cache[pkg].NowBroken()
-		     || (pkg.State () != pkgCache::PkgIterator::NeedsNothing));
-
-      if (!candidate.end ()
-	  && !installed.end()
-	  && installed.CompareVer (candidate) < 0
-	  && is_user_package (candidate)
-          && !broken)
-	{
-	  xexp *x_pkg = NULL;
+      xexp *x_pkg = NULL;
 
-	  rec.lookup(candidate);
-	  int flags = get_flags (rec);
-	  int domain_index = awc->cache->extra_info[pkg->ID].cur_domain;
+      int flags = get_flags (candidate);
+      int domain_index = awc->cache->extra_info[pkg->ID].cur_domain;
 
-          const char *pkg_name;
-          string pretty_name = get_pretty_name (rec);
-          if (!pretty_name.empty ())
-            pkg_name = pretty_name.c_str ();
-          else
-            pkg_name = pkg.Name ();
+      const char *pkg_name = get_pretty_name (candidate);
+      if (*pkg_name == '\0')
+	pkg_name = pkg.Name ();
 
-	  if (flags & pkgflag_system_update)
-	    x_pkg = xexp_text_new ("os", pkg_name);
-	  else if (domains[domain_index].is_certified)
-	    x_pkg = xexp_text_new ("certified", pkg_name);
-	  else
-	    x_pkg = xexp_text_new ("other", pkg_name);
+      if (flags & pkgflag_system_update)
+	x_pkg = xexp_text_new ("os", pkg_name);
+      else if (domains[domain_index].is_certified)
+	x_pkg = xexp_text_new ("certified", pkg_name);
+      else
+	x_pkg = xexp_text_new ("other", pkg_name);
 
-	  xexp_cons (x_updates, x_pkg);
-	}
+      xexp_cons (x_updates, x_pkg);
     }
 
+  g_free (shown);
+
   xexp_write_file (AVAILABLE_UPDATES_FILE, x_updates);
 
   if (x_updates)
@@ -6789,6 +11138,7 @@ fork_progress_process ()
   if (child_pid == 0)
     {
       close (fds[1]);
+      close_query_server_stop_fd ();
       FILE *f = fdopen (fds[0], "r");
       if (f)
 	{
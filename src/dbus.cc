@@ -454,6 +454,97 @@ dsp_with_initialized_packages (void *data)
   g_free (pattern);
 }
 
+struct dgws_clos {
+  DBusConnection *conn;
+  DBusMessage *message;
+};
+
+static void dgws_reply (int cmd, apt_proto_decoder *dec, void *data);
+
+static void
+dbus_get_worker_stats (DBusConnection *conn, DBusMessage *message)
+{
+  dgws_clos *c = new dgws_clos;
+
+  dbus_connection_ref (conn);
+  dbus_message_ref (message);
+
+  c->conn = conn;
+  c->message = message;
+
+  apt_worker_get_stats (dgws_reply, c);
+}
+
+static void
+append_stats_line (GString *text, const char *name, xexp *x)
+{
+  const char *request_bytes = xexp_aref_text (x, "request-bytes");
+  const char *response_bytes = xexp_aref_text (x, "response-bytes");
+
+  g_string_append_printf (text, "%-27s %6d %10s %10s %10s %12s %9s %10s\n",
+			  name,
+			  xexp_aref_int (x, "count", 0),
+			  xexp_aref_text (x, "p50-usecs"),
+			  xexp_aref_text (x, "p99-usecs"),
+			  xexp_aref_text (x, "max-usecs"),
+			  xexp_aref_text (x, "total-usecs"),
+			  request_bytes ? request_bytes : "-",
+			  response_bytes ? response_bytes : "-");
+}
+
+static void
+dgws_reply (int cmd, apt_proto_decoder *dec, void *data)
+{
+  dgws_clos *c = (dgws_clos *)data;
+  DBusMessage *reply;
+  xexp *stats = dec ? dec->decode_xexp () : NULL;
+
+  if (stats && xexp_is_list (stats))
+    {
+      GString *text = g_string_new ("");
+
+      g_string_append_printf (text, "%-27s %6s %10s %10s %10s %12s %9s %10s\n",
+			      "command", "count", "p50-usecs", "p99-usecs",
+			      "max-usecs", "total-usecs", "req-bytes",
+			      "resp-bytes");
+
+      for (xexp *x = xexp_first (stats); x; x = xexp_rest (x))
+	{
+	  if (xexp_is (x, "command"))
+	    append_stats_line (text, xexp_aref_text (x, "name"), x);
+	  else if (xexp_is (x, "cache-init"))
+	    append_stats_line (text, "(cache-init)", x);
+	  else if (xexp_is (x, "cache-refresh"))
+	    append_stats_line (text, "(cache-refresh)", x);
+	}
+
+      reply = dbus_message_new_method_return (c->message);
+      dbus_message_append_args (reply,
+				DBUS_TYPE_STRING, &text->str,
+				DBUS_TYPE_INVALID);
+      g_string_free (text, TRUE);
+    }
+  else
+    reply = dbus_message_new_error (c->message,
+				    DBUS_ERROR_FAILED,
+				    "apt-worker not available");
+
+  if (stats)
+    xexp_free (stats);
+
+  dbus_connection_send (c->conn, reply, NULL);
+  dbus_message_unref (reply);
+
+  // So that we don't lose the reply when we exit below.
+  dbus_connection_flush (c->conn);
+
+  dbus_message_unref (c->message);
+  dbus_connection_unref (c->conn);
+  delete c;
+
+  maybe_exit ();
+}
+
 static DBusHandlerResult
 dbus_handler (DBusConnection *conn, DBusMessage *message, void *data)
 {
@@ -529,6 +620,14 @@ dbus_handler (DBusConnection *conn, DBusMessage *message, void *data)
       return DBUS_HANDLER_RESULT_HANDLED;
     }
 
+  if (dbus_message_is_method_call (message,
+                                   "com.nokia.hildon_application_manager",
+                                   "get_worker_stats"))
+    {
+      dbus_get_worker_stats (conn, message);
+      return DBUS_HANDLER_RESULT_HANDLED;
+    }
+
   return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 }
 
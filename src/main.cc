@@ -882,8 +882,351 @@ sort_all_packages (bool refresh_view)
 struct gpl_closure {
   void (*cont) (void *data);
   void *data;
+  section_info *all_si;
+  bool updating_hidden;
+  bool partial_shown;
 };
 
+/* ICONS
+
+   Package lists only contain the hashes of the icons.  The icons
+   themselves are kept in ICON_CACHE while we run, and in the
+   UFILE_ICON_CACHE directory, one file per hash, between runs.
+   Icons that we don't have yet are collected in ICONS_WANTED,
+   together with the packages that are waiting for them, and then
+   requested from apt-worker with a single GET_ICONS.
+*/
+
+#define ICON_INSTALLED 1
+#define ICON_AVAILABLE 2
+
+struct icon_waiter {
+  package_info *pi;
+  int which;
+};
+
+static GHashTable *icon_cache = NULL;     // hash -> GdkPixbuf or NULL
+static GHashTable *icons_wanted = NULL;   // hash -> GSList of icon_waiter
+static GHashTable *icons_requested = NULL; // the same, for the icons that
+                                           // GET_ICONS has been sent for
+
+/* The icons in the cache on disk, one file per icon hash, may take
+   up this many bytes.  When they take more, the ones that have been
+   used least recently are removed until a quarter of the room is free
+   again.  This is checked only once per session, before the first
+   icon is written, since it needs to look at every file.
+*/
+#define MAX_ICON_CACHE_SIZE (4 * 1024 * 1024)
+
+static void
+unref_icon (gpointer data)
+{
+  if (data)
+    g_object_unref (data);
+}
+
+static bool
+valid_icon_hash (const char *hash)
+{
+  size_t len = strlen (hash);
+  return len > 0 && len <= 64 && strspn (hash, "0123456789abcdef") == len;
+}
+
+static char *
+icon_cache_dir ()
+{
+  char *state_dir = user_file_get_state_dir_path ();
+  if (state_dir == NULL)
+    return NULL;
+
+  char *dir = g_strdup_printf ("%s/%s", state_dir, UFILE_ICON_CACHE);
+  g_free (state_dir);
+  return dir;
+}
+
+static char *
+icon_cache_file (const char *hash, bool create_dir)
+{
+  char *dir = icon_cache_dir ();
+  if (dir == NULL)
+    return NULL;
+
+  if (create_dir && g_mkdir (dir, 0777) && errno != EEXIST)
+    {
+      g_free (dir);
+      return NULL;
+    }
+
+  char *file = g_strdup_printf ("%s/%s", dir, hash);
+  g_free (dir);
+  return file;
+}
+
+static char *
+read_cached_icon (const char *hash)
+{
+  char *file = icon_cache_file (hash, false);
+  char *base64 = NULL;
+
+  /* The modification time tells when the icon was last used.
+   */
+  if (file && g_file_get_contents (file, &base64, NULL, NULL))
+    g_utime (file, NULL);
+  g_free (file);
+  return base64;
+}
+
+struct cached_icon_file {
+  time_t used;
+  off_t size;
+  char *name;
+};
+
+static gint
+compare_cached_icon_files (gconstpointer a, gconstpointer b)
+{
+  time_t used_a = ((const cached_icon_file *) a)->used;
+  time_t used_b = ((const cached_icon_file *) b)->used;
+  return (used_a < used_b)? -1 : (used_a > used_b)? 1 : 0;
+}
+
+/* Remove the least recently used icons from the cache on disk when
+   it has grown too large.
+*/
+static void
+trim_icon_cache_files ()
+{
+  char *dir = icon_cache_dir ();
+  if (dir == NULL)
+    return;
+
+  GDir *d = g_dir_open (dir, 0, NULL);
+  if (d == NULL)
+    {
+      g_free (dir);
+      return;
+    }
+
+  GArray *files = g_array_new (FALSE, FALSE, sizeof (cached_icon_file));
+  int64_t total_size = 0;
+  const char *name;
+  while ((name = g_dir_read_name (d)))
+    {
+      char *file = g_strdup_printf ("%s/%s", dir, name);
+      struct stat buf;
+      if (g_stat (file, &buf) == 0)
+	{
+	  cached_icon_file f = { buf.st_mtime, buf.st_size, file };
+	  g_array_append_val (files, f);
+	  total_size += buf.st_size;
+	}
+      else
+	g_free (file);
+    }
+  g_dir_close (d);
+  g_free (dir);
+
+  if (total_size > MAX_ICON_CACHE_SIZE)
+    {
+      g_array_sort (files, compare_cached_icon_files);
+      for (guint i = 0;
+	   i < files->len && total_size > (MAX_ICON_CACHE_SIZE * 3) / 4;
+	   i++)
+	{
+	  cached_icon_file *f = &g_array_index (files, cached_icon_file, i);
+	  if (g_unlink (f->name) == 0)
+	    total_size -= f->size;
+	}
+    }
+
+  for (guint i = 0; i < files->len; i++)
+    g_free (g_array_index (files, cached_icon_file, i).name);
+  g_array_free (files, TRUE);
+}
+
+static void
+write_cached_icon (const char *hash, const char *base64)
+{
+  static bool trimmed = false;
+
+  if (!trimmed)
+    {
+      trim_icon_cache_files ();
+      trimmed = true;
+    }
+
+  char *file = icon_cache_file (hash, true);
+
+  if (file)
+    g_file_set_contents (file, base64, -1, NULL);
+  g_free (file);
+}
+
+static void
+remember_icon (const char *hash, GdkPixbuf *icon)
+{
+  if (icon_cache == NULL)
+    icon_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+					g_free, unref_icon);
+
+  g_hash_table_replace (icon_cache, g_strdup (hash), icon);
+}
+
+static void
+want_icon (const char *hash, package_info *pi, int which)
+{
+  icon_waiter *w = new icon_waiter;
+  w->pi = pi;
+  w->which = which;
+  pi->ref ();
+
+  /* When the icon has already been asked for, we just wait for it
+     together with the others.
+  */
+  gpointer value;
+  if (icons_requested
+      && g_hash_table_lookup_extended (icons_requested, hash, NULL, &value))
+    {
+      g_hash_table_insert (icons_requested, g_strdup (hash),
+			   g_slist_prepend ((GSList *) value, w));
+      return;
+    }
+
+  if (icons_wanted == NULL)
+    icons_wanted = g_hash_table_new_full (g_str_hash, g_str_equal,
+					  g_free, NULL);
+
+  GSList *waiters = (GSList *) g_hash_table_lookup (icons_wanted, hash);
+  g_hash_table_replace (icons_wanted, g_strdup (hash),
+			g_slist_prepend (waiters, w));
+}
+
+/* Return a new reference to the icon with the given HASH, or NULL.
+   When we don't have the icon yet, PI is put on the list of packages
+   that wait for it and will get it as its WHICH icon when it
+   arrives.
+*/
+static GdkPixbuf *
+find_icon (const char *hash, package_info *pi, int which)
+{
+  gpointer value;
+  GdkPixbuf *icon;
+
+  if (hash == NULL || !valid_icon_hash (hash))
+    return NULL;
+
+  if (icon_cache
+      && g_hash_table_lookup_extended (icon_cache, hash, NULL, &value))
+    icon = (GdkPixbuf *) value;
+  else
+    {
+      char *base64 = read_cached_icon (hash);
+      if (base64 == NULL)
+	{
+	  want_icon (hash, pi, which);
+	  return NULL;
+	}
+
+      icon = pixbuf_from_base64 (base64);
+      g_free (base64);
+      remember_icon (hash, icon);
+    }
+
+  if (icon)
+    g_object_ref (icon);
+  return icon;
+}
+
+static void
+set_waiting_icon (gpointer data, gpointer user_data)
+{
+  icon_waiter *w = (icon_waiter *) data;
+  GdkPixbuf *icon = (GdkPixbuf *) user_data;
+
+  if (icon)
+    {
+      if (w->which & ICON_INSTALLED)
+	{
+	  if (w->pi->installed_icon)
+	    g_object_unref (w->pi->installed_icon);
+	  w->pi->installed_icon = GDK_PIXBUF (g_object_ref (icon));
+	}
+      if (w->which & ICON_AVAILABLE)
+	{
+	  if (w->pi->available_icon)
+	    g_object_unref (w->pi->available_icon);
+	  w->pi->available_icon = GDK_PIXBUF (g_object_ref (icon));
+	}
+      global_package_info_changed (w->pi);
+    }
+
+  w->pi->unref ();
+  delete w;
+}
+
+static void
+get_icons_reply (int cmd, apt_proto_decoder *dec, void *data)
+{
+  char **hashes = (char **) data;
+
+  for (int i = 0; hashes[i]; i++)
+    {
+      const char *hash = hashes[i];
+      GdkPixbuf *icon = NULL;
+
+      if (dec)
+	{
+	  const char *base64 = dec->decode_string_in_place ();
+	  if (base64 && !dec->corrupted ())
+	    {
+	      icon = pixbuf_from_base64 (base64);
+	      if (icon)
+		write_cached_icon (hash, base64);
+	      remember_icon (hash, icon);
+	    }
+	}
+
+      GSList *waiters =
+	(GSList *) g_hash_table_lookup (icons_requested, hash);
+      g_hash_table_remove (icons_requested, hash);
+      g_slist_foreach (waiters, set_waiting_icon, icon);
+      g_slist_free (waiters);
+    }
+
+  g_strfreev (hashes);
+}
+
+static gboolean
+steal_icon_request (gpointer key, gpointer value, gpointer data)
+{
+  char ***ptr = (char ***) data;
+
+  g_hash_table_insert (icons_requested, key, value);
+  *(*ptr)++ = g_strdup ((const char *) key);
+  return TRUE;
+}
+
+/* Request all icons that are wanted right now.  From now on, they
+   are waited for in ICONS_REQUESTED until the reply arrives.
+*/
+static void
+get_wanted_icons ()
+{
+  if (icons_wanted == NULL || g_hash_table_size (icons_wanted) == 0)
+    return;
+
+  if (icons_requested == NULL)
+    icons_requested = g_hash_table_new_full (g_str_hash, g_str_equal,
+					     g_free, NULL);
+
+  char **hashes = g_new (char *, g_hash_table_size (icons_wanted) + 1);
+  char **ptr = hashes;
+  g_hash_table_foreach_steal (icons_wanted, steal_icon_request, &ptr);
+  *ptr = NULL;
+
+  apt_worker_get_icons ((const char **) hashes, get_icons_reply, hashes);
+}
+
 static package_info *
 get_package_list_entry (apt_proto_decoder *dec)
 {
@@ -905,15 +1248,8 @@ get_package_list_entry (apt_proto_decoder *dec)
   available_icon = dec->decode_string_in_place ();
   info->flags = dec->decode_int ();
   
-  info->installed_icon = pixbuf_from_base64 (installed_icon);
-  if (available_icon)
-    info->available_icon = pixbuf_from_base64 (available_icon);
-  else
-    {
-      info->available_icon = info->installed_icon;
-      if (info->available_icon)
-	g_object_ref (info->available_icon);
-    }
+  info->installed_icon = find_icon (installed_icon, info, ICON_INSTALLED);
+  info->available_icon = find_icon (available_icon, info, ICON_AVAILABLE);
 
   return info;
 }
@@ -941,60 +1277,95 @@ package_visible (package_info *pi, bool installed)
 			  : pi->available_section);
 }
 
+/* All packages of the current package list, by name, and the
+   generation of that list in apt-worker.  With these, we only need
+   to ask apt-worker for the changes when the list needs to be
+   refreshed.  See GET_PACKAGE_LIST_DELTA.
+*/
+static GHashTable *package_list_table = NULL;
+static int package_list_generation = -1;
+
 static void
-get_package_list_reply (int cmd, apt_proto_decoder *dec, void *data)
+unref_package_info (gpointer data)
 {
-  gpl_closure *c = (gpl_closure *)data;
+  ((package_info *)data)->unref ();
+}
 
-  hide_updating ();
+static void
+remember_package_list_entry (package_info *info)
+{
+  if (package_list_table == NULL)
+    package_list_table = g_hash_table_new_full (g_str_hash, g_str_equal,
+						NULL, unref_package_info);
 
-  if (dec == NULL)
-    ;
-  else if (dec->decode_int () == 0)
-    what_the_fock_p ();
-  else
-    {
-      section_info *all_si = create_section_info (NULL, SECTION_RANK_ALL, NULL);
+  info->ref ();
+  g_hash_table_replace (package_list_table, info->name, info);
+}
 
-      while (!dec->at_end ())
+static void
+forget_package_list_table ()
+{
+  package_list_generation = -1;
+  if (package_list_table)
+    g_hash_table_remove_all (package_list_table);
+}
+
+static void
+add_package_list_entry (package_info *info, section_info *all_si)
+{
+  if (info->available_version
+      && package_visible (info, false))
+    {
+      if (info->installed_version)
 	{
-	  package_info *info = NULL;
+	  info->ref ();
+	  upgradeable_packages = g_list_prepend (upgradeable_packages,
+						 info);
+	}
+      else
+	{
+	  section_info *sec =
+	    create_section_info (&install_sections,
+				 SECTION_RANK_NORMAL,
+				 info->available_section);
+	  info->ref ();
+	  sec->packages = g_list_prepend (sec->packages, info);
+
+	  info->ref ();
+	  all_si->packages = g_list_prepend (all_si->packages, info);
+	}
+    }
 
-	  info = get_package_list_entry (dec);
+  if (info->installed_version
+      && package_visible (info, true))
+    {
+      info->ref ();
+      installed_packages = g_list_prepend (installed_packages,
+					   info);
+    }
+}
 
-	  if (info->available_version
-	      && package_visible (info, false))
-	    {
-	      if (info->installed_version)
-		{
-		  info->ref ();
-		  upgradeable_packages = g_list_prepend (upgradeable_packages,
-							 info);
-		}
-	      else
-		{
-		  section_info *sec =
-		    create_section_info (&install_sections,
-					 SECTION_RANK_NORMAL,
-					 info->available_section);
-		  info->ref ();
-		  sec->packages = g_list_prepend (sec->packages, info);
-
-		  info->ref ();
-		  all_si->packages = g_list_prepend (all_si->packages, info);
-		}
-	    }
+static void
+add_package_list_entries (apt_proto_decoder *dec, section_info *all_si)
+{
+  while (!dec->at_end ())
+    {
+      package_info *info = get_package_list_entry (dec);
+      remember_package_list_entry (info);
+      add_package_list_entry (info, all_si);
+      info->unref ();
+    }
 
-	  if (info->installed_version
-	      && package_visible (info, true))
-	    {
-	      info->ref ();
-	      installed_packages = g_list_prepend (installed_packages,
-						   info);
-	    }
+  get_wanted_icons ();
+}
 
-	  info->unref ();
-	}
+static void
+finish_package_list (gpl_closure *c, bool success)
+{
+  if (success)
+    {
+      section_info *all_si = c->all_si;
+      c->all_si = NULL;
 
       if (g_list_length (all_si->packages) <= MAX_PACKAGES_NO_CATEGORIES)
 	{
@@ -1007,6 +1378,9 @@ get_package_list_reply (int cmd, apt_proto_decoder *dec, void *data)
 	all_si->unref ();
     }
 
+  if (c->all_si)
+    c->all_si->unref ();
+
   pkg_list_state = pkg_list_ready;
 
   /* Refresh view after sorting only if not in the main view */
@@ -1033,12 +1407,159 @@ get_package_list_reply (int cmd, apt_proto_decoder *dec, void *data)
   delete c;
 }
 
+static void
+get_package_list_reply (int cmd, apt_proto_decoder *dec, void *data)
+{
+  gpl_closure *c = (gpl_closure *)data;
+
+  if (!c->updating_hidden)
+    {
+      hide_updating ();
+      c->updating_hidden = true;
+    }
+
+  if (cmd == APTCMD_PARTIAL && dec != NULL)
+    {
+      /* A piece of a streamed list.  We show the first piece in the
+	 package list views so that the user has something to look at
+	 right away, and then wait for the whole list.  The "All"
+	 section is only added once the list is complete.
+      */
+      if (dec->decode_int () == 0)
+	return;
+
+      if (c->all_si == NULL)
+	c->all_si = create_section_info (NULL, SECTION_RANK_ALL, NULL);
+      add_package_list_entries (dec, c->all_si);
+
+      if (!c->partial_shown
+	  && cur_view_struct != &main_view
+	  && cur_view_struct != &search_results_view)
+	{
+	  sort_all_packages (true);
+	  c->partial_shown = true;
+	}
+      return;
+    }
+
+  if (dec == NULL)
+    {
+      forget_package_list_table ();
+      finish_package_list (c, false);
+    }
+  else if (dec->decode_int () == 0)
+    {
+      forget_package_list_table ();
+      what_the_fock_p ();
+      finish_package_list (c, false);
+    }
+  else
+    {
+      if (c->all_si == NULL)
+	c->all_si = create_section_info (NULL, SECTION_RANK_ALL, NULL);
+      add_package_list_entries (dec, c->all_si);
+      finish_package_list (c, true);
+    }
+}
+
+static void
+readd_package_list_entry (gpointer key, gpointer value, gpointer data)
+{
+  package_info *info = (package_info *)value;
+  section_info *all_si = (section_info *)data;
+
+  add_package_list_entry (info, all_si);
+}
+
+static void
+get_full_package_list (gpl_closure *c)
+{
+  apt_worker_get_package_list (!(red_pill_mode && red_pill_show_all),
+			       false, 
+			       false, 
+			       NULL,
+			       red_pill_mode && red_pill_show_magic_sys,
+			       true,
+			       get_package_list_reply, c);
+}
+
+static void
+get_package_list_delta_reply (int cmd, apt_proto_decoder *dec, void *data)
+{
+  gpl_closure *c = (gpl_closure *)data;
+
+  if (dec == NULL)
+    {
+      get_package_list_reply (cmd, dec, c);
+      return;
+    }
+
+  int generation = dec->decode_int ();
+  bool delta = dec->decode_int ();
+
+  if (delta && !dec->corrupted () && package_list_table)
+    {
+      while (dec->decode_int () == 1)
+	{
+	  package_info *info = get_package_list_entry (dec);
+	  remember_package_list_entry (info);
+	  info->unref ();
+	}
+      get_wanted_icons ();
+
+      const char *name;
+      while ((name = dec->decode_string_in_place ()))
+	g_hash_table_remove (package_list_table, name);
+
+      /* The installable status, download size, and details of these
+	 depend on packages that have changed, and must be fetched
+	 again.
+      */
+      while ((name = dec->decode_string_in_place ()))
+	{
+	  package_info *info = (package_info *)
+	    g_hash_table_lookup (package_list_table, name);
+	  if (info)
+	    {
+	      info->have_info = false;
+	      info->have_detail_kind = no_details;
+	    }
+	}
+
+      if (!dec->corrupted ())
+	{
+	  if (!c->updating_hidden)
+	    {
+	      hide_updating ();
+	      c->updating_hidden = true;
+	    }
+
+	  package_list_generation = generation;
+
+	  c->all_si = create_section_info (NULL, SECTION_RANK_ALL, NULL);
+	  g_hash_table_foreach (package_list_table,
+				readd_package_list_entry, c->all_si);
+	  finish_package_list (c, true);
+	  return;
+	}
+    }
+
+  /* We need the full list.
+   */
+  forget_package_list_table ();
+  package_list_generation = generation;
+  get_full_package_list (c);
+}
+
 void
 get_package_list_with_cont (void (*cont) (void *data), void *data)
 {
   gpl_closure *c = new gpl_closure;
   c->cont = cont;
   c->data = data;
+  c->all_si = NULL;
+  c->updating_hidden = false;
+  c->partial_shown = false;
 
   clear_global_package_list ();
   clear_global_section_list ();
@@ -1051,12 +1572,12 @@ get_package_list_with_cont (void (*cont) (void *data), void *data)
   free_all_packages ();
 
   show_updating ();
-  apt_worker_get_package_list (!(red_pill_mode && red_pill_show_all),
-			       false, 
-			       false, 
-			       NULL,
-			       red_pill_mode && red_pill_show_magic_sys,
-			       get_package_list_reply, c);
+  apt_worker_get_package_list_delta (package_list_generation,
+				     !(red_pill_mode && red_pill_show_all),
+				     false,
+				     false,
+				     red_pill_mode && red_pill_show_magic_sys,
+				     get_package_list_delta_reply, c);
 }
 
 void
@@ -1120,19 +1641,116 @@ gpi_reply  (int cmd, apt_proto_decoder *dec, void *clos)
   pi->unref ();
 }
 
+/* GET_PACKAGE_INFO_BATCH
+
+   Take up to MAX_PACKAGE_INFO_BATCH packages from *NEXT that need
+   their info, advance *NEXT past them, and get the info for all of
+   them with a single APTCMD_GET_PACKAGE_INFOS request with the given
+   PRIORITY.  CONT is
+   called with CHANGED set to true when the reply has been processed.
+   When none of the packages needs its info, CONT is called right away
+   with CHANGED set to false.
+ */
+
+#define MAX_PACKAGE_INFO_BATCH 50
+
+struct gpib_closure {
+  GList *batch;
+  void (*cont) (bool changed, void *data);
+  void *data;
+};
+
+static void gpib_reply (int cmd, apt_proto_decoder *dec, void *clos);
+
+static void
+get_package_info_batch (GList **next,
+			bool only_basic_info,
+			int priority,
+			void (*cont) (bool changed, void *data),
+			void *data)
+{
+  GList *batch = NULL;
+  int n = 0;
+
+  while (*next && n < MAX_PACKAGE_INFO_BATCH)
+    {
+      package_info *pi = (package_info *)(*next)->data;
+      *next = (*next)->next;
+
+      if (pi->have_info && only_basic_info)
+	continue;
+
+      pi->ref ();
+      batch = g_list_prepend (batch, pi);
+      n++;
+    }
+
+  if (batch == NULL)
+    {
+      cont (false, data);
+      return;
+    }
+
+  batch = g_list_reverse (batch);
+
+  const char **names = g_new (const char *, n + 1);
+  n = 0;
+  for (GList *p = batch; p; p = p->next)
+    names[n++] = ((package_info *)p->data)->name;
+  names[n] = NULL;
+
+  gpib_closure *c = new gpib_closure;
+  c->batch = batch;
+  c->cont = cont;
+  c->data = data;
+
+  apt_worker_get_package_infos (names, only_basic_info, priority,
+				gpib_reply, c);
+  g_free (names);
+}
+
+static void
+gpib_reply (int cmd, apt_proto_decoder *dec, void *clos)
+{
+  gpib_closure *c = (gpib_closure *)clos;
+  void (*cont) (bool, void *) = c->cont;
+  void *data = c->data;
+  GList *batch = c->batch;
+  delete c;
+
+  for (GList *p = batch; p; p = p->next)
+    {
+      package_info *pi = (package_info *)p->data;
+
+      pi->have_info = false;
+      if (dec)
+	{
+	  dec->decode_mem (&(pi->info), sizeof (pi->info));
+	  if (!dec->corrupted ())
+	    {
+	      pi->have_info = true;
+	      global_package_info_changed (pi);
+	    }
+	}
+    }
+
+  free_packages (batch);
+
+  cont (true, data);
+}
+
 /* GET_PACKAGE_INFOS
  */
 
 struct gpis_closure
 {
-  GList *package_list;
   GList *current_node;
   bool only_basic_info;
   void (*cont) (void *);
   void *data;
 };
 
-static void gpis_loop (package_info *pi, void *data, bool unused);
+static void gpis_loop (bool unused, void *data);
 
 void
 get_package_infos (GList *package_list,
@@ -1141,17 +1759,16 @@ get_package_infos (GList *package_list,
 		   void *data)
 {
   gpis_closure *clos = new gpis_closure;
-  clos->package_list = package_list;
   clos->current_node = package_list;
   clos->only_basic_info = only_basic_info;
   clos->cont = cont;
   clos->data = data;
 
-  gpis_loop (NULL, clos, TRUE);
+  gpis_loop (true, clos);
 }
 
 static void
-gpis_loop (package_info *pi, void *data, bool unused)
+gpis_loop (bool unused, void *data)
 {
   gpis_closure *clos = (gpis_closure *)data;
 
@@ -1161,20 +1778,23 @@ gpis_loop (package_info *pi, void *data, bool unused)
       delete clos;
     }
   else
-    {
-      GList *current_package_node = clos->current_node;
-      clos->current_node = g_list_next (clos->current_node);
-      get_package_info ((package_info *) current_package_node->data,
-			clos->only_basic_info,
-			gpis_loop, clos);
-    }
+    get_package_info_batch (&clos->current_node,
+			    clos->only_basic_info,
+			    apt_worker_priority_normal,
+			    gpis_loop, clos);
 }
 
 /* GET_PACKAGE_INFOS_IN_BACKGROUND
+
+   The packages are handled in batches with background priority, so
+   that interactive requests only have to wait for the batch that is
+   currently being processed by apt-worker, if any.  The next batch is
+   only requested when the previous one is done, and waits behind any
+   other request that has been made in the meantime.
  */
 
 static void gpiib_trigger ();
-static void gpiib_done (package_info *pi, void *unused, bool changed);
+static void gpiib_done (bool changed, void *unused);
 
 static GList *gpiib_next;
 
@@ -1188,18 +1808,14 @@ get_package_infos_in_background (GList *packages)
 static void
 gpiib_trigger ()
 {
-  GList *n = gpiib_next;
-  if (n)
-    {
-      package_info *pi = (package_info *)n->data;
-      gpiib_next = n->next;
-      get_package_info (pi, true,
-			gpiib_done, NULL);
-    }
+  if (gpiib_next)
+    get_package_info_batch (&gpiib_next, true,
+			    apt_worker_priority_background,
+			    gpiib_done, NULL);
 }
 
 static void 
-gpiib_done (package_info *pi, void *data, bool changed)
+gpiib_done (bool changed, void *data)
 {
   gpiib_trigger ();
 
@@ -1762,7 +2378,11 @@ make_install_applications_view (view *v)
   if (package_list_ready)
     gtk_widget_show (view);
 
-  maybe_refresh_package_cache_without_user ();
+  /* Don't start refreshing the cache while the package list is
+     still arriving.
+  */
+  if (pkg_list_state != pkg_list_retrieving)
+    maybe_refresh_package_cache_without_user ();
 
   return view;
 }
@@ -2155,6 +2775,7 @@ search_packages (const char *pattern, bool in_descriptions)
 				   only_available, 
 				   pattern,
 				   red_pill_mode && red_pill_show_magic_sys,
+				   false,
 				   search_packages_reply, parent);
     }
 }
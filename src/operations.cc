@@ -1468,6 +1468,23 @@ ip_download_cur_reply (int cmd, apt_proto_decoder *dec, void *data)
     ip_download_cur_retry_confirm (result_code, c);
 }
 
+/* The package whose archives the apt-worker should download while
+   the current one is being installed, or NULL.  System updates are
+   never prefetched: they have their own checks before downloading.
+*/
+static const char *
+ip_prefetch_name (ip_clos *c)
+{
+  if (!prefetch_packages || c->cur->next == NULL)
+    return NULL;
+
+  package_info *next = (package_info *)(c->cur->next->data);
+  if (next->info.install_flags & pkgflag_system_update)
+    return NULL;
+
+  return next->name;
+}
+
 static gboolean
 ip_kill_all_and_install_delayed (gpointer data)
 {
@@ -1487,6 +1504,7 @@ ip_kill_all_and_install_delayed (gpointer data)
       /* Continue the process */
       apt_worker_install_package (pi->name,
                                   c->alt_download_root,
+                                  ip_prefetch_name (c),
                                   ip_install_cur_reply, c);
     }
 
@@ -1552,6 +1570,7 @@ ip_install_cur_with_space_checked (int cmd, apt_proto_decoder *dec, void *data)
              SSU package is being installed */
           apt_worker_install_package (pi->name,
                                       c->alt_download_root,
+                                      ip_prefetch_name (c),
                                       ip_install_cur_reply, c);
         }
     }
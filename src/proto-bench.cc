@@ -0,0 +1,678 @@
+/*
+ * This file is part of the hildon-application-manager.
+ *
+ * Copyright (C) 2005, 2006, 2007, 2008 Nokia Corporation.  All Rights reserved.
+ *
+ * Contact: Marius Vollmer <marius.vollmer@nokia.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/* A benchmark for the apt-worker protocol codec, for sending a
+   package list through a pipe, and for xexp reading and writing.
+
+   Each benchmark prints one line with tab separated fields:
+
+     name  encoding  items  bytes  seconds  items_per_sec  mb_per_sec
+
+   preceded by a single header line starting with '#'.  The output
+   is meant to be collected and compared between releases.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+#include <glib.h>
+
+#include "apt-worker-proto.h"
+
+static int n_items = 5000;
+static int n_iterations = 20;
+
+static GOptionEntry entries[] = {
+  { "items", 'n', 0, G_OPTION_ARG_INT, &n_items,
+    "Number of packages or catalogues in the synthetic data", "N" },
+  { "iterations", 'i', 0, G_OPTION_ARG_INT, &n_iterations,
+    "How often to repeat each benchmark", "N" },
+  { NULL }
+};
+
+static const char *encoding_names[] = { "classic", "compact" };
+
+static const char *sections[] = {
+  "user/desktop", "user/utilities", "user/games", "user/system",
+  "user/office", "user/multimedia", "libs", "utils"
+};
+
+#define N_SECTIONS (sizeof (sections) / sizeof (sections[0]))
+
+static void
+report (const char *name, const char *encoding,
+	long items, long bytes, double seconds)
+{
+  if (seconds <= 0)
+    seconds = 1e-9;
+
+  printf ("%s\t%s\t%ld\t%ld\t%.6f\t%.0f\t%.2f\n",
+	  name, encoding ? encoding : "-", items, bytes, seconds,
+	  items / seconds, bytes / seconds / (1024 * 1024));
+}
+
+/* Synthetic data
+ */
+
+static xexp *
+make_catalogues (int n)
+{
+  xexp *x = xexp_list_new ("catalogues");
+
+  for (int i = 0; i < n; i++)
+    {
+      xexp *c = xexp_list_new ("catalogue");
+      char *name = g_strdup_printf ("Catalogue number %d", i);
+      char *uri = g_strdup_printf ("http://repository.example.com/repo%d", i);
+
+      xexp_aset_text (c, "name", name);
+      xexp_aset_text (c, "uri", uri);
+      xexp_aset_text (c, "dist", "fremantle");
+      xexp_aset_text (c, "components", "free non-free");
+      if (i % 4 == 0)
+	xexp_aset_bool (c, "disabled", 1);
+      xexp_cons (x, c);
+
+      g_free (name);
+      g_free (uri);
+    }
+
+  xexp_reverse (x);
+  return x;
+}
+
+static xexp *
+make_updates (int n)
+{
+  xexp *x = xexp_list_new ("updates");
+
+  for (int i = 0; i < n; i++)
+    {
+      char *pkg = g_strdup_printf ("package-%d", i);
+      xexp_cons (x, xexp_text_new ((i % 10 == 0)? "certified" : "other",
+				   pkg));
+      g_free (pkg);
+    }
+
+  return x;
+}
+
+/* Codec benchmarks
+ */
+
+static void
+bench_ints (int encoding)
+{
+  apt_proto_encoder enc;
+  apt_proto_decoder dec;
+  GTimer *timer = g_timer_new ();
+  long sum = 0;
+
+  enc.set_encoding (encoding);
+  dec.set_encoding (encoding);
+
+  g_timer_start (timer);
+  for (int it = 0; it < n_iterations; it++)
+    {
+      enc.reset ();
+      for (int i = 0; i < n_items; i++)
+	{
+	  enc.encode_int (i % 3 - 1);
+	  enc.encode_int (i);
+	  enc.encode_int64 ((int64_t)i * 1024);
+	}
+    }
+  report ("encode_int", encoding_names[encoding],
+	  3L * n_items * n_iterations, (long)enc.get_len () * n_iterations,
+	  g_timer_elapsed (timer, NULL));
+
+  g_timer_start (timer);
+  for (int it = 0; it < n_iterations; it++)
+    {
+      dec.reset (enc.get_buf (), enc.get_len ());
+      for (int i = 0; i < n_items; i++)
+	{
+	  sum += dec.decode_int ();
+	  sum += dec.decode_int ();
+	  sum += dec.decode_int64 ();
+	}
+    }
+  report ("decode_int", encoding_names[encoding],
+	  3L * n_items * n_iterations, (long)enc.get_len () * n_iterations,
+	  g_timer_elapsed (timer, NULL));
+
+  if (dec.corrupted () || sum == 0)
+    fprintf (stderr, "decode_int: wrong result\n");
+
+  g_timer_destroy (timer);
+}
+
+/* The strings are a mix of unique ones, like package names, repeated
+   ones, like sections and versions, and NULLs, as in a package list.
+*/
+static void
+bench_strings (int encoding)
+{
+  apt_proto_encoder enc;
+  apt_proto_decoder dec;
+  GTimer *timer = g_timer_new ();
+  char name[64], version[32];
+  char *copy;
+  long count = 0;
+
+  enc.set_encoding (encoding);
+  dec.set_encoding (encoding);
+
+  g_timer_start (timer);
+  for (int it = 0; it < n_iterations; it++)
+    {
+      enc.reset ();
+      for (int i = 0; i < n_items; i++)
+	{
+	  snprintf (name, sizeof (name), "package-%d", i);
+	  snprintf (version, sizeof (version), "1.%d-maemo%d", i % 7, i % 3);
+	  enc.encode_string (name);
+	  enc.encode_string (version);
+	  enc.encode_string (sections[i % N_SECTIONS]);
+	  enc.encode_string (NULL);
+	}
+    }
+  report ("encode_string", encoding_names[encoding],
+	  4L * n_items * n_iterations, (long)enc.get_len () * n_iterations,
+	  g_timer_elapsed (timer, NULL));
+
+  /* Decoding works in place and might modify the buffer, so we
+     decode from a copy.
+  */
+  copy = (char *)g_malloc (enc.get_len () + 1);
+
+  g_timer_start (timer);
+  for (int it = 0; it < n_iterations; it++)
+    {
+      memcpy (copy, enc.get_buf (), enc.get_len ());
+      dec.reset (copy, enc.get_len ());
+      while (!dec.at_end ())
+	{
+	  dec.decode_string_in_place ();
+	  count++;
+	}
+    }
+  report ("decode_string", encoding_names[encoding],
+	  count, (long)enc.get_len () * n_iterations,
+	  g_timer_elapsed (timer, NULL));
+
+  if (dec.corrupted ())
+    fprintf (stderr, "decode_string: corrupted\n");
+
+  g_free (copy);
+  g_timer_destroy (timer);
+}
+
+static void
+bench_xexp_codec (int encoding, const char *name, xexp *x)
+{
+  apt_proto_encoder enc;
+  apt_proto_decoder dec;
+  GTimer *timer = g_timer_new ();
+  char *copy;
+  char *enc_name = g_strdup_printf ("encode_xexp_%s", name);
+  char *dec_name = g_strdup_printf ("decode_xexp_%s", name);
+
+  enc.set_encoding (encoding);
+  dec.set_encoding (encoding);
+
+  g_timer_start (timer);
+  for (int it = 0; it < n_iterations; it++)
+    {
+      enc.reset ();
+      enc.encode_xexp (x);
+    }
+  report (enc_name, encoding_names[encoding],
+	  (long)xexp_length (x) * n_iterations,
+	  (long)enc.get_len () * n_iterations,
+	  g_timer_elapsed (timer, NULL));
+
+  copy = (char *)g_malloc (enc.get_len () + 1);
+
+  g_timer_start (timer);
+  for (int it = 0; it < n_iterations; it++)
+    {
+      memcpy (copy, enc.get_buf (), enc.get_len ());
+      dec.reset (copy, enc.get_len ());
+      xexp *y = dec.decode_xexp ();
+      if (y)
+	xexp_free (y);
+    }
+  report (dec_name, encoding_names[encoding],
+	  (long)xexp_length (x) * n_iterations,
+	  (long)enc.get_len () * n_iterations,
+	  g_timer_elapsed (timer, NULL));
+
+  if (dec.corrupted ())
+    fprintf (stderr, "%s: corrupted\n", dec_name);
+
+  g_free (copy);
+  g_free (enc_name);
+  g_free (dec_name);
+  g_timer_destroy (timer);
+}
+
+/* Package list benchmarks
+
+   A synthetic GET_PACKAGE_LIST response with one entry per package,
+   laid out like the ones that apt-worker sends.  About half of the
+   packages are installed and every fifth one has an update, so
+   versions, sections and descriptions repeat as in a real list.
+*/
+
+static void
+encode_package_list (apt_proto_encoder &enc)
+{
+  char name[64], version[32], new_version[32], pretty[64], desc[128];
+  char icon[41];
+
+  enc.reset ();
+  enc.encode_int (1);
+  for (int i = 0; i < n_items; i++)
+    {
+      bool installed = (i % 2 == 0);
+      bool available = !installed || (i % 5 == 0);
+      bool has_icon = (i % 3 == 0);
+
+      snprintf (name, sizeof (name), "package-%d", i);
+      snprintf (version, sizeof (version), "1.%d-maemo%d", i % 7, i % 3);
+      snprintf (new_version, sizeof (new_version), "2.%d-maemo%d",
+		i % 7, i % 3);
+      snprintf (pretty, sizeof (pretty), "Package %d", i);
+      snprintf (desc, sizeof (desc), "Short description of package %d", i);
+      snprintf (icon, sizeof (icon), "%040x", i);
+
+      enc.encode_string (name);
+      enc.encode_int (0);
+
+      enc.encode_string (installed? version : NULL);
+      enc.encode_int64 (installed? (int64_t)(i % 100) * 1024 : 0);
+      enc.encode_string (installed? sections[i % N_SECTIONS] : NULL);
+      enc.encode_string (installed && has_icon? pretty : NULL);
+      enc.encode_string (installed? desc : NULL);
+      enc.encode_string (installed && has_icon? icon : NULL);
+
+      enc.encode_string (available? new_version : NULL);
+      enc.encode_string (available? sections[i % N_SECTIONS] : NULL);
+      enc.encode_string (available && has_icon? pretty : NULL);
+      enc.encode_string (available && !installed? desc : NULL);
+      enc.encode_string (available && has_icon? icon : NULL);
+
+      enc.encode_int (0);
+    }
+}
+
+/* Decode the entries the way the frontend does, with copies of the
+   strings that it keeps.
+*/
+static int
+decode_package_list (apt_proto_decoder &dec)
+{
+  int count = 0;
+
+  if (dec.decode_int () != 1)
+    return 0;
+
+  while (!dec.at_end ())
+    {
+      free (dec.decode_string_dup ());
+      dec.decode_int ();
+      free (dec.decode_string_dup ());
+      dec.decode_int64 ();
+      free (dec.decode_string_dup ());
+      free (dec.decode_string_dup ());
+      free (dec.decode_string_dup ());
+      dec.decode_string_in_place ();
+      free (dec.decode_string_dup ());
+      free (dec.decode_string_dup ());
+      free (dec.decode_string_dup ());
+      free (dec.decode_string_dup ());
+      dec.decode_string_in_place ();
+      dec.decode_int ();
+      if (dec.corrupted ())
+	return 0;
+      count++;
+    }
+
+  return count;
+}
+
+static void
+bench_package_list (int encoding)
+{
+  apt_proto_encoder enc;
+  apt_proto_decoder dec;
+  GTimer *timer = g_timer_new ();
+  char *copy;
+  long count = 0;
+
+  enc.set_encoding (encoding);
+  dec.set_encoding (encoding);
+
+  g_timer_start (timer);
+  for (int it = 0; it < n_iterations; it++)
+    encode_package_list (enc);
+  report ("encode_package_list", encoding_names[encoding],
+	  (long)n_items * n_iterations, (long)enc.get_len () * n_iterations,
+	  g_timer_elapsed (timer, NULL));
+
+  copy = (char *)g_malloc (enc.get_len () + 1);
+
+  g_timer_start (timer);
+  for (int it = 0; it < n_iterations; it++)
+    {
+      memcpy (copy, enc.get_buf (), enc.get_len ());
+      dec.reset (copy, enc.get_len ());
+      count += decode_package_list (dec);
+    }
+  report ("decode_package_list", encoding_names[encoding],
+	  count, (long)enc.get_len () * n_iterations,
+	  g_timer_elapsed (timer, NULL));
+
+  if (count != (long)n_items * n_iterations)
+    fprintf (stderr, "decode_package_list: wrong result\n");
+
+  g_free (copy);
+  g_timer_destroy (timer);
+}
+
+/* Transfer benchmark
+
+   apt-worker writes its responses into a fifo that the frontend
+   reads.  This sends the synthetic package list through a pipe to a
+   child process, which reads all of it and acknowledges it with one
+   byte, so that each transfer includes the context switches of the
+   real thing.
+*/
+
+static bool
+write_all (int fd, const char *buf, int len)
+{
+  while (len > 0)
+    {
+      ssize_t n = write (fd, buf, len);
+      if (n < 0 && errno == EINTR)
+	continue;
+      if (n <= 0)
+	return false;
+      buf += n;
+      len -= n;
+    }
+  return true;
+}
+
+static bool
+read_all (int fd, char *buf, int len)
+{
+  while (len > 0)
+    {
+      ssize_t n = read (fd, buf, len);
+      if (n < 0 && errno == EINTR)
+	continue;
+      if (n <= 0)
+	return false;
+      buf += n;
+      len -= n;
+    }
+  return true;
+}
+
+static void
+bench_package_list_transfer (int encoding)
+{
+  apt_proto_encoder enc;
+  GTimer *timer = g_timer_new ();
+  int to_child[2], from_child[2];
+  char ack = 0;
+  pid_t pid;
+
+  enc.set_encoding (encoding);
+  encode_package_list (enc);
+  int len = enc.get_len ();
+
+  if (pipe (to_child) < 0 || pipe (from_child) < 0)
+    {
+      perror ("pipe");
+      exit (1);
+    }
+
+  fflush (stdout);
+  pid = fork ();
+  if (pid < 0)
+    {
+      perror ("fork");
+      exit (1);
+    }
+
+  if (pid == 0)
+    {
+      char *buf = (char *)g_malloc (len);
+
+      close (to_child[1]);
+      close (from_child[0]);
+      while (read_all (to_child[0], buf, len)
+	     && write_all (from_child[1], &ack, 1))
+	;
+      _exit (0);
+    }
+
+  close (to_child[0]);
+  close (from_child[1]);
+
+  g_timer_start (timer);
+  for (int it = 0; it < n_iterations; it++)
+    {
+      if (!write_all (to_child[1], enc.get_buf (), len)
+	  || !read_all (from_child[0], &ack, 1))
+	{
+	  fprintf (stderr, "transfer_package_list: lost the child\n");
+	  exit (1);
+	}
+    }
+  report ("transfer_package_list", encoding_names[encoding],
+	  (long)n_items * n_iterations, (long)len * n_iterations,
+	  g_timer_elapsed (timer, NULL));
+
+  close (to_child[1]);
+  close (from_child[0]);
+  waitpid (pid, NULL, 0);
+  g_timer_destroy (timer);
+}
+
+/* xexp file benchmarks
+ */
+
+static void
+bench_xexp_file (const char *name, xexp *x)
+{
+  GTimer *timer = g_timer_new ();
+  GError *error = NULL;
+  char *filename;
+  char *write_name = g_strdup_printf ("xexp_write_%s", name);
+  char *read_name = g_strdup_printf ("xexp_read_%s", name);
+  long bytes = 0;
+
+  int fd = g_file_open_tmp ("proto-bench-XXXXXX", &filename, &error);
+  if (fd < 0)
+    {
+      fprintf (stderr, "%s\n", error->message);
+      g_error_free (error);
+      exit (1);
+    }
+  close (fd);
+
+  g_timer_start (timer);
+  for (int it = 0; it < n_iterations; it++)
+    {
+      if (!xexp_write_file (filename, x))
+	exit (1);
+    }
+  g_timer_stop (timer);
+
+  FILE *f = fopen (filename, "r");
+  if (f)
+    {
+      fseek (f, 0, SEEK_END);
+      bytes = ftell (f);
+      fclose (f);
+    }
+
+  report (write_name, NULL,
+	  (long)xexp_length (x) * n_iterations, bytes * n_iterations,
+	  g_timer_elapsed (timer, NULL));
+
+  g_timer_start (timer);
+  for (int it = 0; it < n_iterations; it++)
+    {
+      xexp *y = xexp_read_file (filename);
+      if (y == NULL)
+	exit (1);
+      xexp_free (y);
+    }
+  report (read_name, NULL,
+	  (long)xexp_length (x) * n_iterations, bytes * n_iterations,
+	  g_timer_elapsed (timer, NULL));
+
+  unlink (filename);
+  g_free (filename);
+  g_free (write_name);
+  g_free (read_name);
+  g_timer_destroy (timer);
+}
+
+/* Cancellation benchmark
+
+   apt-worker checks for cancellation once per package while
+   encoding a package list.  This measures what that check costs
+   when nobody cancels, by reading the cancel fifo directly as
+   apt-worker used to do, and with an apt_proto_cancel_watch.
+*/
+
+static void
+bench_cancel_poll ()
+{
+  GTimer *timer = g_timer_new ();
+  apt_proto_cancel_watch watch;
+  unsigned char byte = 0;
+  long checks = (long)n_items * n_iterations;
+  long hits = 0;
+  int fds[2];
+
+  if (pipe (fds) < 0
+      || fcntl (fds[0], F_SETFL, O_RDONLY | O_NONBLOCK) < 0)
+    {
+      perror ("pipe");
+      exit (1);
+    }
+
+  g_timer_start (timer);
+  for (long i = 0; i < checks; i++)
+    if (read (fds[0], &byte, 1) == 1)
+      hits++;
+  report ("cancel_poll_read", NULL, checks, 0,
+	  g_timer_elapsed (timer, NULL));
+
+  if (!watch.watch (fds[0]))
+    {
+      perror ("cancel watch");
+      exit (1);
+    }
+  watch.drain ();
+
+  g_timer_start (timer);
+  for (long i = 0; i < checks; i++)
+    if (watch.cancelled ())
+      hits++;
+  report ("cancel_poll_watch", NULL, checks, 0,
+	  g_timer_elapsed (timer, NULL));
+
+  /* Make sure that the watch notices a cancellation.
+   */
+  if (write (fds[1], &byte, 1) != 1
+      || !watch.cancelled ()
+      || watch.cancelled ()
+      || hits != 0)
+    fprintf (stderr, "cancel_poll: wrong result\n");
+
+  close (fds[0]);
+  close (fds[1]);
+  g_timer_destroy (timer);
+}
+
+int
+main (int argc, char **argv)
+{
+  GOptionContext *context;
+  GError *error = NULL;
+
+  context = g_option_context_new ("- benchmark the apt-worker protocol and xexps");
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error))
+    {
+      fprintf (stderr, "%s\n", error->message);
+      g_error_free (error);
+      return 1;
+    }
+  g_option_context_free (context);
+
+  if (n_items <= 0 || n_iterations <= 0)
+    {
+      fprintf (stderr, "items and iterations must be positive\n");
+      return 1;
+    }
+
+  xexp *catalogues = make_catalogues (n_items);
+  xexp *updates = make_updates (n_items);
+
+  printf ("# name\tencoding\titems\tbytes\tseconds\titems_per_sec\tmb_per_sec\n");
+
+  for (int encoding = encoding_classic; encoding <= encoding_compact; encoding++)
+    {
+      bench_ints (encoding);
+      bench_strings (encoding);
+      bench_xexp_codec (encoding, "catalogues", catalogues);
+      bench_xexp_codec (encoding, "updates", updates);
+      bench_package_list (encoding);
+      bench_package_list_transfer (encoding);
+    }
+
+  bench_xexp_file ("catalogues", catalogues);
+  bench_xexp_file ("updates", updates);
+
+  bench_cancel_poll ();
+
+  xexp_free (catalogues);
+  xexp_free (updates);
+
+  return 0;
+}
@@ -44,6 +44,7 @@ bool clean_after_install = true;
 bool assume_connection = false;
 bool break_locks = false;
 bool download_packages_to_mmc = true;
+bool prefetch_packages = true;
 bool use_apt_algorithms = false;
 bool red_pill_mode = false;
 bool red_pill_show_deps = true;
@@ -97,6 +98,8 @@ load_settings ()
 	    break_locks = val;
 	  else if (sscanf (line, "download-packages-to-mmc %d", &val) == 1)
 	    download_packages_to_mmc = val;
+	  else if (sscanf (line, "prefetch-packages %d", &val) == 1)
+	    prefetch_packages = val;
 	  else if (sscanf (line, "use-apt-algorithms %d", &val) == 1)
 	    use_apt_algorithms = val;
 	  else if (sscanf (line, "red-pill-mode %d", &val) == 1)
@@ -148,6 +151,7 @@ save_settings ()
       fprintf (f, "package-sort-sign %d\n", package_sort_sign);
       fprintf (f, "break-locks %d\n", break_locks);
       fprintf (f, "download-packages-to-mmc %d\n", download_packages_to_mmc);
+      fprintf (f, "prefetch-packages %d\n", prefetch_packages);
       fprintf (f, "use-apt-algorithms %d\n", use_apt_algorithms);
       fprintf (f, "red-pill-mode %d\n", red_pill_mode);
       fprintf (f, "red-pill-show-deps %d\n", red_pill_show_deps);
@@ -177,6 +181,7 @@ enum boolean_options {
   OPT_SHOW_MAGIC_SYS,
   OPT_INCLUDE_DETAILS_IN_LOG,
   OPT_DOWNLOAD_PACKAGES_TO_MMC,
+  OPT_PREFETCH_PACKAGES,
   OPT_CHECK_ALWAYS,
   OPT_IGNORE_WRONG_DOMAINS,
   OPT_IGNORE_THIRDPARTY_POLICY,
@@ -243,6 +248,9 @@ make_settings_tab (settings_closure *c)
   make_boolean_option (c, vbox, group, OPT_DOWNLOAD_PACKAGES_TO_MMC,
 		       "Use MMC to download packages",
 		       &download_packages_to_mmc);
+  make_boolean_option (c, vbox, group, OPT_PREFETCH_PACKAGES,
+		       "Download next package while installing",
+		       &prefetch_packages);
   make_boolean_option (c, vbox, group, OPT_CHECK_ALWAYS,
 		       "Always check for updates",
 		       &red_pill_check_always);
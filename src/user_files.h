@@ -40,6 +40,7 @@ extern "C" {
 #define UFILE_AVAILABLE_NOTIFICATIONS_TMP   UFILE_AVAILABLE_NOTIFICATIONS ".tmp"
 #define UFILE_BOOT "boot"
 #define UFILE_LAST_UPDATE "last-update"
+#define UFILE_ICON_CACHE "icons"
 
 gchar *user_file_get_state_dir_path ();
 FILE *user_file_open_for_read (const gchar *name);